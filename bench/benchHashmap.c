@@ -0,0 +1,225 @@
+//
+// Created by paul on 10/17/26.
+//
+
+/*
+ * Compares tHashMap with the fixed-bucket map it replaced, on paths shaped
+ * like a media library's. Built only with -DBUILD_BENCHMARKS=ON:
+ *     benchHashmap [count] [rounds]
+ * The old map only compared hashes, so its lookups are a little flattered:
+ * the new one also checks each path, as the pathMap does.
+ */
+
+#include "processNewFiles.h"
+
+#define kOldBucketCount 256
+
+/* the map as it was, so there's something to compare against */
+typedef struct {
+    unsigned int    count;
+    tHashEntry      entries[];
+} tOldBucket;
+
+typedef struct {
+    tOldBucket *    bucket[ kOldBucketCount ];
+} tOldHashMap;
+
+static unsigned short oldBucketIndex( tHash hash )
+{
+    unsigned short index = 0;
+    while ( hash > 0 ) {
+        index ^= ( hash & 0xFF );
+        hash >>= 8;
+    }
+    return index;
+}
+
+static tError oldHashMapAdd( tOldHashMap * hashmap, tHash hash, void * value )
+{
+    unsigned short index  = oldBucketIndex( hash );
+    tOldBucket *   bucket = hashmap->bucket[ index ];
+    if ( bucket == NULL ) {
+        bucket = calloc( 1, sizeof( tOldBucket ) + 8 * sizeof( tHashEntry ) );
+        if ( bucket == NULL ) return -ENOMEM;
+        bucket->count = 8;
+        hashmap->bucket[ index ] = bucket;
+    }
+
+    for ( unsigned int i = 0; i < bucket->count; ++i ) {
+        if ( bucket->entries[ i ].value == NULL ) {
+            bucket->entries[ i ].hash  = hash;
+            bucket->entries[ i ].value = value;
+            return 0;
+        }
+        if ( i + 1 >= bucket->count ) {
+            bucket = realloc( bucket, sizeof( tOldBucket ) + ( bucket->count + 8 ) * sizeof( tHashEntry ) );
+            if ( bucket == NULL ) return -ENOMEM;
+            memset( &bucket->entries[ bucket->count ], 0, 8 * sizeof( tHashEntry ) );
+            bucket->count += 8;
+            hashmap->bucket[ index ] = bucket;
+        }
+    }
+    return 0;
+}
+
+static tError oldHashMapFind( tOldHashMap * hashmap, tHash hash, void ** value )
+{
+    tOldBucket * bucket = hashmap->bucket[ oldBucketIndex( hash ) ];
+    if ( bucket != NULL ) {
+        for ( unsigned int i = 0; i < bucket->count; ++i ) {
+            if ( bucket->entries[ i ].hash == hash ) {
+                *value = bucket->entries[ i ].value;
+                return 0;
+            }
+        }
+    }
+    return -ENOENT;
+}
+
+static tError oldHashMapRemove( tOldHashMap * hashmap, tHash hash )
+{
+    tOldBucket * bucket = hashmap->bucket[ oldBucketIndex( hash ) ];
+    if ( bucket != NULL ) {
+        for ( unsigned int i = 0; i < bucket->count; ++i ) {
+            if ( bucket->entries[ i ].hash == hash ) {
+                for ( ; i < bucket->count - 1; ++i ) {
+                    bucket->entries[ i ] = bucket->entries[ i + 1 ];
+                }
+                bucket->entries[ i ].value = NULL;
+                return 0;
+            }
+        }
+    }
+    return -ENOENT;
+}
+
+static void oldFreeHashMap( tOldHashMap * hashmap )
+{
+    for ( unsigned int i = 0; i < kOldBucketCount; ++i ) {
+        free( hashmap->bucket[ i ] );
+    }
+    free( hashmap );
+}
+
+
+/* as inotify.c calculates it */
+static tHash calcHash( const char * string )
+{
+    tHash hash = 0xDeadBeef;
+    while ( *string != '\0' ) {
+        hash = (hash * 43) ^ *string++;
+    }
+    return hash;
+}
+
+typedef struct {
+    const char *    path;
+    tHash           hash;
+} tBenchNode;
+
+static bool benchPathMatches( const void * value, const void * key )
+{
+    return strcmp( ((const tBenchNode *)value)->path, (const char *)key ) == 0;
+}
+
+static double nsSince( const struct timespec * start, unsigned long operations )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    double ns = (double)( now.tv_sec - start->tv_sec ) * 1e9 + (double)( now.tv_nsec - start->tv_nsec );
+    return ns / (double)operations;
+}
+
+
+int main( int argc, char * argv[] )
+{
+    unsigned long count  = ( argc > 1 ) ? strtoul( argv[1], NULL, 10 ) : 200000;
+    unsigned int  rounds = ( argc > 2 ) ? (unsigned int)strtoul( argv[2], NULL, 10 ) : 5;
+    if ( count == 0 || rounds == 0 ) {
+        fprintf( stderr, "usage: %s [count] [rounds]\n", argv[0] );
+        return 1;
+    }
+
+    tBenchNode * nodes = calloc( count, sizeof( tBenchNode ) );
+    if ( nodes == NULL ) return 1;
+
+    char path[ PATH_MAX ];
+    for ( unsigned long i = 0; i < count; ++i ) {
+        snprintf( path, sizeof( path ), "/mnt/library/TV/Show %lu/Season %lu/Episode %lu.mpg",
+                  i / 500, ( i / 20 ) % 25, i % 20 );
+        nodes[ i ].path = strdup( path );
+        nodes[ i ].hash = calcHash( nodes[ i ].path );
+    }
+
+    tHashMap *    map    = newHashMap( benchPathMatches );
+    tOldHashMap * oldMap = calloc( 1, sizeof( tOldHashMap ) );
+    if ( map == NULL || oldMap == NULL ) return 1;
+
+    struct timespec start;
+    void *          value;
+    unsigned long   wrong = 0;
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for ( unsigned long i = 0; i < count; ++i ) {
+        hashMapAdd( map, nodes[ i ].hash, &nodes[ i ] );
+    }
+    double insertNs = nsSince( &start, count );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for ( unsigned long i = 0; i < count; ++i ) {
+        oldHashMapAdd( oldMap, nodes[ i ].hash, &nodes[ i ] );
+    }
+    double oldInsertNs = nsSince( &start, count );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for ( unsigned int r = 0; r < rounds; ++r ) {
+        for ( unsigned long i = 0; i < count; ++i ) {
+            if ( hashMapFind( map, nodes[ i ].hash, nodes[ i ].path, &value ) != 0 || value != &nodes[ i ] ) ++wrong;
+        }
+    }
+    double findNs = nsSince( &start, count * rounds );
+
+    /* it can't tell colliding paths apart, so it may find the wrong node */
+    unsigned long oldWrong = 0;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for ( unsigned int r = 0; r < rounds; ++r ) {
+        for ( unsigned long i = 0; i < count; ++i ) {
+            if ( oldHashMapFind( oldMap, nodes[ i ].hash, &value ) != 0 || value != &nodes[ i ] ) ++oldWrong;
+        }
+    }
+    double oldFindNs = nsSince( &start, count * rounds );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for ( unsigned long i = 0; i < count; ++i ) {
+        if ( hashMapRemove( map, nodes[ i ].hash, nodes[ i ].path ) != 0 ) ++wrong;
+    }
+    double removeNs = nsSince( &start, count );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for ( unsigned long i = 0; i < count; ++i ) {
+        oldHashMapRemove( oldMap, nodes[ i ].hash );
+    }
+    double oldRemoveNs = nsSince( &start, count );
+
+    printf( "%lu paths, %u lookup rounds (ns per operation)\n", count, rounds );
+    printf( "          %10s %10s\n", "tHashMap", "buckets" );
+    printf( "insert    %10.1f %10.1f\n", insertNs, oldInsertNs );
+    printf( "lookup    %10.1f %10.1f\n", findNs, oldFindNs );
+    printf( "remove    %10.1f %10.1f\n", removeNs, oldRemoveNs );
+    if ( oldWrong > 0 ) {
+        printf( "the bucket map found the wrong node %lu times\n", oldWrong );
+    }
+
+    freeHashMap( map );
+    oldFreeHashMap( oldMap );
+    for ( unsigned long i = 0; i < count; ++i ) {
+        free( (void *)nodes[ i ].path );
+    }
+    free( nodes );
+
+    if ( wrong > 0 ) {
+        fprintf( stderr, "tHashMap failed %lu lookups or removals\n", wrong );
+        return 1;
+    }
+    return 0;
+}
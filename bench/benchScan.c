@@ -0,0 +1,302 @@
+//
+// Created by paul on 10/17/26.
+//
+
+/*
+ * Times the scans of a synthetic tree, and counts the syscalls they make,
+ * so the synchronous build can be compared with the io_uring one. Built
+ * only with -DBUILD_BENCHMARKS=ON, and run from each build in turn:
+ *     benchScan <dir> [files] [rounds]
+ * <dir> is filled with 'files' empty files, 1000 to a directory, unless it
+ * already has them. They're all recorded as processed first, so a deep scan
+ * stats every one of them, as does a periodic scan once the directory
+ * stamps are cleared.
+ *
+ * The syscalls are counted with the raw_syscalls:sys_enter tracepoint, which
+ * needs tracefs and permission to use perf events (e.g. root). Without them,
+ * only the times are reported.
+ */
+
+#include "processNewFiles.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "events.h"
+#include "inotify.h"
+#include "rescan.h"
+#include "stateStore.h"
+
+#define kFilesPerDir    1000
+
+tGlobals g;
+
+static struct {
+    bool            recording;  // the setup scan: record each file it finds as processed
+    unsigned long   found;      // files the timed scans found that need processing (should be none)
+} gBench;
+
+
+/**
+ * @brief open a counter of this process's syscalls
+ * @return -1 if they can't be counted
+ */
+static tFileDscr openSyscallCounter( void )
+{
+    static const char * const idPaths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+        NULL
+    };
+
+    unsigned long long id = 0;
+    for ( int i = 0; idPaths[ i ] != NULL && id == 0; ++i ) {
+        FILE * file = fopen( idPaths[ i ], "r" );
+        if ( file != NULL ) {
+            if ( fscanf( file, "%llu", &id ) != 1 ) id = 0;
+            fclose( file );
+        }
+    }
+    if ( id == 0 ) return -1;
+
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.type     = PERF_TYPE_TRACEPOINT;
+    attr.size     = sizeof( attr );
+    attr.config   = id;
+    attr.disabled = 1;
+
+    return (tFileDscr)syscall( SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC );
+}
+
+
+/**
+ * @brief make the synthetic tree, unless it's already there
+ * @param root
+ * @param files
+ * @return
+ */
+static tError makeTree( const char * root, unsigned long files )
+{
+    char path[ PATH_MAX ];
+
+    if ( mkdir( root, S_IRWXU ) == -1 && errno != EEXIST ) return -errno;
+
+    for ( unsigned long i = 0; i < files; ++i ) {
+        if ( i % kFilesPerDir == 0 ) {
+            snprintf( path, sizeof( path ), "%s/d%05lu", root, i / kFilesPerDir );
+            if ( mkdir( path, S_IRWXU ) == -1 ) {
+                if ( errno != EEXIST ) return -errno;
+                /* already made, by an earlier run */
+                i += kFilesPerDir - 1;
+                continue;
+            }
+        }
+        snprintf( path, sizeof( path ), "%s/d%05lu/f%05lu", root, i / kFilesPerDir, i % kFilesPerDir );
+        tFileDscr fd = open( path, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR );
+        if ( fd == -1 ) return -errno;
+        close( fd );
+    }
+    return 0;
+}
+
+
+/**
+ * @brief just enough of a tree for its scans and its state store
+ * @param root
+ * @return NULL if it couldn't be opened
+ */
+static tWatchedTree * openTree( const char * root )
+{
+    tWatchedTree * watchedTree = calloc( 1, sizeof( tWatchedTree ) );
+    char *         rootPath    = realpath( root, NULL );
+    char           seenPath[ PATH_MAX ];
+    if ( watchedTree == NULL || rootPath == NULL ) return NULL;
+
+    snprintf( seenPath, sizeof( seenPath ), "%s/.seen", rootPath );
+    mkdir( seenPath, S_IRWXU );
+
+    watchedTree->root.path    = rootPath;
+    watchedTree->root.pathLen = strlen( rootPath );
+    watchedTree->root.fd      = open( rootPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    watchedTree->seen.path    = strdup( seenPath );
+    watchedTree->seen.pathLen = strlen( seenPath );
+    watchedTree->seen.fd      = open( seenPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    watchedTree->pathMap      = newHashMap( fsNodePathMatches );
+    watchedTree->scan.stamps  = newHashMap( NULL );
+    pthread_mutex_init( &watchedTree->scan.stampLock, NULL );
+
+    struct stat info;
+    if ( watchedTree->root.fd == -1 || watchedTree->seen.fd == -1
+      || fstat( watchedTree->root.fd, &info ) == -1
+      || openStateStore( watchedTree ) != 0 ) {
+        return NULL;
+    }
+    watchedTree->scan.device = info.st_dev;
+
+    /* the stores are synced & closed through the list of trees */
+    g.treeList = newList();
+    listAppend( g.treeList, &watchedTree->queue );
+
+    return watchedTree;
+}
+
+
+/**
+ * @brief a scan's fScanFound. The files the setup scan finds are recorded as processed
+ */
+static void benchFound( tTreeScan * scan, const char * fullPath, tFSNodeType type )
+{
+    if ( type != kFile ) return;
+
+    if ( !gBench.recording ) {
+        ++gBench.found;
+        return;
+    }
+
+    tWatchedTree * watchedTree = scan->watchedTree;
+    const char *   relPath     = &fullPath[ watchedTree->root.pathLen + 1 ];
+    struct statx   info;
+    if ( statx( watchedTree->root.fd, relPath, 0, STATX_MTIME | STATX_SIZE, &info ) == 0 ) {
+        tFileRecord record = {
+            .state = kStateDone,
+            .mtime = statxNs( &info.stx_mtime ),
+            .size  = info.stx_size
+        };
+        storeUpdate( watchedTree->state, relPath, &record );
+        storeNoteDone( watchedTree->state, relPath, record.mtime, record.size );
+    }
+}
+
+
+/**
+ * @brief forget every directory's stamp, so a periodic scan looks at all the files
+ * @param watchedTree
+ */
+static void clearDirStamps( tWatchedTree * watchedTree )
+{
+    size_t index = 0;
+    void * stamp;
+    while ( ( stamp = hashMapNext( watchedTree->scan.stamps, &index ) ) != NULL ) {
+        free( stamp );
+    }
+    freeHashMap( watchedTree->scan.stamps );
+    watchedTree->scan.stamps = newHashMap( NULL );
+}
+
+
+/**
+ * @brief scan the whole tree, as the event loop would, but in one go
+ * @param watchedTree
+ * @param deep
+ * @param counter for the syscalls (-1 if they aren't counted)
+ * @param syscalls set to how many were made
+ * @param stats set to how many files were stat'ed
+ * @return how long it took, in milliseconds
+ */
+static double scanTree( tWatchedTree * watchedTree, bool deep, tFileDscr counter,
+                        unsigned long * syscalls, unsigned long * stats )
+{
+    struct timespec start, end;
+    tTreeScan       scan;
+
+    watchedTree->scan.deep       = deep;
+    watchedTree->scan.generation = deep ? storeNewGeneration( watchedTree->state ) : 0;
+    if ( !deep ) {
+        clearDirStamps( watchedTree );
+    }
+
+    if ( counter != -1 ) {
+        ioctl( counter, PERF_EVENT_IOC_RESET, 0 );
+        ioctl( counter, PERF_EVENT_IOC_ENABLE, 0 );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    initTreeScan( &scan, watchedTree );
+    scan.found = benchFound;
+    scan.queueDir( &scan, "" );
+    while ( scanSome( &scan, kScanSliceEntries ) ) { /* until it's done */ }
+
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    *syscalls = 0;
+    if ( counter != -1 ) {
+        uint64_t count = 0;
+        ioctl( counter, PERF_EVENT_IOC_DISABLE, 0 );
+        if ( read( counter, &count, sizeof( count ) ) == sizeof( count ) ) {
+            *syscalls = (unsigned long)count;
+        }
+    }
+    *stats = scan.count.stats;
+    freeTreeScan( &scan );
+
+    return (double)( end.tv_sec - start.tv_sec ) * 1e3 + (double)( end.tv_nsec - start.tv_nsec ) / 1e6;
+}
+
+
+int main( int argc, char * argv[] )
+{
+    if ( argc < 2 ) {
+        fprintf( stderr, "usage: %s <dir> [files] [rounds]\n", argv[0] );
+        return 1;
+    }
+    unsigned long files  = ( argc > 2 ) ? strtoul( argv[2], NULL, 10 ) : 100000;
+    unsigned int  rounds = ( argc > 3 ) ? (unsigned int)strtoul( argv[3], NULL, 10 ) : 5;
+
+    initLogStuff( "benchScan" );
+    setLogStuffDestination( kLogInfo, kLogToStderr );
+    g.timeout.deepScan = 1;
+
+    tError result = makeTree( argv[1], files );
+    if ( result != 0 ) {
+        fprintf( stderr, "unable to make the tree in \'%s\': %s\n", argv[1], strerror( -result ) );
+        return 1;
+    }
+    tWatchedTree * watchedTree = openTree( argv[1] );
+    if ( watchedTree == NULL ) {
+        fprintf( stderr, "unable to open \'%s\'\n", argv[1] );
+        return 1;
+    }
+
+    /* record every file as processed, and warm the caches */
+    unsigned long syscalls, stats;
+    gBench.recording = true;
+    scanTree( watchedTree, true, -1, &syscalls, &stats );
+    gBench.recording = false;
+    syncStateStores( true );
+
+    tFileDscr counter = openSyscallCounter();
+    if ( counter == -1 ) {
+        fprintf( stderr, "syscalls can't be counted here (%s), so only the times are reported\n",
+                 strerror( errno ) );
+    }
+
+#ifdef USE_IO_URING
+    const char * build = "io_uring";
+#else
+    const char * build = "synchronous";
+#endif
+    printf( "%s build, %lu files, best of %u rounds\n", build, files, rounds );
+
+    for ( int deep = 1; deep >= 0; --deep ) {
+        double        best        = 0;
+        unsigned long minSyscalls = 0;
+        for ( unsigned int r = 0; r < rounds; ++r ) {
+            double ms = scanTree( watchedTree, deep, counter, &syscalls, &stats );
+            if ( r == 0 || ms < best ) best = ms;
+            if ( r == 0 || syscalls < minSyscalls ) minSyscalls = syscalls;
+        }
+        printf( "%-8s scan: %8.1f ms, %8lu files stat'ed", deep ? "deep" : "periodic", best, stats );
+        if ( counter != -1 ) {
+            printf( ", %8lu syscalls", minSyscalls );
+        }
+        printf( "\n" );
+    }
+
+    if ( gBench.found > 0 ) {
+        fprintf( stderr, "the scans found %lu files that needed processing\n", gBench.found );
+    }
+    closeStateStores();
+
+    return ( gBench.found > 0 ) ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+//
+// Created by paul on 10/17/26.
+//
+
+/*
+ * Times starting a child, and waiting for it to exit, three ways: fork() and
+ * execve(), as the daemon used to; posix_spawn(), as it does now; and a round
+ * trip to the fork server (see forkServer.h). Each is timed as the daemon's
+ * resident set grows, since that's what makes fork() slower. Built only with
+ * -DBUILD_BENCHMARKS=ON:
+ *     benchSpawn [jobs] [MB...]
+ * It runs 'jobs' of /bin/true each way (2000 by default) at each size (0, 256
+ * and 1024 MB by default). The memory is allocated as 300-byte blocks, about
+ * the size of a node and its path, and each one is written to, so it's
+ * resident. As in the daemon, the fork server is started while we're small.
+ */
+
+#include "processNewFiles.h"
+
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "forkServer.h"
+
+#define kNodeSize   300
+
+tGlobals g;
+
+extern char ** environ;
+
+
+static double msSince( const struct timespec * start )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (double)( now.tv_sec - start->tv_sec ) * 1e3 + (double)( now.tv_nsec - start->tv_nsec ) / 1e6;
+}
+
+
+/**
+ * @brief grow the resident set to 'mb' megabytes (or thereabouts)
+ * @param mb
+ * @param allocated how many bytes have been allocated so far
+ * @return
+ */
+static tError growTo( unsigned long mb, unsigned long * allocated )
+{
+    while ( *allocated < mb * 1024 * 1024 ) {
+        char * node = malloc( kNodeSize );
+        if ( node == NULL ) return -ENOMEM;
+        memset( node, 0x5A, kNodeSize );
+        *allocated += kNodeSize;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief the resident set, as the kernel sees it
+ * @return in megabytes
+ */
+static unsigned long residentMB( void )
+{
+    unsigned long pages = 0;
+    FILE * file = fopen( "/proc/self/statm", "r" );
+    if ( file != NULL ) {
+        if ( fscanf( file, "%*u %lu", &pages ) != 1 ) pages = 0;
+        fclose( file );
+    }
+    return pages * (unsigned long)sysconf( _SC_PAGESIZE ) / ( 1024 * 1024 );
+}
+
+
+static tError viaFork( char * const argv[] )
+{
+    pid_t pid = fork();
+    if ( pid == -1 ) return -errno;
+    if ( pid == 0 ) {
+        execve( argv[0], argv, environ );
+        _exit( 127 );
+    }
+    return ( waitpid( pid, NULL, 0 ) == -1 ) ? -errno : 0;
+}
+
+
+static tError viaSpawn( char * const argv[] )
+{
+    pid_t  pid;
+    tError result = spawnChild( &pid, argv, environ, NULL );
+    if ( result == 0 && waitpid( pid, NULL, 0 ) == -1 ) {
+        result = -errno;
+    }
+    return result;
+}
+
+
+static tError viaForkServer( char * const argv[] )
+{
+    static uint64_t id = 0;
+
+    tError result = requestSpawn( ++id, argv, environ );
+    if ( result != 0 ) return result;
+
+    /* it reports that it started the child, then that it exited */
+    struct pollfd polled = { .fd = forkServerFd(), .events = POLLIN };
+    for (;;) {
+        tSpawnReport report;
+        result = receiveSpawnReport( &report );
+        if ( result == -EAGAIN ) {
+            if ( poll( &polled, 1, -1 ) == -1 && errno != EINTR ) return -errno;
+            continue;
+        }
+        if ( result != 0 ) return result;
+        if ( report.id != id ) continue;
+        if ( report.outcome == kSpawnFailed ) return -report.error;
+        if ( report.outcome == kExited ) return 0;
+    }
+}
+
+
+/**
+ * @brief
+ * @param how
+ * @param jobs
+ * @param argv
+ * @return milliseconds per job, or a negative value if one couldn't be started
+ */
+static double timeJobs( tError (*how)( char * const argv[] ), unsigned int jobs, char * const argv[] )
+{
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for ( unsigned int i = 0; i < jobs; ++i ) {
+        tError result = how( argv );
+        if ( result != 0 ) {
+            fprintf( stderr, "unable to start \'%s\': %s\n", argv[0], strerror( -result ) );
+            return -1;
+        }
+    }
+    return msSince( &start ) / (double)jobs;
+}
+
+
+int main( int argc, char * argv[] )
+{
+    unsigned int  jobs  = ( argc > 1 ) ? (unsigned int)strtoul( argv[1], NULL, 10 ) : 2000;
+    unsigned long sizes[ 16 ] = { 0, 256, 1024 };
+    unsigned int  count = 3;
+    if ( argc > 2 ) {
+        count = 0;
+        for ( int i = 2; i < argc && count < 16; ++i ) {
+            sizes[ count++ ] = strtoul( argv[i], NULL, 10 );
+        }
+    }
+    if ( jobs == 0 ) {
+        fprintf( stderr, "usage: %s [jobs] [MB...]\n", argv[0] );
+        return 1;
+    }
+
+    initLogStuff( "benchSpawn" );
+    setLogStuffDestination( kLogInfo, kLogToStderr );
+
+    /* while we're still small, as the daemon does */
+    tError result = startForkServer();
+    if ( result != 0 ) {
+        fprintf( stderr, "unable to start the fork server: %s\n", strerror( -result ) );
+        return 1;
+    }
+
+    char * const child[] = { "/bin/true", NULL };
+
+    printf( "%u jobs of \'%s\' each way (ms per job, including the wait)\n", jobs, child[0] );
+    printf( "%10s %12s %12s %12s\n", "RSS (MB)", "fork+execve", "posix_spawn", "fork server" );
+
+    unsigned long allocated = 0;
+    for ( unsigned int i = 0; i < count; ++i ) {
+        result = growTo( sizes[ i ], &allocated );
+        if ( result != 0 ) {
+            fprintf( stderr, "unable to grow to %lu MB\n", sizes[ i ] );
+            break;
+        }
+        double forkMs   = timeJobs( viaFork, jobs, child );
+        double spawnMs  = timeJobs( viaSpawn, jobs, child );
+        double serverMs = timeJobs( viaForkServer, jobs, child );
+        if ( forkMs < 0 || spawnMs < 0 || serverMs < 0 ) {
+            result = -1;
+            break;
+        }
+        printf( "%10lu %12.3f %12.3f %12.3f\n", residentMB(), forkMs, spawnMs, serverMs );
+        fflush( stdout );
+    }
+
+    stopForkServer();
+
+    return ( result == 0 ) ? 0 : 1;
+}
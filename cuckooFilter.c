@@ -0,0 +1,206 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include "cuckooFilter.h"
+
+/**
+ * @brief spread the bits of a key, so the low bits pick its first bucket
+ * and the top 32 bits are its fingerprint
+ */
+static inline uint64_t mixKey( uint64_t h )
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint32_t fingerprintOf( uint64_t mixed )
+{
+    uint32_t fingerprint = (uint32_t)(mixed >> 32);
+    /* zero marks an empty entry */
+    return ( fingerprint != 0 ) ? fingerprint : 1;
+}
+
+/**
+ * @brief the other bucket a fingerprint could be in. Applying it twice gets
+ * back to where it started, so it works from either bucket
+ */
+static inline size_t altBucket( const tCuckooFilter * filter, size_t bucket, uint32_t fingerprint )
+{
+    return ( bucket ^ ((uint64_t)fingerprint * 0x5bd1e995) ) & (filter->bucketCount - 1);
+}
+
+/**
+ * @brief put a fingerprint in an empty entry of the bucket, if it has one
+ * @return true if it was added
+ */
+static bool putInBucket( tCuckooFilter * filter, size_t bucket, uint32_t fingerprint )
+{
+    uint32_t * entries = &filter->slots[ bucket * kCuckooBucketSize ];
+    for ( unsigned int i = 0; i < kCuckooBucketSize; ++i ) {
+        if ( entries[ i ] == 0 ) {
+            entries[ i ] = fingerprint;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool inBucket( const tCuckooFilter * filter, size_t bucket, uint32_t fingerprint )
+{
+    const uint32_t * entries = &filter->slots[ bucket * kCuckooBucketSize ];
+    for ( unsigned int i = 0; i < kCuckooBucketSize; ++i ) {
+        if ( entries[ i ] == fingerprint ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool removeFromBucket( tCuckooFilter * filter, size_t bucket, uint32_t fingerprint )
+{
+    uint32_t * entries = &filter->slots[ bucket * kCuckooBucketSize ];
+    for ( unsigned int i = 0; i < kCuckooBucketSize; ++i ) {
+        if ( entries[ i ] == fingerprint ) {
+            entries[ i ] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief
+ * @param capacity how many keys it should be able to hold
+ * @return
+ */
+tCuckooFilter * newCuckooFilter( size_t capacity )
+{
+    tCuckooFilter * filter = calloc( 1, sizeof( tCuckooFilter ) );
+    if ( filter != NULL ) {
+        size_t buckets = kCuckooMinBuckets;
+        while ( buckets * kCuckooBucketSize * 7 < capacity * 8 ) buckets *= 2;
+
+        filter->slots = calloc( buckets * kCuckooBucketSize, sizeof( uint32_t ) );
+        if ( filter->slots == NULL ) {
+            free( filter );
+            return NULL;
+        }
+        filter->bucketCount = buckets;
+    }
+    return filter;
+}
+
+tError freeCuckooFilter( tCuckooFilter * filter )
+{
+    if ( filter == NULL ) return -EINVAL;
+
+    free( filter->slots );
+    free( filter );
+
+    return 0;
+}
+
+/**
+ * @brief add a key. Adding the same key twice holds two copies of its fingerprint
+ * @param filter
+ * @param key
+ * @return -ENOSPC if it was added, but another fingerprint had to be dropped
+ * to make room for it
+ */
+tError cuckooFilterAdd( tCuckooFilter * filter, uint64_t key )
+{
+    uint64_t mixed       = mixKey( key );
+    uint32_t fingerprint = fingerprintOf( mixed );
+    size_t   bucket      = mixed & (filter->bucketCount - 1);
+
+    if ( putInBucket( filter, bucket, fingerprint )
+      || putInBucket( filter, altBucket( filter, bucket, fingerprint ), fingerprint ) ) {
+        ++filter->count;
+        return 0;
+    }
+
+    /* both are full, so evict one to its other bucket, and so on */
+    for ( unsigned int kicks = 0; kicks < kCuckooMaxKicks; ++kicks ) {
+        uint32_t * entry = &filter->slots[ bucket * kCuckooBucketSize + filter->kick++ % kCuckooBucketSize ];
+        uint32_t   evicted = *entry;
+        *entry      = fingerprint;
+        fingerprint = evicted;
+        bucket      = altBucket( filter, bucket, fingerprint );
+        if ( putInBucket( filter, bucket, fingerprint ) ) {
+            ++filter->count;
+            return 0;
+        }
+    }
+
+    /* the last one evicted has nowhere to go */
+    return -ENOSPC;
+}
+
+bool cuckooFilterContains( const tCuckooFilter * filter, uint64_t key )
+{
+    uint64_t mixed       = mixKey( key );
+    uint32_t fingerprint = fingerprintOf( mixed );
+    size_t   bucket      = mixed & (filter->bucketCount - 1);
+
+    return inBucket( filter, bucket, fingerprint )
+        || inBucket( filter, altBucket( filter, bucket, fingerprint ), fingerprint );
+}
+
+/**
+ * @brief remove one copy of a key's fingerprint. Only remove keys that were
+ * added, otherwise another key with the same fingerprint may be removed instead
+ * @param filter
+ * @param key
+ * @return -ENOENT if its fingerprint isn't there
+ */
+tError cuckooFilterRemove( tCuckooFilter * filter, uint64_t key )
+{
+    uint64_t mixed       = mixKey( key );
+    uint32_t fingerprint = fingerprintOf( mixed );
+    size_t   bucket      = mixed & (filter->bucketCount - 1);
+
+    if ( removeFromBucket( filter, bucket, fingerprint )
+      || removeFromBucket( filter, altBucket( filter, bucket, fingerprint ), fingerprint ) ) {
+        --filter->count;
+        return 0;
+    }
+    return -ENOENT;
+}
+
+/**
+ * @return how many keys it can hold before it should be replaced by a bigger one
+ */
+size_t cuckooFilterCapacity( const tCuckooFilter * filter )
+{
+    /* insertions start to need a lot of kicks beyond about 95% full */
+    return filter->bucketCount * kCuckooBucketSize / 8 * 7;
+}
+
+/**
+ * @return bytes used
+ */
+size_t cuckooFilterMemory( const tCuckooFilter * filter )
+{
+    return sizeof( tCuckooFilter ) + filter->bucketCount * kCuckooBucketSize * sizeof( uint32_t );
+}
+
+/**
+ * @brief the chance that a key that was never added is found, as full as it is now.
+ * It's compared with every fingerprint in its two buckets, and each matches
+ * with a chance of 1 in 2^32 - 1. That's small enough to simply add them up.
+ * @param filter
+ * @return
+ */
+double cuckooFilterFalsePositiveRate( const tCuckooFilter * filter )
+{
+    double load = (double)filter->count / (double)(filter->bucketCount * kCuckooBucketSize);
+    return 2.0 * kCuckooBucketSize * load / 4294967295.0;
+}
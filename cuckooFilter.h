@@ -0,0 +1,49 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_CUCKOOFILTER_H
+#define PROCESSNEWFILES_CUCKOOFILTER_H
+
+#include <stdint.h>
+
+/*
+ * Cuckoo filter: a compact set of 64-bit keys, which only holds a 32-bit
+ * fingerprint of each one. Every key has two candidate buckets, the second
+ * derived from the first and the fingerprint alone, so a fingerprint can be
+ * moved to make room ('kicked') without knowing its key. Unlike a Bloom
+ * filter, a key can be removed again.
+ *
+ * A key that was added is always found, unless an insertion ran out of kicks
+ * and dropped a fingerprint to make room. A key that wasn't added may be
+ * found anyway, when its fingerprint matches another in either bucket.
+ */
+
+#define kCuckooBucketSize   4       // fingerprints per bucket
+#define kCuckooMaxKicks     500     // give up on an insertion after moving this many fingerprints
+#define kCuckooMinBuckets   256
+
+typedef struct {
+    uint32_t *      slots;          // bucketCount * kCuckooBucketSize fingerprints, zero is empty
+    size_t          bucketCount;    // always a power of 2
+    size_t          count;          // fingerprints held
+    unsigned int    kick;           // which entry of a full bucket to evict next
+} tCuckooFilter;
+
+tCuckooFilter * newCuckooFilter( size_t capacity );
+
+tError freeCuckooFilter( tCuckooFilter * filter );
+
+tError cuckooFilterAdd( tCuckooFilter * filter, uint64_t key );
+
+bool   cuckooFilterContains( const tCuckooFilter * filter, uint64_t key );
+
+tError cuckooFilterRemove( tCuckooFilter * filter, uint64_t key );
+
+size_t cuckooFilterCapacity( const tCuckooFilter * filter );
+
+size_t cuckooFilterMemory( const tCuckooFilter * filter );
+
+double cuckooFilterFalsePositiveRate( const tCuckooFilter * filter );
+
+#endif //PROCESSNEWFILES_CUCKOOFILTER_H
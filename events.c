@@ -7,16 +7,35 @@
 #include <poll.h>
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <time.h>
-#include <ftw.h>
 #include <sys/inotify.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 
 #include "events.h"
 #include "rescan.h"
 #include "inotify.h"
+#include "scanPool.h"
+#include "stateStore.h"
+#include "snapshot.h"
+#include "takeover.h"
+#include "execTemplate.h"
+#include "forkServer.h"
+#include "worker.h"
+#include "plugin.h"
 
 typedef enum {
     kSignalEvent = 1,  /* signal received */
+    kChildEvent,       /* a pidfd became readable, i.e. a child exited */
+    kTimerEvent,       /* the timerfd reached the next expiration */
+    kInotifyEvent,     /* the (shared) inotify fd has events waiting */
+    kScanEvent,        /* the scan threads have found something */
+    kTakeoverEvent,    /* a new process wants to take over from us */
+    kTakeoverPeerEvent,/* ...and has gone away again */
+    kForkServerEvent,  /* the fork server has reported on a child */
+    kWorkerEvent,      /* a worker has replied, or exited */
+    kPluginEvent,      /* a plugin is done with one or more files */
 } tEpollSpecialValue;
 
 static struct {
@@ -28,7 +47,11 @@ static struct {
         tFileDscr   fd;
     } signal;
 
-    tListRoot * treeList;
+    struct {
+        tFileDscr   fd;
+        tTick       armedFor;   /* deadline the timerfd is currently set to */
+    } timer;
+
 } gEvent;
 
 
@@ -109,6 +132,11 @@ void logSignal( unsigned int signum )
 }
 
 
+void reapChildren( void );
+tError processForkServerEvents( void );
+tError processTimerEvent( void );
+
+
 /**
  * @brief
  * @param siginfo
@@ -122,11 +150,17 @@ int processOneSignalEvent( const struct signalfd_siginfo * siginfo )
     switch ( siginfo->ssi_signo )
     {
     case SIGINT:
+    case SIGTERM:   /* e.g. systemd stopping the service */
+    case SIGHUP:
+        /* stop cleanly, so the snapshot gets written */
         result = -EINTR;
         break;
 
     case SIGCHLD:
         logInfo( "Child exit status %d", siginfo->ssi_status );
+        /* covers kernels without pidfd support */
+        reapChildren();
+        reapWorkers();
         break;
 
     default:
@@ -161,7 +195,11 @@ int processSignalEvents( void )
         const char * end   = buf + len;
         while ( event < end ) {
             ++count;
-            result = processOneSignalEvent( (const struct signalfd_siginfo *)event );
+            /* don't let a later signal hide an earlier request to terminate */
+            int err = processOneSignalEvent( (const struct signalfd_siginfo *)event );
+            if ( err != 0 ) {
+                result = err;
+            }
             event += sizeof( struct signalfd_siginfo );
         }
         logDebug( "processed %d signal events from a buffer %ld bytes long", count, len );
@@ -180,8 +218,9 @@ int processEpollEvent( const struct epoll_event * const epollEvent )
 {
     int result = 0;
 
-    /* Process an epoll event we just read from the epoll file descriptor. */
-    if ( epollEvent->events & EPOLLIN )
+    /* Process an epoll event we just read from the epoll file descriptor. A pipe
+     * whose writer has gone only reports EPOLLHUP, which its read() will find */
+    if ( epollEvent->events & (EPOLLIN | EPOLLHUP | EPOLLERR) )
     {
         /* check for the 'special values' */
         switch ( epollEvent->data.u64 )
@@ -190,10 +229,44 @@ int processEpollEvent( const struct epoll_event * const epollEvent )
             result = processSignalEvents();
             break;
 
+        case kChildEvent:
+            reapChildren();
+            break;
+
+        case kTimerEvent:
+            result = processTimerEvent();
+            break;
+
+        case kInotifyEvent:
+            result = processInotifyEvents();
+            break;
+
+        case kScanEvent:
+            result = processScanResults();
+            break;
+
+        case kTakeoverEvent:
+            result = acceptTakeover();
+            break;
+
+        case kTakeoverPeerEvent:
+            result = takeoverPeerGone();
+            break;
+
+        case kForkServerEvent:
+            result = processForkServerEvents();
+            break;
+
+        case kWorkerEvent:
+            result = processWorkerEvents();
+            break;
+
+        case kPluginEvent:
+            result = processPluginResults();
+            break;
+
         default:
-            /* if it's not a 'special' event, then iNotify events are waiting,
-             * and data.ptr points at the corresponding watchedTree */
-            result = processInotifyEvents(  (tWatchedTree *)epollEvent->data.ptr );
+            logError( "(Internal) unexpected epoll event %lu", epollEvent->data.u64 );
             break;
         }
     }
@@ -243,99 +316,72 @@ tError readyToExec( tFSNode * fileNode )
 tError fileExpired( tFSNode * node )
 {
     tError   result = 0;
-    const tWatchedTree * watchedTree = node->watchedTree;
+    tWatchedTree * watchedTree = node->watchedTree;
 
     const char * path = node->relPath;
     if (path == NULL || *path == '\0' )
         { path = node->path; }
     logDebug("\'%s\' expired, and %s", path, expiredReasonAsStr[ node->expires.because ] );
 
-    /* remove any existing shadow file */
-    if (unlinkat(watchedTree->shadow.fd, node->relPath, 0 ) == -1 && errno != ENOENT ) {
-        logError("unable to remove shadow file \'%s\'", node->relPath );
+    /* note that it's being processed. If it never completes, a rescan will
+     * find it again. The mtime & size aren't needed until it's done */
+    tFileRecord record;
+    storeLookup( watchedTree->state, node->relPath, 0, &record );
+    record.state    = kStatePending;
+    record.attempts = node->expires.retries + 1;
+    if ( storeUpdate( watchedTree->state, node->relPath, &record ) != 0 ) {
+        logError( "unable to record that \'%s\' is being processed", node->relPath );
+        logSetErrno( 0 );
     }
-    /* create a fresh shadow file */
-    int fd = openat(watchedTree->shadow.fd, node->relPath, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU );
-    if ( fd == -1 ) {
-        result = -errno;
-        logError("unable to create shadow file \'%s/%s\'", watchedTree->shadow.path, node->relPath );
-    } else {
-        char * buffer;
 
-        if ( asprintf(&buffer, "#!/bin/bash\nFILE=\'%s\'\nREASON=\'%s\'\n%s\n",
-                      node->path,
-                      expiredReasonAsStr[ node->expires.because ],
-                      watchedTree->exec ) < 1 ) {
-            logDebug( "unable to generate script contents" );
-        }
-        ssize_t len = strlen( buffer );
-        if ( write( fd, buffer, len) < len ) {
-            logError( "unable to write script contents" );
-        }
-        free( buffer );
-        close( fd );
-
-        result = readyToExec(node);
-    }
+    result = readyToExec(node);
 
     return result;
 }
 
 
 /**
- * @brief scan the expiringList of each watchedTree, expiring entries whose time has passed
+ * @brief expire the nodes in g.expiring whose time has passed
  * @return
  */
 tError processExpiredFSNodes( void )
 {
     int result = 0;
     tFSNode * node;
+    tListRoot expired;
+
+    listInit( &expired );
+    timerWheelExpire( g.expiring, monotonicMs(), &expired );
 
-#ifdef DEBUG
     int count = 0;
-    listForEachEntry( &g.expiringList, node )
+    while ( !listAtEnd( &expired, node = (tFSNode *)listStart( &expired ) ) )
     {
         ++count;
-        logDebug("%s expires in %ld secs", node->path, node->expires.at - time(NULL) );
-    }
-    if (count > 0)
-    {
-        logDebug( "%d %s waiting to expire", count, count > 1 ? "nodes" : "node" );
-    }
-#endif
+        /* remove the item from the expired list, as it's about to be put on another */
+        listRemove( &node->queue );
 
-    time_t now = time( NULL );
-    listForEachEntry( &g.expiringList, node )
-    {
-        if ( node->expires.at > now ) break;
-        else
+        switch (node->type)
         {
-            /* remember the node that comes next, as we're about to unlink this node */
-            tFSNode * next = (tFSNode *)listNext( &node->queue );
-            /* remove the item from expiringList because it expired... */
-            listRemove( &node->queue );
-
-            switch (node->type)
-            {
-            case kFile:
-                result = fileExpired( node );
-                break;
-
-            case kTree:
-                result = rescanTree( node );
-                break;
+        case kFile:
+            result = fileExpired( node );
+            break;
 
-            default:
-                logError( "(Internal) something expired that isn't supposed to expire!" );
-                break;
-            }
+        case kTree:
+            result = rescanTree( node );
+            break;
 
-            /* update the pointer to the next one in the list. can't use node,
-             * since it's already been removed from expiringList  */
-            node = next;
+        default:
+            logError( "(Internal) something expired that isn't supposed to expire!" );
+            break;
         }
     }
 
+    if (count > 0)
+    {
+        logDebug( "%d %s expired, %u still waiting to expire",
+                  count, count > 1 ? "nodes" : "node", g.expiring->count );
+    }
+
     return result;
 }
 
@@ -343,7 +389,8 @@ tError processExpiredFSNodes( void )
 /**
  * @brief destroy a fsNode and remove any references to it
  * Typically this is a fileNode that expired, so it's no
- * longer of interest.
+ * longer of interest. One that's still being processed is only
+ * marked, and forgotten once it's done.
  * @see removeNode()
  * @param fsNode
  */
@@ -351,40 +398,110 @@ void forgetNode( tFSNode * fsNode )
 {
     if (fsNode == NULL) return;
 
-    listRemove( &fsNode->queue );
+    if ( fsNode->child.pid != 0 ) {
+        /* it's on the executingList, and holds a job. childExited() releases it, then forgets the node */
+        fsNode->child.forgotten = true;
+        return;
+    }
+
+    if ( fsNode->expires.filed != 0 ) {
+        timerWheelRemove( g.expiring, fsNode );
+    } else if ( listEntryValid( &fsNode->queue ) ) {
+        /* directory nodes are never queued, so their links are still zero */
+        listRemove( &fsNode->queue );
+    }
 
     tWatchedTree * watchedTree = fsNode->watchedTree;
     if (watchedTree != NULL) {
         forgetWatch(fsNode);
+        if ( fsNode->type == kDirectory ) {
+            forgetDirStamp( fsNode );
+            forgetDirty( fsNode );
+        }
         if ( watchedTree->pathMap != NULL) {
-            hashMapRemove(watchedTree->pathMap, fsNode->pathHash);
+            hashMapRemove(watchedTree->pathMap, fsNode->pathHash, fsNode->path);
         }
     }
 }
 
 
+/**
+ * @brief the name of the script a job is written to, in the tree's '.seen/scripts'
+ * @param fileNode
+ * @param name
+ * @param size
+ */
+static void scriptName( const tFSNode * fileNode, char * name, size_t size )
+{
+    snprintf( name, size, "%016lx.sh", calcHash( fileNode->relPath ) );
+}
+
+
 /**
  * @brief
  * @param fileNode
  */
 void markFileComplete( tFSNode * fileNode )
 {
-    const tWatchedTree * watchedTree = fileNode->watchedTree;
+    tWatchedTree * watchedTree = fileNode->watchedTree;
+    tFileRecord    record;
+    struct statx   info;
+
+    storeLookup( watchedTree->state, fileNode->relPath, 0, &record );
+
+    /* record the file as it is now the script has finished with it, so any
+     * changes the script made itself don't make it look modified */
+    if ( statx( watchedTree->root.fd, fileNode->relPath, 0, STATX_MTIME | STATX_SIZE, &info ) == 0 ) {
+        record.state = kStateDone;
+        record.mtime = statxNs( &info.stx_mtime );
+        record.size  = info.stx_size;
+        if ( storeUpdate( watchedTree->state, fileNode->relPath, &record ) != 0 ) {
+            logError( "unable to record that \'%s\' has been processed", fileNode->relPath );
+        }
+    } else if ( errno == ENOENT ) {
+        /* the script moved it somewhere else */
+        storeForget( watchedTree->state, fileNode->relPath );
+    } else {
+        logError( "Failed to get info about \'%s\'", fileNode->relPath );
+    }
+    logSetErrno( 0 );
 
-    int fd = openat( watchedTree->shadow.fd,
-                     fileNode->relPath,
-                     O_RDONLY | O_CREAT | O_TRUNC,
-                     S_IRUSR | S_IRGRP );
-    /* openat does not apply the permissions if the
-     * file isn't new, so also do it explicitly */
-    fchmod( fd, S_IRUSR | S_IRGRP );
-    close( fd );
+    if ( watchedTree->writeScripts ) {
+        /* only the scripts of the jobs that failed are of any interest */
+        char name[ 32 ];
+        scriptName( fileNode, name, sizeof( name ) );
+        unlinkat( watchedTree->scriptsFd, name, 0 );
+    }
 
     forgetNode( fileNode );
     /* ToDo: free the fileNode */
 }
 
 
+/**
+ * @brief its retries have run out, so record that it's been given up on.
+ * Scans leave it alone from then on, unless it's modified
+ * @param fileNode
+ */
+static void markFileFailed( tFSNode * fileNode )
+{
+    tWatchedTree * watchedTree = fileNode->watchedTree;
+    tFileRecord    record      = { .state = kStateFailed, .attempts = (unsigned int)fileNode->expires.retries };
+    struct statx   info;
+
+    if ( statx( watchedTree->root.fd, fileNode->relPath, 0, STATX_MTIME | STATX_SIZE, &info ) == 0 ) {
+        record.mtime = statxNs( &info.stx_mtime );
+        record.size  = info.stx_size;
+        if ( storeUpdate( watchedTree->state, fileNode->relPath, &record ) != 0 ) {
+            logError( "unable to record that \'%s\' has been given up on", fileNode->relPath );
+        }
+    } else if ( errno != ENOENT ) {
+        logError( "Failed to get info about \'%s\'", fileNode->relPath );
+    }
+    logSetErrno( 0 );
+}
+
+
 /**
  * @brief
  * @param fileNode
@@ -395,7 +512,7 @@ tError retryFileNode( tFSNode * fileNode )
     tError result = 1;
 
     fileNode->expires.retries++;    /* count the failures, so we don't retry forever */
-    fileNode->expires.every += 2;    /* increase the idle delay each time it fails */
+    fileNode->expires.every += 2000; /* increase the idle delay each time it fails */
     /* spread the expirations out over time, to spread the load if many of them
      * fail quickly and would otherwise be retried at almost the same time. This
      * is most likely to happen if the 'exec' statement provided by the user is
@@ -405,6 +522,7 @@ tError retryFileNode( tFSNode * fileNode )
         logError( "failed to process \'%s\' successfully after %d retries",
                   fileNode->path,
                   fileNode->expires.retries );
+        markFileFailed( fileNode );
         result = -ENOTRECOVERABLE;
     } else {
         logError( "attempt %d to process \'%s\' failed, retry",
@@ -418,22 +536,334 @@ tError retryFileNode( tFSNode * fileNode )
 
 
 /**
- *
+ * @brief run the tree's exec statement for this fileNode, directly from the
+ * template it was compiled into. The file's path is in $FILE, and why it's
+ * being processed in $REASON (see execTemplate.h for the rest).
+ * It's started by the fork server if it's running (see forkServer.h), in
+ * which case its pid isn't known until the fork server reports it.
  * @param fileNode
  * @return
  */
-tError executeNode( tFSNode * fileNode )
+tError spawnNode( tFSNode * fileNode )
 {
     tError result = 0;
+    const tWatchedTree * watchedTree = fileNode->watchedTree;
+
+    char attempt[ 16 ];
+    snprintf( attempt, sizeof( attempt ), "%d", fileNode->expires.retries + 1 );
+
+    tExecValue values[ kExecValueCount ] = {
+        [kExecFile]    = execString( fileNode->path ),
+        [kExecRelPath] = execString( fileNode->relPath ),
+        [kExecReason]  = execString( expiredReasonAsStr[ fileNode->expires.because ] ),
+        [kExecTree]    = execString( watchedTree->root.path ),
+        [kExecAttempt] = execString( attempt ),
+        [kExecSize]    = execString( "" )
+    };
+    setPathValues( values, fileNode->path );
+
+    /* only look, if the template asks for it */
+    char size[ 24 ];
+    if ( execUses( watchedTree->command, kExecSize ) ) {
+        struct statx info;
+        if ( statx( watchedTree->root.fd, fileNode->relPath, AT_STATX_DONT_SYNC, STATX_SIZE, &info ) == 0 ) {
+            snprintf( size, sizeof( size ), "%llu", (unsigned long long)info.stx_size );
+            values[ kExecSize ] = execString( size );
+        }
+    }
+
+    /* both are built within the template, so there's nothing to free */
+    char ** argv = buildExecArgv( watchedTree->command, values );
+    char ** envp = buildExecEnv( watchedTree->command, values );
+    if ( argv == NULL || envp == NULL ) {
+        logError( "unable to generate the command for '%s'", fileNode->relPath );
+        return ( argv == NULL ) ? -ENAMETOOLONG : -ENOMEM;
+    }
+
+    if ( watchedTree->writeScripts ) {
+        char name[ 32 ];
+        scriptName( fileNode, name, sizeof( name ) );
+        if ( writeExecScript( watchedTree->scriptsFd, name, argv, values ) != 0 ) {
+            logError( "unable to write the script for '%s'", fileNode->relPath );
+            logSetErrno( 0 );
+        }
+    }
+
+    /* the fork server starts it if it can, as it's cheaper for a process as small as it is */
+    if ( forkServerRunning() ) {
+        result = requestSpawn( (uint64_t)(uintptr_t)fileNode, argv, envp );
+        if ( result == 0 ) {
+            logDebug( "asked the fork server to execute \'%s\'", fileNode->relPath );
+            fileNode->child.pid        = -1;    // until the fork server reports it
+            fileNode->child.pidfd      = -1;
+            fileNode->child.forkServer = true;
+            return 0;
+        }
+        logSetErrno( -result );
+        logDebug( "unable to ask the fork server to execute \'%s\', so starting it directly", fileNode->relPath );
+        logSetErrno( 0 );
+    }
+
+    pid_t pid;
+    result = spawnChild( &pid, argv, envp, NULL );
+
+    if ( result != 0 ) {
+        logSetErrno( -result );
+        logError( "unable to execute \'%s\' for \'%s\'", argv[0], fileNode->relPath );
+        logSetErrno( 0 );
+    } else {
+        logDebug( "[%d] executing \'%s\'", pid, fileNode->relPath );
+        fileNode->child.pid        = pid;
+        fileNode->child.forkServer = false;
+        fileNode->child.pidfd = (tFileDscr)syscall( SYS_pidfd_open, pid, 0 );
+        if ( fileNode->child.pidfd == -1 ) {
+            /* not fatal - SIGCHLD will still tell us when it exits */
+            logDebug( "pidfd_open() not available for child %d", pid );
+        } else if ( registerFdToEpoll( fileNode->child.pidfd, kChildEvent ) != 0 ) {
+            close( fileNode->child.pidfd );
+            fileNode->child.pidfd = -1;
+        }
+    }
+
+    return result;
+}
 
-    /* ToDo: Actually execute it */
-    result = ( fileNode->expires.retries < 2 )? -1 : 0 ;
 
-    if (result == 0) {
-        /* processing completed without error, so adjust the shadow file accordingly */
+/**
+ * @brief start executing the processing for the provided fileNode, or if
+ * its tree has workers or a plugin, hand it to them.
+ * If the child can't be started, the fileNode is retried later.
+ * @param fileNode
+ * @return
+ */
+tError executeNode( tFSNode * fileNode )
+{
+    tError result;
+    tWatchedTree * watchedTree = fileNode->watchedTree;
+
+    if ( watchedTree->plugin != NULL ) {
+        result = sendToPlugin( fileNode );
+    } else if ( watchedTree->workers != NULL ) {
+        result = sendToWorker( fileNode );
+    } else {
+        result = spawnNode( fileNode );
+    }
+
+    if ( result == 0 ) {
+        listAppend( g.executingList, &fileNode->queue );
+        ++g.jobs.running;
+        ++watchedTree->jobs.running;
+    } else {
+        if ( retryFileNode( fileNode ) < 0 ) {
+            forgetNode( fileNode );
+        }
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief a child has exited, so record the outcome for its fileNode
+ * @param fileNode
+ * @param info the status returned by waitid()
+ */
+void childExited( tFSNode * fileNode, const siginfo_t * info )
+{
+    tWatchedTree * watchedTree = fileNode->watchedTree;
+
+    if ( fileNode->child.pidfd != -1 ) {
+        /* closing it also removes it from the epoll set */
+        close( fileNode->child.pidfd );
+        fileNode->child.pidfd = -1;
+    }
+    fileNode->child.pid        = 0;
+    fileNode->child.forkServer = false;
+    fileNode->child.worker     = NULL;
+    fileNode->child.plugin     = NULL;
+
+    listRemove( &fileNode->queue );
+    --g.jobs.running;
+    --watchedTree->jobs.running;
+
+    if ( fileNode->child.forgotten ) {
+        /* it was deleted (or replaced) while it was being processed, so there's nothing to record */
+        logDebug( "\'%s\' went while it was being processed", fileNode->relPath );
+        fileNode->child.forgotten = false;
+        forgetNode( fileNode );
+    } else if ( info->si_code == CLD_EXITED && info->si_status == 0 ) {
+        /* processing completed without error, so record that it's done */
         markFileComplete( fileNode );
     } else {
-        result = retryFileNode( fileNode );
+        if ( info->si_code == CLD_EXITED ) {
+            logInfo( "processing \'%s\' exited with status %d", fileNode->relPath, info->si_status );
+        } else {
+            logInfo( "processing \'%s\' was terminated by signal %d", fileNode->relPath, info->si_status );
+        }
+        if ( retryFileNode( fileNode ) < 0 ) {
+            forgetNode( fileNode );
+        }
+    }
+}
+
+
+/**
+ * @brief collect the exit status of any children that have finished
+ * Only a handful of children are ever running at once, so it's cheap
+ * to check all of them, whichever pidfd (or SIGCHLD) woke us up.
+ */
+void reapChildren( void )
+{
+    tFSNode * node = (tFSNode *)listStart( g.executingList );
+    while ( !listAtEnd( g.executingList, node ) )
+    {
+        /* remember the node that comes next, as childExited() unlinks this node */
+        tFSNode * next = (tFSNode *)listNext( &node->queue );
+        if ( node->child.forkServer || node->child.worker != NULL || node->child.plugin != NULL ) {
+            /* it isn't our child. The fork server, the worker or the plugin reports when it's done */
+            node = next;
+            continue;
+        }
+
+        siginfo_t info;
+        info.si_pid = 0;
+        if ( waitid( P_PID, node->child.pid, &info, WEXITED | WNOHANG ) == -1 ) {
+            logError( "unable to get the status of child %d", node->child.pid );
+            /* it isn't our child any more, so treat it as a failure */
+            info.si_pid    = node->child.pid;
+            info.si_code   = CLD_KILLED;
+            info.si_status = 0;
+        }
+        if ( info.si_pid != 0 ) {
+            childExited( node, &info );
+        }
+
+        node = next;
+    }
+}
+
+
+/**
+ * @brief
+ * @param id as passed to requestSpawn()
+ * @return the node on the executingList it refers to, or NULL if none does
+ */
+static tFSNode * findSpawned( uint64_t id )
+{
+    tFSNode * node;
+    listForEachEntry( g.executingList, node )
+    {
+        if ( (uint64_t)(uintptr_t)node == id && node->child.forkServer ) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief read what the fork server has to report about the children it started.
+ * If it has gone away, its children are treated as failures, to be retried,
+ * and from now on children are started directly
+ * @return
+ */
+tError processForkServerEvents( void )
+{
+    tError       result;
+    tSpawnReport report;
+
+    while ( ( result = receiveSpawnReport( &report ) ) == 0 )
+    {
+        tFSNode * node = findSpawned( report.id );
+        if ( node == NULL ) {
+            logError( "(Internal) the fork server reported on a child we don't know about" );
+            continue;
+        }
+
+        siginfo_t info = { 0 };
+        switch ( (tSpawnOutcome)report.outcome )
+        {
+        case kSpawned:
+            node->child.pid = report.pid;
+            logDebug( "[%d] executing \'%s\'", report.pid, node->relPath );
+            break;
+
+        case kSpawnFailed:
+            logSetErrno( report.error );
+            logError( "unable to execute the command for \'%s\'", node->relPath );
+            logSetErrno( 0 );
+            /* as the shell would report it */
+            info.si_code   = CLD_EXITED;
+            info.si_status = 127;
+            childExited( node, &info );
+            break;
+
+        case kExited:
+            info.si_pid    = report.pid;
+            info.si_code   = report.code;
+            info.si_status = report.status;
+            childExited( node, &info );
+            break;
+
+        default:
+            logError( "(Internal) unexpected report %u from the fork server", report.outcome );
+            break;
+        }
+    }
+
+    if ( result == -EAGAIN ) {
+        logSetErrno( 0 );
+    } else {
+        logSetErrno( -result );
+        logWarning( "the fork server has gone, so children will be started directly" );
+        logSetErrno( 0 );
+        stopForkServer();
+
+        tFSNode * node = (tFSNode *)listStart( g.executingList );
+        while ( !listAtEnd( g.executingList, node ) )
+        {
+            tFSNode * next = (tFSNode *)listNext( &node->queue );
+            if ( node->child.forkServer ) {
+                siginfo_t info = { .si_code = CLD_KILLED, .si_status = SIGKILL };
+                childExited( node, &info );
+            }
+            node = next;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief start as many of the nodes on readyList as the job limits allow
+ * Nodes belonging to a tree that's already running its limit stay on the
+ * readyList, and don't hold up the nodes of other trees behind them.
+ * @return
+ */
+tError dispatchReadyNodes( void )
+{
+    tError result = 0;
+
+    if ( takeoverPending() ) {
+        /* the process taking over will start them */
+        return 0;
+    }
+
+    tFSNode * node = (tFSNode *)listStart( g.readyList );
+    while ( g.jobs.running < g.jobs.limit && !listAtEnd( g.readyList, node ) )
+    {
+        tFSNode * next = (tFSNode *)listNext( &node->queue );
+
+        const tWatchedTree * watchedTree = node->watchedTree;
+        if ( watchedTree->jobs.limit == 0 || watchedTree->jobs.running < watchedTree->jobs.limit ) {
+            listRemove( &node->queue );
+            --g.readyCount;
+
+            executeNode( node );
+        }
+
+        node = next;
     }
 
     return result;
@@ -442,63 +872,130 @@ tError executeNode( tFSNode * fileNode )
 
 /**
  * @brief figure out when the next soonest expiration will occur
- * @return time_t of the next expiration
+ * @return monotonicMs() time of the next expiration
  */
-time_t nextExpiration( void )
+tTick nextExpiration( void )
 {
-    time_t now = time( NULL );
-    time_t whenExpires = now + g.timeout.rescan;
+    tTick now = monotonicMs();
+    tTick whenExpires = now + g.timeout.rescan;
 
-    /* list is sorted ascending by expiration, so the head of the list is the next to expire */
-    tFSNode const * node = (tFSNode *) listStart( g.expiringList );
-    if ( node != NULL && !listAtEnd( &g.expiringList, node ) )
+    tTick next = timerWheelNext( g.expiring );
+    if ( next != UINT64_MAX )
     {
-        whenExpires = node->expires.at;
-
-        if ( whenExpires < now ) {
+        if ( next < now ) {
             whenExpires = now;
-        } else if ( whenExpires - now > g.timeout.rescan ) {
-            whenExpires = now + g.timeout.rescan;
+        } else if ( next < whenExpires ) {
+            whenExpires = next;
         }
 
-#ifdef DEBUG
-        logDebug( "%s %s, and will expire in %ld seconds",
-                  node->path, expiredReasonAsStr[ node->expires.because ], whenExpires - now );
-#endif
+        logDebug( "%u %s waiting, next expiration in %lu ms",
+                  g.expiring->count, g.expiring->count == 1 ? "node" : "nodes", whenExpires - now );
     }
 
     return whenExpires;
 }
 
 
+/**
+ * @brief set the timerfd to fire at the given deadline
+ * @param deadline in monotonicMs() time
+ * @return
+ */
+tError armTimer( tTick deadline )
+{
+    tError result = 0;
+
+    if ( deadline != gEvent.timer.armedFor ) {
+        struct itimerspec when = { 0 };
+        when.it_value.tv_sec  = (time_t)(deadline / 1000);
+        when.it_value.tv_nsec = (long)(deadline % 1000) * 1000000;
+
+        if ( timerfd_settime( gEvent.timer.fd, TFD_TIMER_ABSTIME, &when, NULL ) == -1 ) {
+            result = -errno;
+            logError( "unable to set timer fd %d", gEvent.timer.fd );
+        } else {
+            gEvent.timer.armedFor = deadline;
+        }
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief the timerfd fired. The expired nodes are dealt with after all the
+ * epoll events, so all that's needed here is to acknowledge it.
+ * @return
+ */
+tError processTimerEvent( void )
+{
+    tError   result = 0;
+    uint64_t expirations;
+
+    if ( read( gEvent.timer.fd, &expirations, sizeof( expirations ) ) == -1 && errno != EAGAIN ) {
+        result = -errno;
+        logError( "unable to read from timer fd %d", gEvent.timer.fd );
+    }
+    /* it's no longer armed, so make sure armTimer() sets it again, even for the same deadline */
+    gEvent.timer.armedFor = 0;
+
+    return result;
+}
+
+
+/**
+ * @brief
+ * @return true if no children are running, and no tree is being scanned
+ */
+static bool quiescent( void )
+{
+    if ( g.jobs.running != 0 ) {
+        return false;
+    }
+
+    const tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        if ( watchedTree->scan.running ) return false;
+    }
+    return true;
+}
+
+
 /**
  * @brief main event loop
  * @return
  */
 tError eventLoop( void )
 {
-    int                result = 0;
+    int                result     = 0;
+    bool               busy       = true;   /* the trees' first scans have been queued */
+    bool               handedOver = false;
     struct epoll_event epollEvents[32];
 
-    rescanAllTrees();
+    if ( !tookOver() ) {
+        /* a tree that was taken over already has its next rescan scheduled */
+        rescanAllTrees();
+    }
 
     do {
-        int timeout = (int)(nextExpiration() - time( NULL ));
+        /* the state stores' appends are fsync'ed in batches, at most kStoreSyncMs late */
+        tTick deadline = nextExpiration();
+        if ( takeoverPending() ) {
+            /* expirations are left for the process taking over, so don't keep waking up for them */
+            deadline = monotonicMs() + g.timeout.rescan;
+        }
+        tTick syncAt   = syncStateStores( false );
+        result = armTimer( syncAt < deadline ? syncAt : deadline );
+        if ( result != 0 ) break;
 
-        /* * * * * * block waiting for events or a timeout * * * * * */
+        /* * * * * * block waiting for events or the timer * * * * * */
         logSetErrno( 0 );
-#if 0
-        logDebug( "epoll_wait( fd: %d, %p[%ld], %d secs )",
-                  gEvent.epoll.fd,
-                  epollEvents,
-                  sizeof( epollEvents ) / sizeof( struct epoll_event ),
-                  timeout );
-#endif
         /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
         int count = epoll_wait( gEvent.epoll.fd,
                                 epollEvents,
                                 sizeof( epollEvents ) / sizeof( struct epoll_event ),
-                                timeout * 1000 );
+                                busy ? 0 : -1 );
         /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
         if ( count < 0 )
         {
@@ -524,43 +1021,79 @@ tError eventLoop( void )
                 result = processEpollEvent( &epollEvents[ i ] );
             }
 
-            /* If any nodes that expired, handle them appropriately */
-            if ( result == 0 ) {
+            /* If any nodes that expired, handle them appropriately. Not while we're handing
+             * over, though: they stay where they are, and go in the snapshot */
+            if ( result == 0 && !takeoverPending() ) {
                 result = processExpiredFSNodes();
             }
+
+            /* start any ready nodes that there's now room for */
+            if ( result == 0 ) {
+                result = dispatchReadyNodes();
+            }
+
+            /* a slice of any rescans in progress. If there's more to do, just poll next time around */
+            if ( result == 0 ) {
+                busy = continueRescans();
+            }
+
+            /* once nothing is running, everything can be handed to the process taking over.
+             * If that fails, we're still the owner */
+            if ( result == 0 && takeoverPending() && !busy && quiescent() ) {
+                closeStateStores();
+                handedOver = ( handOver() == 0 );
+                if ( handedOver ) break;
+                reopenStateStores();
+            }
         }
     } while ( result == 0 );
 
     logInfo( "loop terminated %d", result );
-    removePIDfile();
+    if ( !handedOver ) {
+        closeStateStores();
+        /* only once the state stores are safely closed, so a snapshot never runs ahead of them.
+         * If a handover failed, the new process loads them once we've exited */
+        saveSnapshots();
+    }
+    if ( !takeoverPending() ) {
+        /* otherwise it's the new process's pid file now */
+        removePIDfile();
+    }
+    closeTakeover();
+    stopWorkers();
+    stopPlugins();
+    stopForkServer();
     return result;
 }
 
 
 /**
- * @brief
+ * @brief create the tree's '.seen' directory if need be, and open the
+ * state store in it
  * @param watchedTree
  * @return
  */
-tError makeShadowRoot( tWatchedTree * watchedTree )
+tError makeSeenDir( tWatchedTree * watchedTree )
 {
     tError result = 0;
 
-    if ( asprintf( (char **)&(watchedTree->shadow.path), "%s/.seen", watchedTree->root.path ) < 1 ) {
-        logError( "failed to generate path to shadow directory" );
+    if ( asprintf( (char **)&(watchedTree->seen.path), "%s/.seen", watchedTree->root.path ) < 1 ) {
+        logError( "failed to generate path to the .seen directory" );
+        watchedTree->seen.path = NULL;
+        return -ENOMEM;
     }
-    if (watchedTree->shadow.path != NULL ) {
-        watchedTree->shadow.pathLen = strlen( watchedTree->shadow.path );
+    watchedTree->seen.pathLen = strlen( watchedTree->seen.path );
 
-        if ( mkdir( watchedTree->shadow.path, S_IRWXU | S_IRWXG) == -1 && errno != EEXIST) {
-            logError( "unable to create shadow directory \'%s\'", watchedTree->shadow.path );
+    if ( mkdir( watchedTree->seen.path, S_IRWXU | S_IRWXG) == -1 && errno != EEXIST) {
+        logError( "unable to create directory \'%s\'", watchedTree->seen.path );
+        result = -errno;
+    } else {
+        watchedTree->seen.fd = open( watchedTree->seen.path, O_DIRECTORY | O_CLOEXEC );
+        if ( watchedTree->seen.fd == -1 ) {
+            logError( "couldn't open directory \'%s\'", watchedTree->seen.path );
             result = -errno;
         } else {
-            watchedTree->shadow.fd = open( watchedTree->shadow.path, O_DIRECTORY );
-            if ( watchedTree->shadow.fd == -1 ) {
-                logError( "couldn't open shadow directory \'%s\'", watchedTree->shadow.path );
-                result = -errno;
-            }
+            result = openStateStore( watchedTree );
         }
     }
 
@@ -589,10 +1122,11 @@ tError openRootDir( tWatchedTree * watchedTree, const char * dir )
         } else if ( S_ISDIR( fileInfo.st_mode ) ) {
             watchedTree->root.path    = rootPath;
             watchedTree->root.pathLen = strlen( rootPath );
+            watchedTree->scan.device  = fileInfo.st_dev;
 
             logDebug( "absolute root.path is \'%s\'", watchedTree->root.path );
 
-            watchedTree->root.fd = open( watchedTree->root.path, O_DIRECTORY );
+            watchedTree->root.fd = open( watchedTree->root.path, O_DIRECTORY | O_CLOEXEC );
             if ( watchedTree->root.fd < 0 ) {
                 logError( "couldn't open the root directory \'%s\'", watchedTree->root.path );
                 result = -errno;
@@ -602,6 +1136,35 @@ tError openRootDir( tWatchedTree * watchedTree, const char * dir )
     return result;
 }
 
+/**
+ * @brief true if 'inner' is 'outer', or is somewhere below it
+ */
+static bool pathIsWithin( const tDir * inner, const tDir * outer )
+{
+    return inner->pathLen >= outer->pathLen
+        && strncmp( inner->path, outer->path, outer->pathLen ) == 0
+        && ( inner->path[ outer->pathLen ] == '\0' || inner->path[ outer->pathLen ] == '/' );
+}
+
+
+/**
+ * @brief all trees share one inotify instance, which only has a single watch
+ * per directory. So a directory in two trees only reports to one of them.
+ * @param watchedTree
+ */
+static void warnIfOverlapping( const tWatchedTree * watchedTree )
+{
+    tWatchedTree * other;
+    listForEachEntry( g.treeList, other )
+    {
+        if ( pathIsWithin( &watchedTree->root, &other->root )
+          || pathIsWithin( &other->root, &watchedTree->root ) ) {
+            logWarning( "\'%s\' overlaps \'%s\'; their shared directories will only be processed by one of them",
+                        watchedTree->root.path, other->root.path );
+        }
+    }
+}
+
 #if 0
 tError childEvent( const struct epoll_event * event )
 {
@@ -655,11 +1218,13 @@ tError child( int pipeReadFd )
  * @param dir
  * @return
  */
-tError createTree( const char * dir, const char * exec )
+tError createTree( const tTreeConfig * config )
 {
     int result = 0;
 
-    if ( dir == NULL ) return -EINVAL;
+    if ( config == NULL || config->path == NULL ) return -EINVAL;
+
+    const char * dir = config->path;
 
     logDebug( "creating tree for \'%s\'", dir );
     tWatchedTree * watchedTree = (tWatchedTree *)calloc( 1, sizeof( tWatchedTree ));
@@ -668,9 +1233,10 @@ tError createTree( const char * dir, const char * exec )
     } else {
         /* since calloc() was used for this structure, the pointers it contains are already NULL */
 
-        watchedTree->pathMap  = newHashMap();
-        watchedTree->watchMap = newHashMap();
-        watchedTree->watchMap = newHashMap();
+        watchedTree->pathMap   = newHashMap( fsNodePathMatches );
+        watchedTree->cookieMap = newHashMap( NULL );
+        watchedTree->scan.stamps = newHashMap( NULL );
+        pthread_mutex_init( &watchedTree->scan.stampLock, NULL );
 
         tFSNode * rootNode = calloc(1, sizeof(tFSNode) );
         if (rootNode == NULL )
@@ -680,22 +1246,79 @@ tError createTree( const char * dir, const char * exec )
         }
         watchedTree->rootNode = rootNode;
 
-        watchedTree->exec = strdup( exec );
+        /* a worker line is compiled just like an exec line. A plugin has neither */
+        const char * exec = ( config->worker != NULL ) ? config->worker : config->exec;
+        if ( exec != NULL ) {
+            watchedTree->exec = strdup( exec );
+            watchedTree->command = compileExec( watchedTree->exec );
+            if ( watchedTree->command == NULL ) {
+                logError( "unable to compile the exec line \'%s\'", exec );
+                free( (void *)watchedTree->exec );
+                free( rootNode );
+                free( watchedTree );
+                return -EINVAL;
+            }
+            if ( watchedTree->command->shell ) {
+                logSetErrno( 0 );
+                logInfo( "\'%s\' needs a shell, so it will be run by bash", exec );
+            }
+        }
+        if ( config->worker != NULL ) {
+            /* as many as the tree may process at once */
+            watchedTree->workers = newWorkerPool( ( config->jobs != 0 ) ? config->jobs : g.jobs.limit );
+            if ( watchedTree->workers == NULL ) {
+                freeExecTemplate( watchedTree->command );
+                free( (void *)watchedTree->exec );
+                free( rootNode );
+                free( watchedTree );
+                return -ENOMEM;
+            }
+        }
+        watchedTree->writeScripts = config->writeScripts;
+        watchedTree->scriptsFd    = -1;
+        watchedTree->jobs.limit = config->jobs;
+        watchedTree->idle = ( config->idle != 0 ) ? config->idle : g.timeout.idle;
+        watchedTree->inotify.mask = ( config->events != 0 ) ? config->events : kDefaultEventMask;
+        watchedTree->inotify.mask |= kRequiredEventMask;
+        watchedTree->useXattr = config->useXattr;
+        if ( watchedTree->useXattr && (watchedTree->inotify.mask & (IN_ATTRIB | IN_OPEN | IN_CLOSE_NOWRITE)) ) {
+            /* setting the xattr would make the file look like it needs processing again,
+             * and so would opening the file to get at it */
+            logWarning( "'%s' keeps its state in xattrs, so it can't watch for 'attrib', "
+                        "'open' or 'close_nowrite' events", dir );
+            watchedTree->inotify.mask &= ~(IN_ATTRIB | IN_OPEN | IN_CLOSE_NOWRITE);
+        }
 
         result = openRootDir( watchedTree, dir );
         if ( result == 0 )
         {
-            result = makeShadowRoot(watchedTree);
+            result = makeSeenDir(watchedTree);
 
-            logDebug( "root.fd: %d, shadow.fd: %d", watchedTree->root.fd, watchedTree->shadow.fd );
+            logDebug( "root.fd: %d, seen.fd: %d", watchedTree->root.fd, watchedTree->seen.fd );
         }
 
-        if (result == 0) {
-            result = registerForInotifyEvents( watchedTree );
+        if ( result == 0 && config->plugin != NULL ) {
+            watchedTree->plugin = loadPlugin( config->plugin, watchedTree->root.path );
+            if ( watchedTree->plugin == NULL ) {
+                result = -EINVAL;
+            }
+        }
+
+        if ( result == 0 && watchedTree->writeScripts ) {
+            if ( mkdirat( watchedTree->seen.fd, "scripts", S_IRWXU | S_IRGRP | S_IXGRP ) == -1 && errno != EEXIST ) {
+                result = -errno;
+            } else {
+                watchedTree->scriptsFd = openat( watchedTree->seen.fd, "scripts", O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+                if ( watchedTree->scriptsFd == -1 ) result = -errno;
+            }
+            if ( result != 0 ) {
+                logError( "unable to open \'%s/scripts\'", watchedTree->seen.path );
+            }
         }
 
         if ( result == 0 ) {
-            result = listAppend( gEvent.treeList, &watchedTree->queue );
+            warnIfOverlapping( watchedTree );
+            result = listAppend( g.treeList, &watchedTree->queue );
         }
 
         if ( result == 0 )
@@ -707,12 +1330,26 @@ tError createTree( const char * dir, const char * exec )
             rootNode->relPath       = &rootNode->path[ strlen(rootNode->path) ];
             rootNode->expires.every = g.timeout.rescan;
 
-            result = rescanTree(rootNode );
+            if ( applyTakeover( watchedTree ) == 0 ) {
+                /* its nodes and their watches carried over, with no events missed. So there's
+                 * nothing to catch up on, just the next rescan to schedule */
+                resetExpiration( rootNode, kRescan );
+            } else {
+                if ( loadSnapshot( watchedTree ) != 0 ) {
+                    logWarning( "unable to restore '%s' from its snapshot, so it will be scanned deeply",
+                                watchedTree->root.path );
+                    logSetErrno( 0 );
+                }
+
+                result = rescanTree(rootNode );
+            }
         }
         else {
+            free( watchedTree->workers );
+            freeExecTemplate( watchedTree->command );
             free( (void *)watchedTree->exec );
             free( (void *)watchedTree->root.path );
-            free( (void *)watchedTree->shadow.path );
+            free( (void *)watchedTree->seen.path );
             free( watchedTree );
             free( rootNode );
         }
@@ -879,9 +1516,9 @@ tError initEventLoop( void )
 {
     tError result = 0;
 
-    gEvent.treeList = newList();
+    g.treeList = newList();
 
-    gEvent.epoll.fd = epoll_create1( 0 );
+    gEvent.epoll.fd = epoll_create1( EPOLL_CLOEXEC );
 
     sigset_t mask;
     sigfillset( &mask );
@@ -898,6 +1535,37 @@ tError initEventLoop( void )
         result = registerFdToEpoll( gEvent.signal.fd, kSignalEvent );
     }
 
+    if ( result == 0 ) {
+        gEvent.timer.fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+        if ( gEvent.timer.fd == -1 ) {
+            result = -errno;
+            logError( "unable to allocate a new timer fd" );
+        } else {
+            result = registerFdToEpoll( gEvent.timer.fd, kTimerEvent );
+        }
+    }
+
+    if ( result == 0 ) {
+        result = registerForInotifyEvents( kInotifyEvent );
+    }
+
+    if ( result == 0 ) {
+        result = initScanPool( kScanEvent );
+    }
+
+    if ( result == 0 ) {
+        result = registerForkServer( kForkServerEvent );
+    }
+
+    if ( result == 0 ) {
+        result = registerForWorkerEvents( kWorkerEvent );
+    }
+
+    if ( result == 0 ) {
+        result = initPlugins( kPluginEvent );
+    }
+
+
     return result;
 }
 
@@ -936,6 +1604,12 @@ tError startDaemon( void )
 {
     tError result;
 
+    /* not fatal: it just means a new process would have to start from scratch */
+    if ( listenForTakeover( kTakeoverEvent, kTakeoverPeerEvent ) != 0 ) {
+        logWarning( "unable to listen for a takeover" );
+        logSetErrno( 0 );
+    }
+
     result = eventLoop();
 
     return result;
@@ -6,11 +6,12 @@
 #define PROCESSNEWFILES__EVENTS_H_
 
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "list.h"
 
 typedef uint32_t    tCookie;
 typedef int         tWatchID;
-typedef int         tNFTWresult;
 
 typedef enum {
     kUnset = 0, kTreeRoot, kRescan, kFirstSeen, kModified, kMoved, kRetry
@@ -28,6 +29,18 @@ typedef enum {
     kFile
 } tFSNodeType;
 
+typedef struct {
+    const char *    path;
+    const char *    exec;
+    unsigned int    jobs;   // zero means only the global limit applies
+    tTick           idle;   // in milliseconds, zero means use g.timeout.idle
+    uint32_t        events; // inotify event mask, zero means use kDefaultEventMask
+    bool            useXattr;   // record each file's state in an xattr on the file itself
+    bool            writeScripts;   // write each job out as a script, to debug it with
+    const char *    worker; // instead of 'exec': a long-lived worker that each file is sent to
+    const char *    plugin; // ...or a shared object that handles each file in-process (see pnfPlugin.h)
+} tTreeConfig;
+
 /* circular dependency, so forward-declare tWatchedTree */
 typedef struct nextWatchedTree tWatchedTree;
 
@@ -42,14 +55,26 @@ typedef struct sFSNode {
     tHash           pathHash;   // hash of the full path
     tWatchID        watchID;    // the watchID iNotify gave us
     tCookie         cookie;     // only used for the 'move' events
+    uint32_t        dirtyEpoch; // directories: the epoch in which it last had an event
+    tListEntry      dirty;      // ...on the list of those that have had one recently (see inotify.c)
 
     struct {
-        time_t          at;         // when it has been idle long enough (i.e. resetExpiration hasn't been called)
+        tTick           at;         // when it has been idle long enough (i.e. resetExpiration hasn't been called)
+        tTick           filed;      // deadline it's filed under in g.expiring (zero if it isn't)
         tExpiredReason  because;    // why the file was being watched in the first place
-        time_t          every;      // keep track of how long to wait between retries
+        tTick           every;      // keep track of how long to wait between retries (in milliseconds)
         int             retries;    // keep track of how many times we've tried & failed to process this
     } expires;
 
+    struct {
+        pid_t           pid;        // non-zero while the node's script is executing
+        tFileDscr       pidfd;      // lets epoll tell us when the child exits (-1 if unavailable)
+        bool            forkServer; // it was started by the fork server, which reports when it exits
+        struct sWorker * worker;    // or it was sent to this worker, which replies when it's done (see worker.h)
+        struct sPluginJob * plugin; // or it was handed to its tree's plugin, which calls back when it's done
+        bool            forgotten;  // it was deleted while running, so it's forgotten once it's done
+    } child;
+
     tFSNodeType     type;
 } tFSNode;
 
@@ -59,27 +84,75 @@ typedef struct nextWatchedTree {
     tFSNode *   rootNode;   // the tree's root node. it expires regularly to trigger a rescan of this hierarchy
 
     tHashMap *  pathMap;    // the path hash hashmap
-    tHashMap *  watchMap;   // the watchID hashmap
     tHashMap *  cookieMap;  // the cookie hashmap (only used to match up pairs of 'move' events)
 
     struct {
-        tFileDscr   fd;
+        uint32_t    mask;       // what the tree's directories are watched for
+        struct {
+            unsigned long received; // events read from inotify
+            unsigned long ignored;  // events that didn't change any state (e.g. IN_ATTRIB)
+            unsigned long logged;   // 'received' when the stats were last logged
+        } count;
     }  inotify;
 
     tDir root;
-    tDir shadow;
+    tDir seen;      // '<root>/.seen', which holds the state store
+
+    struct sStateStore * state;     // what's known about the tree's files
+    bool         useXattr;  // ...which is kept in an xattr on each file, where the filesystem allows
+
+    const char * exec;              // or the worker line, if it has workers
+    struct sExecTemplate * command; // ...compiled
+    struct sWorkerPool * workers;   // 'worker' mode: the files are sent to these (NULL if each gets a child of its own)
+    struct sPlugin * plugin;        // 'plugin' mode: the files are handled in-process by this (NULL if not)
+    bool         writeScripts;      // a debugging aid: each job is also written out as a script...
+    tFileDscr    scriptsFd;         // ...in '.seen/scripts', which is kept until the job succeeds
 
-    const char * exec;
+    tTick        idle;      // how long a file must be left alone before it's processed (in milliseconds)
+
+    struct {
+        dev_t           device;         // the filesystem the root is on. Scans don't leave it
+        bool            running;        // a full scan of the tree is in progress
+        bool            background;     // ...on the scan threads, so the cursor's shallow rescans aren't part of it
+        bool            deep;           // ...and it's looking at every file, even in directories that haven't changed
+        tTick           started;
+        tTick           deepAt;         // when the next deep scan is due
+        uint8_t         generation;     // the state store's generation for this deep scan (zero if it isn't one)
+        struct sTreeScan * cursor;      // a scan being stepped through on the event loop (NULL if none)
+        pthread_mutex_t stampLock;      // the scan threads share the stamps
+        tHashMap *      stamps;         // each directory's mtime & ctime when its files were last looked at
+        atomic_uint     outstanding;    // directories queued or being scanned by the scan threads
+        atomic_ulong    dirs;
+        atomic_ulong    unchanged;      // directories whose files weren't looked at
+        atomic_ulong    files;
+        atomic_ulong    stats;
+        atomic_ulong    errors;         // directories that couldn't be read
+        struct {
+            tTick           at;         // when the tree started catching up on an inotify overflow (zero if it isn't)
+            bool            full;       // ...by rescanning all of it, rather than its recently active directories
+        } overflow;
+    } scan;
+
+    struct {
+        unsigned int limit;     // maximum concurrent children for this tree (zero means only the global limit applies)
+        unsigned int running;   // number of this tree's nodes currently executing
+    } jobs;
 
 } tWatchedTree;
 
 
+extern const char * const expiredReasonAsStr[];
+
 void    forgetNode( tFSNode * fsNode );
 
-tError  createTree( const char * dir, const char * exec );
+tError  createTree( const tTreeConfig * config );
 
 tError  fileExpired( tFSNode * node );
 
+tError  dispatchReadyNodes( void );
+
+void    childExited( tFSNode * fileNode, const siginfo_t * info );
+
 tError  registerFdToEpoll( tFileDscr fd, uint64_t data );
 
 pid_t   getDaemonPID( void );
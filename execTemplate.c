@@ -0,0 +1,764 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include <ctype.h>
+
+#include "execTemplate.h"
+
+static const char * const kExecVariableNames[ kExecVariableCount ] = {
+    [kExecFile]    = "FILE",
+    [kExecRelPath] = "RELPATH",
+    [kExecReason]  = "REASON",
+    [kExecTree]    = "TREE",
+    [kExecAttempt] = "ATTEMPT"
+};
+
+static const char * const kExecPlaceholders[ kExecValueCount ] = {
+    [kExecFile]    = "path",
+    [kExecRelPath] = "relpath",
+    [kExecReason]  = "reason",
+    [kExecTree]    = "tree",
+    [kExecAttempt] = "attempt",
+    [kExecDir]     = "dir",
+    [kExecStem]    = "stem",
+    [kExecExt]     = "ext",
+    [kExecSize]    = "size"
+};
+
+/* the longest a reason, or a number, can be */
+#define kExecShortValue     64
+
+/* outside quotes, these need a shell to make sense of them */
+static const char kShellSpecial[] = "|&;<>()`*?[";
+
+typedef struct {
+    tExecTemplate * template;
+    size_t          capacity;   // tokens allocated
+    char *          out;        // where the next character of a literal goes
+    char *          literal;    // where the literal being built starts
+    bool            inWord;
+} tCompiler;
+
+
+/**
+ * @brief the most room a value can take up in the argv buffer
+ */
+static size_t maxLength( tExecValueId value, tExecQuoting quoting )
+{
+    size_t length = ( value == kExecReason || value == kExecAttempt || value == kExecSize )
+                  ? kExecShortValue : PATH_MAX;
+    switch ( quoting ) {
+    case kQuoteNone:   return length;
+    case kQuoteBare:   return 2 + 4 * length;   // every ' becomes '\''
+    case kQuoteSingle: return 4 * length;
+    case kQuoteDouble: return 2 * length;       // every \ " $ ` gains a backslash
+    }
+    return length;
+}
+
+
+static tError addToken( tCompiler * compiler, tExecTokenType type, tExecValueId value,
+                        tExecQuoting quoting, const char * text, size_t length )
+{
+    tExecTemplate * template = compiler->template;
+
+    if ( template->count == compiler->capacity ) {
+        size_t       capacity = ( compiler->capacity == 0 ) ? 16 : compiler->capacity * 2;
+        tExecToken * tokens   = realloc( template->tokens, capacity * sizeof( tExecToken ) );
+        if ( tokens == NULL ) {
+            return -ENOMEM;
+        }
+        template->tokens   = tokens;
+        compiler->capacity = capacity;
+    }
+
+    tExecToken * token = &template->tokens[ template->count++ ];
+    token->type    = type;
+    token->value   = value;
+    token->quoting = quoting;
+    token->text    = text;
+    token->length  = length;
+
+    switch ( type ) {
+    case kTokenLiteral:
+        template->args.size += length;
+        break;
+
+    case kTokenValue:
+        template->args.size += maxLength( value, quoting );
+        template->uses      |= 1u << value;
+        break;
+
+    case kTokenEndOfWord:
+        template->args.size += 1;
+        ++template->words;
+        break;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief turn the characters collected since the last token into a literal token
+ */
+static tError flushLiteral( tCompiler * compiler )
+{
+    tError result = 0;
+
+    if ( compiler->out > compiler->literal ) {
+        result = addToken( compiler, kTokenLiteral, 0, kQuoteNone, compiler->literal,
+                           (size_t)(compiler->out - compiler->literal) );
+        *compiler->out++  = '\0';
+        compiler->literal = compiler->out;
+    }
+    return result;
+}
+
+
+static tError endWord( tCompiler * compiler )
+{
+    tError result = flushLiteral( compiler );
+    if ( result == 0 ) {
+        result = addToken( compiler, kTokenEndOfWord, 0, kQuoteNone, NULL, 0 );
+    }
+    compiler->inWord = false;
+
+    return result;
+}
+
+
+static inline bool isNameStart( char c )
+{
+    return ( isalpha( (unsigned char)c ) || c == '_' );
+}
+
+static inline bool isNameChar( char c )
+{
+    return ( isalnum( (unsigned char)c ) || c == '_' );
+}
+
+
+/**
+ * @brief
+ * @param compiler
+ * @return true if all there is of the current word is a plain name, so an '=' makes it an assignment
+ */
+static bool isAssignment( const tCompiler * compiler )
+{
+    if ( compiler->template->count != 0 || compiler->out == compiler->literal
+      || !isNameStart( *compiler->literal ) ) {
+        return false;
+    }
+    for ( const char * p = compiler->literal; p < compiler->out; ++p ) {
+        if ( !isNameChar( *p ) ) return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief compile a placeholder, if that's what it is
+ * @param compiler
+ * @param p points at the '{', and is left at the '}' if it's a placeholder
+ * @param quoting
+ * @return 1 if it was a placeholder, 0 if it wasn't, or a negative error
+ */
+static tError compilePlaceholder( tCompiler * compiler, const char ** p, tExecQuoting quoting )
+{
+    const char * start = *p + 1;
+    const char * end   = strchr( start, '}' );
+    if ( end == NULL ) {
+        return 0;
+    }
+
+    size_t length = (size_t)(end - start);
+    for ( tExecValueId value = 0; value < kExecValueCount; ++value ) {
+        if ( strlen( kExecPlaceholders[ value ] ) == length
+          && strncmp( kExecPlaceholders[ value ], start, length ) == 0 ) {
+            tError result = flushLiteral( compiler );
+            if ( result == 0 ) {
+                result = addToken( compiler, kTokenValue, value, quoting, NULL, 0 );
+            }
+            *p = end;
+            return ( result == 0 ) ? 1 : result;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief compile a $NAME or ${NAME}
+ * @param compiler
+ * @param p points at the '$', and is left at the last character of the reference
+ * @return -ENOTSUP if it's something only a shell can expand, e.g. $(...) or ${NAME:-default}
+ */
+static tError compileVariable( tCompiler * compiler, const char ** p )
+{
+    const char * start = *p + 1;
+    const char * end;
+
+    if ( *start == '{' ) {
+        ++start;
+        end = start;
+        if ( !isNameStart( *end ) ) return -ENOTSUP;
+        while ( isNameChar( *end ) ) ++end;
+        if ( *end != '}' ) return -ENOTSUP;
+        *p = end;
+    } else if ( isNameStart( *start ) ) {
+        end = start;
+        while ( isNameChar( *end ) ) ++end;
+        *p = end - 1;
+    } else if ( *start == '\0' || isspace( (unsigned char)*start ) || *start == '"' ) {
+        /* a lone '$' is just a '$' */
+        *compiler->out++ = '$';
+        return 0;
+    } else {
+        /* $?, $1, $$, $(...) and so on */
+        return -ENOTSUP;
+    }
+
+    size_t length = (size_t)(end - start);
+    for ( tExecValueId value = 0; value < kExecVariableCount; ++value ) {
+        if ( strlen( kExecVariableNames[ value ] ) == length
+          && strncmp( kExecVariableNames[ value ], start, length ) == 0 ) {
+            tError result = flushLiteral( compiler );
+            if ( result == 0 ) {
+                result = addToken( compiler, kTokenValue, value, kQuoteNone, NULL, 0 );
+            }
+            return result;
+        }
+    }
+
+    /* any other variable comes from our environment, which doesn't change. So it's just more literal */
+    char name[ 256 ];
+    if ( length >= sizeof( name ) ) {
+        return -ENOTSUP;
+    }
+    memcpy( name, start, length );
+    name[ length ] = '\0';
+
+    const char * text = getenv( name );
+    if ( text != NULL ) {
+        size_t len = strlen( text );
+        memcpy( compiler->out, text, len );
+        compiler->out += len;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief split the exec line into words, removing quotes, and find the
+ * placeholders and variables in them
+ * @param compiler
+ * @param exec
+ * @return -ENOTSUP if it needs a shell
+ */
+static tError compileWords( tCompiler * compiler, const char * exec )
+{
+    tError result = 0;
+    char   quote  = '\0';   // the quote we're within, if any
+
+    for ( const char * p = exec; *p != '\0' && result == 0; ++p ) {
+        char c = *p;
+
+        if ( c == '{' ) {
+            /* they're ours, not the shell's, so they're the same inside quotes */
+            result = compilePlaceholder( compiler, &p, kQuoteNone );
+            if ( result == 1 ) {
+                compiler->inWord = true;
+                result = 0;
+                continue;
+            }
+            if ( result != 0 ) break;
+        }
+
+        if ( quote == '\'' ) {
+            if ( c == '\'' ) {
+                quote = '\0';
+            } else {
+                *compiler->out++ = c;
+            }
+        } else if ( quote == '"' ) {
+            if ( c == '"' ) {
+                quote = '\0';
+            } else if ( c == '\\' && p[1] != '\0' && strchr( "\"\\$`", p[1] ) != NULL ) {
+                *compiler->out++ = *++p;
+            } else if ( c == '$' ) {
+                result = compileVariable( compiler, &p );
+            } else if ( c == '`' ) {
+                result = -ENOTSUP;
+            } else {
+                *compiler->out++ = c;
+            }
+        } else if ( isspace( (unsigned char)c ) ) {
+            if ( compiler->inWord ) {
+                result = endWord( compiler );
+            }
+        } else if ( strchr( kShellSpecial, c ) != NULL
+                 || ( !compiler->inWord && ( c == '#' || c == '~' ) ) ) {
+            result = -ENOTSUP;
+        } else {
+            if ( c == '=' && compiler->template->words == 0 && isAssignment( compiler ) ) {
+                /* 'NAME=value command' sets a variable for the command */
+                result = -ENOTSUP;
+                break;
+            }
+            compiler->inWord = true;
+            if ( c == '\'' || c == '"' ) {
+                quote = c;
+            } else if ( c == '\\' ) {
+                if ( p[1] == '\0' ) {
+                    result = -ENOTSUP;
+                } else {
+                    *compiler->out++ = *++p;
+                }
+            } else if ( c == '$' ) {
+                result = compileVariable( compiler, &p );
+            } else {
+                *compiler->out++ = c;
+            }
+        }
+    }
+
+    if ( result == 0 && quote != '\0' ) {
+        /* leave bash to complain about it */
+        result = -ENOTSUP;
+    }
+    if ( result == 0 && compiler->inWord ) {
+        result = endWord( compiler );
+    }
+    if ( result == 0 && compiler->template->words == 0 ) {
+        result = -EINVAL;
+    }
+    return result;
+}
+
+
+/**
+ * @brief compile the exec line as the script for 'bash -c'. It's left as it
+ * is, apart from its placeholders, so the quoting they're within is followed
+ * @param compiler
+ * @param exec
+ * @return
+ */
+static tError compileScript( tCompiler * compiler, const char * exec )
+{
+    tError       result  = 0;
+    tExecQuoting quoting = kQuoteBare;
+
+    for ( const char * p = exec; *p != '\0' && result == 0; ++p ) {
+        char c = *p;
+
+        if ( c == '$' && p[1] == '{' && quoting != kQuoteSingle ) {
+            /* bash's ${...}, not '$' and a placeholder (which bash would take as $'...'),
+             * so it's copied as it is, placeholders and all, up to its matching '}' */
+            unsigned int depth = 0;
+            *compiler->out++ = *p++;
+            do {
+                if ( *p == '\\' && p[1] != '\0' ) {
+                    *compiler->out++ = *p++;
+                } else if ( *p == '{' ) {
+                    ++depth;
+                } else if ( *p == '}' ) {
+                    --depth;
+                }
+                *compiler->out++ = *p;
+            } while ( depth > 0 && *++p != '\0' );
+            if ( *p == '\0' ) break;   // unterminated, which bash can complain about
+            continue;
+        }
+
+        if ( c == '{' ) {
+            result = compilePlaceholder( compiler, &p, quoting );
+            if ( result == 1 ) {
+                result = 0;
+                continue;
+            }
+            if ( result != 0 ) break;
+        }
+
+        *compiler->out++ = c;
+        if ( quoting == kQuoteSingle ) {
+            if ( c == '\'' ) quoting = kQuoteBare;
+        } else if ( c == '\\' && p[1] != '\0' ) {
+            *compiler->out++ = *++p;
+        } else if ( c == '"' ) {
+            quoting = ( quoting == kQuoteDouble ) ? kQuoteBare : kQuoteDouble;
+        } else if ( c == '\'' && quoting == kQuoteBare ) {
+            quoting = kQuoteSingle;
+        }
+    }
+
+    if ( result == 0 ) {
+        result = endWord( compiler );
+    }
+    return result;
+}
+
+
+/**
+ * @brief set aside the buffers each job's argv and environment are built in
+ * @param template
+ * @return
+ */
+static tError allocateBuffers( tExecTemplate * template )
+{
+    template->args.argv   = calloc( template->words + 1, sizeof( char * ) );
+    template->args.buffer = malloc( template->args.size );
+
+    size_t count = 0;
+    while ( environ[ count ] != NULL ) ++count;
+    template->env.capacity = count + kExecVariableCount + 1;
+    template->env.envp     = calloc( template->env.capacity, sizeof( char * ) );
+    template->env.size     = kExecVariableCount * ( 16 + PATH_MAX );
+    template->env.buffer   = malloc( template->env.size );
+
+    if ( template->args.argv == NULL || template->args.buffer == NULL
+      || template->env.envp == NULL || template->env.buffer == NULL ) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief how much longer the line gets when the variables from our environment are expanded
+ */
+static size_t expansionLength( const char * exec )
+{
+    size_t length = 0;
+
+    for ( const char * p = strchr( exec, '$' ); p != NULL; p = strchr( p + 1, '$' ) ) {
+        const char * start = ( p[1] == '{' ) ? p + 2 : p + 1;
+        const char * end   = start;
+        while ( isNameChar( *end ) ) ++end;
+
+        char name[ 256 ];
+        if ( end > start && (size_t)(end - start) < sizeof( name ) ) {
+            memcpy( name, start, (size_t)(end - start) );
+            name[ end - start ] = '\0';
+            const char * text = getenv( name );
+            if ( text != NULL ) {
+                length += strlen( text );
+            }
+        }
+    }
+    return length;
+}
+
+
+/**
+ * @brief
+ * @param exec
+ * @return the compiled template, to be freed by freeExecTemplate(). NULL if
+ * it's empty, or we're out of memory
+ */
+tExecTemplate * compileExec( const char * exec )
+{
+    tExecTemplate * template = calloc( 1, sizeof( tExecTemplate ) );
+    if ( template == NULL ) {
+        return NULL;
+    }
+
+    /* every literal is shorter than the line, even with a NUL after each.
+     * Plus room for the words of 'bash -c', if it comes to that */
+    size_t length = strlen( exec ) + expansionLength( exec );
+    template->source  = exec;
+    template->strings = malloc( 2 * length + 32 );
+    if ( template->strings == NULL ) {
+        free( template );
+        return NULL;
+    }
+
+    tCompiler compiler = {
+        .template = template,
+        .out      = template->strings,
+        .literal  = template->strings
+    };
+    tError result = compileWords( &compiler, exec );
+
+    if ( result == -ENOTSUP ) {
+        /* start again, as 'bash -c <exec>' */
+        template->shell     = true;
+        template->uses      = 0;
+        template->count     = 0;
+        template->words     = 0;
+        template->args.size = 0;
+        compiler.out     = template->strings;
+        compiler.literal = template->strings;
+        compiler.inWord  = false;
+
+        result = compileWords( &compiler, "/bin/bash -c" );
+        if ( result == 0 ) {
+            result = compileScript( &compiler, exec );
+        }
+    }
+
+    if ( result == 0 ) {
+        /* the variables are always in the environment */
+        template->uses |= (1u << kExecVariableCount) - 1;
+        result = allocateBuffers( template );
+    }
+
+    if ( result != 0 ) {
+        freeExecTemplate( template );
+        return NULL;
+    }
+    return template;
+}
+
+
+void freeExecTemplate( tExecTemplate * template )
+{
+    if ( template == NULL ) return;
+
+    free( template->tokens );
+    free( template->strings );
+    free( template->args.argv );
+    free( template->args.buffer );
+    free( template->env.envp );
+    free( template->env.buffer );
+    free( template );
+}
+
+
+/**
+ * @brief set the values that are parts of the file's path
+ * @param values {dir}, {stem} and {ext} are set
+ * @param path
+ */
+void setPathValues( tExecValue values[ kExecValueCount ], const char * path )
+{
+    const char * name = strrchr( path, '/' );
+    name = ( name != NULL ) ? name + 1 : path;
+
+    size_t dirLen = (size_t)(name - path);
+    if ( dirLen > 1 ) --dirLen;     // leave off the '/', unless it's the root
+    values[ kExecDir ] = (tExecValue){ .text = path, .length = dirLen };
+
+    /* a name that starts with a '.', and has no other, has no extension */
+    const char * dot = strrchr( name, '.' );
+    if ( dot == NULL || dot == name ) {
+        dot = name + strlen( name );
+        values[ kExecExt ] = (tExecValue){ .text = dot, .length = 0 };
+    } else {
+        values[ kExecExt ] = execString( dot + 1 );
+    }
+    values[ kExecStem ] = (tExecValue){ .text = name, .length = (size_t)(dot - name) };
+}
+
+
+/**
+ * @brief copy a value, quoted to suit where it is
+ * @param out
+ * @param end the end of the buffer
+ * @param value
+ * @param quoting
+ * @return just past the copy, or NULL if it doesn't fit
+ */
+static char * copyValue( char * out, const char * end, const tExecValue * value, tExecQuoting quoting )
+{
+    if ( quoting == kQuoteNone ) {
+        if ( out + value->length > end ) return NULL;
+        memcpy( out, value->text, value->length );
+        return out + value->length;
+    }
+
+    if ( quoting == kQuoteBare ) {
+        if ( out >= end ) return NULL;
+        *out++ = '\'';
+    }
+    for ( size_t i = 0; i < value->length; ++i ) {
+        char c = value->text[ i ];
+        if ( out + 4 > end ) return NULL;
+        if ( c == '\'' && quoting != kQuoteDouble ) {
+            /* close the quote, add an escaped one, and open it again */
+            memcpy( out, "'\\''", 4 );
+            out += 4;
+        } else {
+            if ( quoting == kQuoteDouble && strchr( "\\\"$`", c ) != NULL ) {
+                *out++ = '\\';
+            }
+            *out++ = c;
+        }
+    }
+    if ( quoting == kQuoteBare ) {
+        if ( out >= end ) return NULL;
+        *out++ = '\'';
+    }
+    return out;
+}
+
+
+/**
+ * @brief fill in the template's values, in a single pass over its tokens
+ * @param template
+ * @param values each one's value for this job
+ * @return a NULL-terminated argv. It's within the template, so it's only
+ * good until the next job is built. NULL if a value is too long
+ */
+char ** buildExecArgv( tExecTemplate * template, const tExecValue values[ kExecValueCount ] )
+{
+    char *       out  = template->args.buffer;
+    const char * end  = out + template->args.size;
+    char **      argv = template->args.argv;
+    unsigned int word = 0;
+
+    argv[ word ] = out;
+    for ( unsigned int i = 0; i < template->count && out != NULL; ++i ) {
+        const tExecToken * token = &template->tokens[ i ];
+        switch ( token->type ) {
+        case kTokenLiteral:
+            if ( out + token->length > end ) {
+                out = NULL;
+            } else {
+                memcpy( out, token->text, token->length );
+                out += token->length;
+            }
+            break;
+
+        case kTokenValue:
+            out = copyValue( out, end, &values[ token->value ], token->quoting );
+            break;
+
+        case kTokenEndOfWord:
+            if ( out >= end ) {
+                out = NULL;
+            } else {
+                *out++ = '\0';
+                argv[ ++word ] = out;
+            }
+            break;
+        }
+    }
+    if ( out == NULL ) {
+        return NULL;
+    }
+    argv[ word ] = NULL;
+
+    return argv;
+}
+
+
+/**
+ * @brief build the environment for a child: the variables, then ours
+ * @param template
+ * @param values
+ * @return a NULL-terminated array, within the template, so it's only good
+ * until the next job is built. NULL if we're out of memory
+ */
+char ** buildExecEnv( tExecTemplate * template, const tExecValue values[ kExecValueCount ] )
+{
+    size_t count = 0;
+    while ( environ[ count ] != NULL ) ++count;
+
+    if ( count + kExecVariableCount + 1 > template->env.capacity ) {
+        /* someone has set another environment variable since */
+        char ** envp = realloc( template->env.envp, ( count + kExecVariableCount + 1 ) * sizeof( char * ) );
+        if ( envp == NULL ) {
+            return NULL;
+        }
+        template->env.envp     = envp;
+        template->env.capacity = count + kExecVariableCount + 1;
+    }
+
+    char ** envp = template->env.envp;
+    char *  out  = template->env.buffer;
+    for ( tExecValueId value = 0; value < kExecVariableCount; ++value ) {
+        size_t nameLen = strlen( kExecVariableNames[ value ] );
+        envp[ value ] = out;
+        memcpy( out, kExecVariableNames[ value ], nameLen );
+        out += nameLen;
+        *out++ = '=';
+        size_t length = values[ value ].length;
+        if ( length > PATH_MAX ) length = PATH_MAX;
+        memcpy( out, values[ value ].text, length );
+        out += length;
+        *out++ = '\0';
+    }
+
+    /* then ours, leaving out any of the variables we inherited, so there is only one of each */
+    size_t used = kExecVariableCount;
+    for ( size_t i = 0; i < count; ++i ) {
+        bool ours = true;
+        for ( tExecValueId value = 0; value < kExecVariableCount && ours; ++value ) {
+            size_t len = strlen( kExecVariableNames[ value ] );
+            if ( strncmp( environ[ i ], kExecVariableNames[ value ], len ) == 0 && environ[ i ][ len ] == '=' ) {
+                ours = false;
+            }
+        }
+        if ( ours ) {
+            envp[ used++ ] = environ[ i ];
+        }
+    }
+    envp[ used ] = NULL;
+
+    return envp;
+}
+
+
+/**
+ * @brief write a single-quoted word, so the shell takes it literally
+ */
+static void writeQuoted( FILE * file, const char * word, size_t length )
+{
+    fputc( '\'', file );
+    for ( size_t i = 0; i < length; ++i ) {
+        if ( word[ i ] == '\'' ) {
+            fputs( "'\\''", file );
+        } else {
+            fputc( word[ i ], file );
+        }
+    }
+    fputc( '\'', file );
+}
+
+
+/**
+ * @brief a debugging aid: write a script that runs the job again, exactly as it was run
+ * @param dirFd where to write it
+ * @param name
+ * @param argv
+ * @param values
+ * @return
+ */
+tError writeExecScript( tFileDscr dirFd, const char * name, char * const argv[],
+                        const tExecValue values[ kExecValueCount ] )
+{
+    tError result = 0;
+
+    tFileDscr fd = openat( dirFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU | S_IRGRP | S_IXGRP );
+    if ( fd == -1 ) {
+        return -errno;
+    }
+    FILE * file = fdopen( fd, "w" );
+    if ( file == NULL ) {
+        result = -errno;
+        close( fd );
+        return result;
+    }
+
+    fprintf( file, "#!/bin/bash\n" );
+    for ( tExecValueId value = 0; value < kExecVariableCount; ++value ) {
+        fprintf( file, "export %s=", kExecVariableNames[ value ] );
+        writeQuoted( file, values[ value ].text, values[ value ].length );
+        fputc( '\n', file );
+    }
+    fprintf( file, "exec" );
+    for ( unsigned int i = 0; argv[ i ] != NULL; ++i ) {
+        fputc( ' ', file );
+        writeQuoted( file, argv[ i ], strlen( argv[ i ] ) );
+    }
+    fputc( '\n', file );
+
+    if ( fclose( file ) != 0 ) {
+        result = -errno;
+    }
+    return result;
+}
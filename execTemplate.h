@@ -0,0 +1,133 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_EXECTEMPLATE_H
+#define PROCESSNEWFILES_EXECTEMPLATE_H
+
+#include <stdint.h>
+
+/*
+ * A tree's 'exec' line is compiled once, when the tree is created, into a
+ * list of tokens: literal text, the values that change with each job, and
+ * word breaks. Each job just fills in the values, in a single pass, into a
+ * buffer the template set aside for it, to get the argv it's executed with,
+ * directly, without a shell in between. Words are split and quotes removed
+ * much as the shell would, but each word is always one argument, whatever
+ * values it holds, so a path with spaces in it needs no quoting.
+ *
+ * The values are available as placeholders:
+ *   {path}     the file's full path
+ *   {relpath}  its path relative to the tree's root
+ *   {dir}      the directory it's in
+ *   {stem}     its name, without the extension
+ *   {ext}      its extension, without the '.' (empty if it has none)
+ *   {reason}   why it's being processed, e.g. "is new"
+ *   {size}     its size, in bytes
+ *   {tree}     the tree's root
+ *   {attempt}  1 the first time, counting up with each retry
+ * Anything else in braces is left as it is.
+ *
+ * Some are also in the child's environment, and can be used as variables:
+ *   FILE, RELPATH, REASON, TREE and ATTEMPT
+ * Any other $NAME or ${NAME} is taken from our own environment when the
+ * line is compiled.
+ *
+ * An exec line that needs more than that (pipes, redirection, globs,
+ * command substitution, several commands...) is run by bash, as 'bash -c',
+ * with the same variables in its environment. Its placeholders are filled
+ * in quoted to suit where they are, so bash takes each one literally. A
+ * '${', outside single quotes, starts one of bash's expansions, which is
+ * left for bash up to its matching '}': '${path}' is the variable 'path',
+ * and there are no placeholders inside '${FILE%.{ext}}'. So "${FILE}" or
+ * {path} gets the path, but never ${path}.
+ */
+
+typedef enum {
+    kExecFile = 0,      // the first few are also environment variables
+    kExecRelPath,
+    kExecReason,
+    kExecTree,
+    kExecAttempt,
+    kExecDir,           // the rest are only placeholders
+    kExecStem,
+    kExecExt,
+    kExecSize,
+    kExecValueCount
+} tExecValueId;
+
+#define kExecVariableCount  ( kExecAttempt + 1 )
+
+/* a value needn't be NUL-terminated, so {dir}, {stem} and {ext} can point into the path */
+typedef struct {
+    const char *    text;
+    size_t          length;
+} tExecValue;
+
+typedef enum {
+    kTokenLiteral = 1,
+    kTokenValue,
+    kTokenEndOfWord
+} tExecTokenType;
+
+/* how a value is quoted, for bash */
+typedef enum {
+    kQuoteNone = 0,     // it's an argument by itself, so it isn't
+    kQuoteBare,         // outside quotes in a line run by bash
+    kQuoteSingle,       // within '...'
+    kQuoteDouble        // within "..."
+} tExecQuoting;
+
+typedef struct {
+    tExecTokenType  type;
+    tExecValueId    value;
+    tExecQuoting    quoting;
+    const char *    text;       // a literal, within 'strings'
+    size_t          length;
+} tExecToken;
+
+typedef struct sExecTemplate {
+    const char *    source;     // as configured
+    bool            shell;      // it's run by bash, as it uses shell syntax
+    uint32_t        uses;       // a bit for each tExecValueId it has a placeholder or variable for
+    unsigned int    words;
+    unsigned int    count;      // tokens
+    tExecToken *    tokens;
+    char *          strings;    // the literals, with the quoting removed
+
+    struct {
+        char **         argv;   // words + 1 pointers
+        char *          buffer; // ...into this
+        size_t          size;   // big enough for every value to be as long as it can be
+    } args;
+
+    struct {
+        char **         envp;
+        size_t          capacity;   // pointers in envp
+        char *          buffer;     // the variables, as NAME=value
+        size_t          size;
+    } env;
+} tExecTemplate;
+
+tExecTemplate * compileExec( const char * exec );
+void            freeExecTemplate( tExecTemplate * template );
+
+static inline bool execUses( const tExecTemplate * template, tExecValueId value )
+{
+    return ( template->uses & (1u << value) ) != 0;
+}
+
+static inline tExecValue execString( const char * text )
+{
+    return (tExecValue){ .text = text, .length = strlen( text ) };
+}
+
+void    setPathValues( tExecValue values[ kExecValueCount ], const char * path );
+
+char ** buildExecArgv( tExecTemplate * template, const tExecValue values[ kExecValueCount ] );
+char ** buildExecEnv( tExecTemplate * template, const tExecValue values[ kExecValueCount ] );
+
+tError  writeExecScript( tFileDscr dirFd, const char * name, char * const argv[],
+                         const tExecValue values[ kExecValueCount ] );
+
+#endif //PROCESSNEWFILES_EXECTEMPLATE_H
@@ -0,0 +1,411 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "events.h"
+#include "forkServer.h"
+
+/* a child the helper has started, and not yet reported the exit of */
+typedef struct {
+    pid_t       pid;
+    uint64_t    id;
+} tHelperChild;
+
+static struct {
+    pid_t       pid;        // the helper's (zero if it isn't running)
+    tFileDscr   fd;         // our end of the socketpair
+    char *      buffer;     // requests are assembled in this
+    uint64_t    epollData;  // for its reports
+} gForkServer = { .fd = -1 };
+
+
+/**
+ * @brief start a child, with the signal mask and dispositions reset, since
+ * both the daemon and the helper block all signals so they can receive
+ * them through signalfd. A command without a '/' is looked for in $PATH,
+ * as the shell would
+ * @param pid
+ * @param argv
+ * @param envp
+ * @param actions e.g. to connect its stdin & stdout to pipes (NULL if there are none)
+ * @return
+ */
+tError spawnChild( pid_t * pid, char * const argv[], char * const envp[],
+                   const posix_spawn_file_actions_t * actions )
+{
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigset_t defaults;
+    sigfillset( &defaults );
+    sigdelset( &defaults, SIGSTOP );
+    sigdelset( &defaults, SIGKILL );
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init( &attr );
+    posix_spawnattr_setflags( &attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF );
+    posix_spawnattr_setsigmask( &attr, &mask );
+    posix_spawnattr_setsigdefault( &attr, &defaults );
+
+    int err = posix_spawnp( pid, argv[0], actions, &attr, argv, envp );
+    posix_spawnattr_destroy( &attr );
+
+    return -err;
+}
+
+
+/**
+ * @brief the helper's side: start a child for a request
+ * @param request
+ * @param length
+ * @param children the ones it has started, which this one is added to
+ * @param count
+ * @param capacity
+ * @param report to send back
+ */
+static void helperSpawn( const char * request, size_t length,
+                         tHelperChild ** children, size_t * count, size_t * capacity,
+                         tSpawnReport * report )
+{
+    tSpawnRequest header;
+    memcpy( &header, request, sizeof( header ) );
+    report->id      = header.id;
+    report->outcome = kSpawnFailed;
+    report->error   = EINVAL;
+
+    const char * strings = request + sizeof( header );
+    const char * end     = request + length;
+    if ( (size_t)header.argc + header.envc > length ) {
+        return;
+    }
+
+    char ** argv = calloc( header.argc + header.envc + 2, sizeof( char * ) );
+    if ( argv == NULL ) {
+        report->error = ENOMEM;
+        return;
+    }
+    char ** envp = &argv[ header.argc + 1 ];
+
+    /* each string must be NUL-terminated within the request */
+    const char * p = strings;
+    for ( uint32_t i = 0; i < header.argc + header.envc && p < end; ++i ) {
+        const char * nul = memchr( p, '\0', (size_t)(end - p) );
+        if ( nul == NULL ) {
+            p = end + 1;
+            break;
+        }
+        if ( i < header.argc ) {
+            argv[ i ] = (char *)p;
+        } else {
+            envp[ i - header.argc ] = (char *)p;
+        }
+        p = nul + 1;
+    }
+
+    if ( header.argc != 0 && p <= end && argv[ header.argc - 1 ] != NULL
+      && ( header.envc == 0 || envp[ header.envc - 1 ] != NULL ) ) {
+        if ( *count == *capacity ) {
+            size_t         more  = ( *capacity == 0 ) ? 16 : *capacity * 2;
+            tHelperChild * table = realloc( *children, more * sizeof( tHelperChild ) );
+            if ( table == NULL ) {
+                report->error = ENOMEM;
+                free( argv );
+                return;
+            }
+            *children = table;
+            *capacity = more;
+        }
+
+        pid_t  pid;
+        tError err = spawnChild( &pid, argv, envp, NULL );
+        if ( err == 0 ) {
+            (*children)[ (*count)++ ] = (tHelperChild){ .pid = pid, .id = header.id };
+            report->outcome = kSpawned;
+            report->pid     = pid;
+            report->error   = 0;
+        } else {
+            report->error = -err;
+        }
+    }
+    free( argv );
+}
+
+
+/**
+ * @brief the helper's main loop. It only ever returns to exit, when the daemon goes away
+ * @param fd the helper's end of the socketpair
+ */
+static void serveForks( tFileDscr fd )
+{
+    /* SIGINT & SIGTERM are for the daemon, which closes its end when it exits */
+    sigset_t mask;
+    sigfillset( &mask );
+    sigdelset( &mask, SIGSTOP );
+    sigdelset( &mask, SIGKILL );
+    sigprocmask( SIG_BLOCK, &mask, NULL );
+
+    sigset_t childMask;
+    sigemptyset( &childMask );
+    sigaddset( &childMask, SIGCHLD );
+    tFileDscr signalFd = signalfd( -1, &childMask, SFD_CLOEXEC | SFD_NONBLOCK );
+
+    char * request = malloc( kForkServerMaxRequest );
+    if ( signalFd == -1 || request == NULL ) {
+        logError( "the fork server is unable to start" );
+        return;
+    }
+
+    tHelperChild * children = NULL;
+    size_t         count    = 0;
+    size_t         capacity = 0;
+
+    struct pollfd polled[2] = {
+        { .fd = fd,       .events = POLLIN },
+        { .fd = signalFd, .events = POLLIN }
+    };
+
+    for (;;) {
+        if ( poll( polled, 2, -1 ) == -1 ) {
+            if ( errno == EINTR ) continue;
+            logError( "the fork server's poll() failed" );
+            break;
+        }
+
+        if ( polled[1].revents & POLLIN ) {
+            struct signalfd_siginfo siginfo;
+            while ( read( signalFd, &siginfo, sizeof( siginfo ) ) > 0 ) { /* just drain it */ }
+
+            siginfo_t info;
+            for (;;) {
+                info.si_pid = 0;
+                if ( waitid( P_ALL, 0, &info, WEXITED | WNOHANG ) == -1 || info.si_pid == 0 ) break;
+
+                for ( size_t i = 0; i < count; ++i ) {
+                    if ( children[ i ].pid == info.si_pid ) {
+                        tSpawnReport report = {
+                            .id      = children[ i ].id,
+                            .outcome = kExited,
+                            .pid     = info.si_pid,
+                            .code    = info.si_code,
+                            .status  = info.si_status
+                        };
+                        send( fd, &report, sizeof( report ), MSG_NOSIGNAL );
+                        children[ i ] = children[ --count ];
+                        break;
+                    }
+                }
+            }
+        }
+
+        if ( polled[0].revents & POLLIN ) {
+            ssize_t length = recv( fd, request, kForkServerMaxRequest, MSG_TRUNC );
+            if ( length <= 0 ) {
+                /* the daemon has gone */
+                break;
+            }
+            tSpawnReport report = { 0 };
+            if ( (size_t)length < sizeof( tSpawnRequest ) ) {
+                continue;
+            } else if ( length > kForkServerMaxRequest ) {
+                memcpy( &report.id, request, sizeof( report.id ) );
+                report.outcome = kSpawnFailed;
+                report.error   = E2BIG;
+            } else {
+                helperSpawn( request, (size_t)length, &children, &count, &capacity, &report );
+            }
+            if ( send( fd, &report, sizeof( report ), MSG_NOSIGNAL ) == -1 ) {
+                break;
+            }
+        } else if ( polled[0].revents & (POLLHUP | POLLERR) ) {
+            break;
+        }
+    }
+
+    free( children );
+    free( request );
+}
+
+
+/**
+ * @brief fork the helper. Call this early, while the daemon is still small,
+ * and before it starts any threads, i.e. before any tree is created
+ * @return
+ */
+tError startForkServer( void )
+{
+    tFileDscr fds[2];
+
+    if ( socketpair( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds ) == -1 ) {
+        logError( "unable to create the fork server's socketpair" );
+        return -errno;
+    }
+
+    gForkServer.buffer = malloc( kForkServerMaxRequest );
+    if ( gForkServer.buffer == NULL ) {
+        close( fds[0] );
+        close( fds[1] );
+        return -ENOMEM;
+    }
+
+    pid_t pid = fork();
+    if ( pid == -1 ) {
+        tError result = -errno;
+        logError( "unable to fork the fork server" );
+        close( fds[0] );
+        close( fds[1] );
+        free( gForkServer.buffer );
+        gForkServer.buffer = NULL;
+        return result;
+    }
+
+    if ( pid == 0 ) {
+        close( fds[0] );
+        serveForks( fds[1] );
+        _exit( 0 );
+    }
+
+    close( fds[1] );
+    /* the event loop must never wait on the helper. If it falls behind, children are started directly */
+    if ( fcntl( fds[0], F_SETFL, fcntl( fds[0], F_GETFL ) | O_NONBLOCK ) == -1 ) {
+        logWarning( "unable to make the fork server's socket non-blocking" );
+    }
+    gForkServer.fd  = fds[0];
+    gForkServer.pid = pid;
+    logSetErrno( 0 );
+    logDebug( "fork server is pid %d", pid );
+
+    /* unless nothing is waiting on its reports through epoll */
+    tError result = 0;
+    if ( gForkServer.epollData != 0 ) {
+        result = registerFdToEpoll( gForkServer.fd, gForkServer.epollData );
+        if ( result != 0 ) {
+            stopForkServer();
+        }
+    }
+    return result;
+}
+
+
+/**
+ * @brief remember what epoll is to tag the helper's reports with, once it's started
+ * @param epollData
+ * @return
+ */
+tError registerForkServer( uint64_t epollData )
+{
+    gForkServer.epollData = epollData;
+    return 0;
+}
+
+
+bool forkServerRunning( void )
+{
+    return ( gForkServer.fd != -1 );
+}
+
+
+/**
+ * @return our end of the socketpair, which is readable when the helper has
+ * reported something (-1 if it isn't running)
+ */
+tFileDscr forkServerFd( void )
+{
+    return gForkServer.fd;
+}
+
+
+/**
+ * @brief stop using the helper. Once its end of the socketpair is closed, it exits
+ */
+void stopForkServer( void )
+{
+    if ( gForkServer.fd != -1 ) {
+        /* closing it also removes it from the epoll set */
+        close( gForkServer.fd );
+        gForkServer.fd = -1;
+    }
+    if ( gForkServer.pid != 0 ) {
+        /* it exits as soon as it sees we've closed our end, so this doesn't wait for long */
+        while ( waitpid( gForkServer.pid, NULL, 0 ) == -1 && errno == EINTR ) { /* try again */ }
+        gForkServer.pid = 0;
+        logSetErrno( 0 );
+    }
+    free( gForkServer.buffer );
+    gForkServer.buffer = NULL;
+}
+
+
+/**
+ * @brief ask the helper to start a child. Its reports arrive later, through receiveSpawnReport()
+ * @param id to tag the reports with
+ * @param argv
+ * @param envp
+ * @return -E2BIG if it's too large to send, or -EAGAIN if the helper is behind,
+ * in which case the caller should spawn it directly
+ */
+tError requestSpawn( uint64_t id, char * const argv[], char * const envp[] )
+{
+    if ( !forkServerRunning() ) {
+        return -ENOTCONN;
+    }
+
+    tSpawnRequest header = { .id = id };
+    char *        out    = gForkServer.buffer + sizeof( header );
+    const char *  end    = gForkServer.buffer + kForkServerMaxRequest;
+
+    for ( unsigned int pass = 0; pass < 2; ++pass ) {
+        char * const * strings = ( pass == 0 ) ? argv : envp;
+        uint32_t       count   = 0;
+        for ( ; strings[ count ] != NULL; ++count ) {
+            size_t length = strlen( strings[ count ] ) + 1;
+            if ( out + length > end ) {
+                return -E2BIG;
+            }
+            memcpy( out, strings[ count ], length );
+            out += length;
+        }
+        if ( pass == 0 ) {
+            header.argc = count;
+        } else {
+            header.envc = count;
+        }
+    }
+    memcpy( gForkServer.buffer, &header, sizeof( header ) );
+
+    if ( send( gForkServer.fd, gForkServer.buffer, (size_t)(out - gForkServer.buffer),
+               MSG_NOSIGNAL | MSG_DONTWAIT ) == -1 ) {
+        return ( errno == EWOULDBLOCK ) ? -EAGAIN : -errno;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief
+ * @param report
+ * @return -EAGAIN if there's nothing (more) to read, -EPIPE if the helper has gone
+ */
+tError receiveSpawnReport( tSpawnReport * report )
+{
+    if ( !forkServerRunning() ) {
+        return -EPIPE;
+    }
+
+    ssize_t length = recv( gForkServer.fd, report, sizeof( *report ), MSG_DONTWAIT );
+    if ( length == -1 ) {
+        return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? -EAGAIN : -errno;
+    }
+    if ( length == 0 ) {
+        return -EPIPE;
+    }
+    if ( (size_t)length != sizeof( *report ) ) {
+        return -EPROTO;
+    }
+    return 0;
+}
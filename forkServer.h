@@ -0,0 +1,73 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_FORKSERVER_H
+#define PROCESSNEWFILES_FORKSERVER_H
+
+#include <stdint.h>
+#include <spawn.h>
+
+/*
+ * The daemon's page tables grow with the trees it's tracking, and so does
+ * the cost of each fork(). So a small helper is forked at startup, before
+ * any trees are loaded, and the daemon asks it to start each child instead.
+ *
+ * Requests go over a socketpair (SOCK_SEQPACKET, so each one is a single
+ * message): a tSpawnRequest, followed by the argv and then the environment,
+ * each string NUL-terminated. The helper reports back when it has started
+ * the child, and again when the child exits, as tSpawnReports, which the
+ * event loop reads along with everything else. Children inherit the
+ * helper's working directory and resource limits, which are the daemon's
+ * as they were at startup.
+ *
+ * It's only started if the config asks for it ('forkServer = true'), which
+ * is read before any tree is created. glibc's
+ * posix_spawn() shares the daemon's memory until the exec, rather than
+ * copying its page tables, so it doesn't slow down as the daemon grows, and
+ * the round trip to the helper costs more than it saves. It's there for
+ * where posix_spawn() falls back to fork().
+ *
+ * If the helper can't be started, or goes away, the daemon starts children
+ * itself, as it does without it. So it does if the helper falls behind and
+ * the socketpair fills up: the daemon's end is non-blocking, so the event
+ * loop never waits on it.
+ */
+
+/* the largest request the helper accepts. Larger ones are spawned directly */
+#define kForkServerMaxRequest   ( 128 * 1024 )
+
+typedef struct {
+    uint64_t    id;         // the daemon's, to match up the reports
+    uint32_t    argc;
+    uint32_t    envc;
+} tSpawnRequest;
+
+typedef enum {
+    kSpawned = 1,           // the child was started
+    kSpawnFailed,           // it couldn't be, see 'error'
+    kExited                 // it has exited, see 'code' and 'status'
+} tSpawnOutcome;
+
+typedef struct {
+    uint64_t    id;
+    uint32_t    outcome;    // a tSpawnOutcome
+    int32_t     pid;
+    int32_t     error;      // kSpawnFailed: the errno, as posix_spawn() returned it
+    int32_t     code;       // kExited: as waitid() reported it, e.g. CLD_EXITED
+    int32_t     status;
+} tSpawnReport;
+
+tError startForkServer( void );
+tError registerForkServer( uint64_t epollData );
+bool   forkServerRunning( void );
+tFileDscr forkServerFd( void );
+void   stopForkServer( void );
+
+tError requestSpawn( uint64_t id, char * const argv[], char * const envp[] );
+tError receiveSpawnReport( tSpawnReport * report );
+
+tError spawnChild( pid_t * pid, char * const argv[], char * const envp[],
+                   const posix_spawn_file_actions_t * actions );
+
+#endif //PROCESSNEWFILES_FORKSERVER_H
@@ -4,109 +4,278 @@
 
 #include "processNewFiles.h"
 
-unsigned short hashToBucketIndex( tHash hash )
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define kControlEmpty   0x80
+
+/**
+ * @brief spread the bits of the hash, so the low bits pick a slot and the
+ * top 7 bits go in the control byte. calcHash() on its own is too weak
+ * for that, and watchIDs & cookies are small integers.
+ * It's a bijection, so two different hashes still differ afterwards.
+ * @param hash
+ * @return
+ */
+static inline tHash mixHash( tHash hash )
+{
+    uint64_t h = hash;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (tHash)h;
+}
+
+static inline uint8_t controlFor( tHash mixed )
+{
+    return (uint8_t)(mixed >> (sizeof(tHash) * 8 - 7));
+}
+
+/**
+ * @brief compare the group of control bytes starting at 'control' with 'byte'
+ * @return a bitmask, with bit n set if control[n] == byte
+ */
+static inline unsigned int groupMatch( const uint8_t * control, uint8_t byte )
 {
-    unsigned short index = 0;
-    tHash h = hash;
-    while ( h > 0 )
-    {
-        index ^= ( h & 0xFF );
-        h = h >> 8;
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128( (const __m128i *)control );
+    return (unsigned int)_mm_movemask_epi8( _mm_cmpeq_epi8( group, _mm_set1_epi8( (char)byte ) ) );
+#else
+    unsigned int mask = 0;
+    for ( unsigned int i = 0; i < kHashGroupWidth; ++i ) {
+        if ( control[i] == byte ) mask |= 1u << i;
     }
-    return index;
+    return mask;
+#endif
 }
 
-tError freeHashMap(tHashMap * hashmap )
+/**
+ * @return a bitmask, with bit n set if control[n] is empty
+ */
+static inline unsigned int groupEmpty( const uint8_t * control )
 {
-    if ( hashmap == NULL ) return -EINVAL;
+#ifdef __SSE2__
+    /* only empty slots have the top bit set */
+    return (unsigned int)_mm_movemask_epi8( _mm_loadu_si128( (const __m128i *)control ) );
+#else
+    return groupMatch( control, kControlEmpty );
+#endif
+}
 
-    for (unsigned int i = 0; i < HASH_BUCKET_COUNT; i++ )
-    {
-        if ( hashmap->bucket[i] != NULL )
-        {
-            free( hashmap->bucket[i] );
-            hashmap->bucket[i] = NULL;
-        }
+/**
+ * @brief set a control byte, and its copy past the end if it has one,
+ * so a group can always be loaded without wrapping around
+ */
+static inline void setControl( tHashMap * hashmap, size_t index, uint8_t byte )
+{
+    hashmap->control[ index ] = byte;
+    if ( index < kHashGroupWidth ) {
+        hashmap->control[ hashmap->capacity + index ] = byte;
+    }
+}
+
+/**
+ * @brief allocate empty arrays for the given capacity
+ */
+static tError allocTable( tHashMap * hashmap, size_t capacity )
+{
+    uint8_t *    control = malloc( capacity + kHashGroupWidth );
+    tHashEntry * entries = malloc( capacity * sizeof( tHashEntry ) );
+    if ( control == NULL || entries == NULL ) {
+        free( control );
+        free( entries );
+        return -ENOMEM;
     }
+    memset( control, kControlEmpty, capacity + kHashGroupWidth );
+
+    hashmap->control  = control;
+    hashmap->entries  = entries;
+    hashmap->capacity = capacity;
+    hashmap->count    = 0;
+
     return 0;
 }
 
-tError hashMapAdd(tHashMap * hashmap, tHash hash, void * value )
+/**
+ * @brief put an entry in the first empty slot of its probe sequence
+ * The caller makes sure there's room.
+ */
+static void insertEntry( tHashMap * hashmap, tHash mixed, void * value )
 {
-    unsigned short index = hashToBucketIndex( hash );
-    tHashBucket * bucket = hashmap->bucket[index];
-    if ( bucket == NULL )
-    {
-        unsigned int count = 8;
-        bucket = calloc( 1, sizeof(tHashBucket) + (count * sizeof(tHashEntry)) );
-        if ( bucket != NULL )
-        {
-            bucket->count = count;
-            hashmap->bucket[index] = bucket;
+    const size_t mask = hashmap->capacity - 1;
+    size_t pos = mixed & mask;
+
+    for (;;) {
+        unsigned int empty = groupEmpty( &hashmap->control[ pos ] );
+        if ( empty != 0 ) {
+            size_t index = (pos + __builtin_ctz( empty )) & mask;
+            hashmap->entries[ index ].hash  = mixed;
+            hashmap->entries[ index ].value = value;
+            setControl( hashmap, index, controlFor( mixed ) );
+            ++hashmap->count;
+            return;
         }
+        pos = (pos + kHashGroupWidth) & mask;
     }
-    if ( bucket == NULL ) return -ENOMEM;
-
-    for ( unsigned int i = 0; i < bucket->count; ++i )
-    {
-        if ( bucket->entries[i].value == NULL )
-        {
-            bucket->entries[i].hash  = hash;
-            bucket->entries[i].value = value;
-            return 0;
+}
+
+/**
+ * @brief double the capacity, and re-insert everything
+ */
+static tError growTable( tHashMap * hashmap )
+{
+    uint8_t *    oldControl  = hashmap->control;
+    tHashEntry * oldEntries  = hashmap->entries;
+    size_t       oldCapacity = hashmap->capacity;
+
+    tError result = allocTable( hashmap, oldCapacity * 2 );
+    if ( result == 0 ) {
+        for ( size_t i = 0; i < oldCapacity; ++i ) {
+            if ( oldControl[ i ] != kControlEmpty ) {
+                insertEntry( hashmap, oldEntries[ i ].hash, oldEntries[ i ].value );
+            }
         }
-        if ( i+1 >= bucket->count )
-        {
-            const int increment = 8;
-            // we ran out of slots, so enlarge the bucket
-            bucket = realloc( bucket, sizeof(tHashBucket) + ((bucket->count + increment) * sizeof(tHashEntry)) );
-            if ( bucket == NULL )
-            {
-                // the realloc() failed
-                return -ENOMEM;
+        free( oldControl );
+        free( oldEntries );
+    }
+    return result;
+}
+
+/**
+ * @brief find the slot holding the key
+ * @return the slot index, or -1 if it isn't present
+ */
+static ssize_t findIndex( const tHashMap * hashmap, tHash mixed, const void * key )
+{
+    const size_t  mask = hashmap->capacity - 1;
+    const uint8_t h2   = controlFor( mixed );
+    size_t pos = mixed & mask;
+
+    for (;;) {
+        const uint8_t * group = &hashmap->control[ pos ];
+
+        unsigned int matches = groupMatch( group, h2 );
+        while ( matches != 0 ) {
+            size_t index = (pos + __builtin_ctz( matches )) & mask;
+            const tHashEntry * entry = &hashmap->entries[ index ];
+            if ( entry->hash == mixed
+              && ( hashmap->match == NULL || (*hashmap->match)( entry->value, key ) ) ) {
+                return (ssize_t)index;
             }
+            matches &= matches - 1;
+        }
 
-            // realloc() does not clear the additional bytes
-            memset( &bucket->entries[bucket->count], 0, increment * sizeof(tHashEntry) );
-            bucket->count += increment;
-            hashmap->bucket[index] = bucket;
+        /* an empty slot ends the probe sequence */
+        if ( groupEmpty( group ) != 0 ) {
+            return -1;
         }
+        pos = (pos + kHashGroupWidth) & mask;
     }
+}
+
+/**
+ * @brief
+ * @param match
+ * @return
+ */
+tHashMap * newHashMap( fHashMatch match )
+{
+    tHashMap * hashmap = calloc( 1, sizeof( tHashMap ) );
+    if ( hashmap != NULL ) {
+        hashmap->match = match;
+        if ( allocTable( hashmap, kHashMinCapacity ) != 0 ) {
+            free( hashmap );
+            hashmap = NULL;
+        }
+    }
+    return hashmap;
+}
+
+tError freeHashMap( tHashMap * hashmap )
+{
+    if ( hashmap == NULL ) return -EINVAL;
+
+    free( hashmap->control );
+    free( hashmap->entries );
+    free( hashmap );
 
     return 0;
 }
 
-tError hashMapFind(tHashMap * hashmap, tHash hash, void ** value )
+tError hashMapAdd( tHashMap * hashmap, tHash hash, void * value )
 {
-    unsigned short index = hashToBucketIndex( hash );
-    tHashBucket * bucket = hashmap->bucket[index];
-    if ( bucket != NULL ) {
-        for (unsigned int i = 0; i < bucket->count; ++i) {
-            if (bucket->entries[i].hash == hash) {
-                *value = bucket->entries[i].value;
-                return 0;
-            }
+    tError result = 0;
+
+    /* keep the load factor under 7/8, so there's always an empty slot to end a probe */
+    if ( (hashmap->count + 1) * 8 > hashmap->capacity * 7 ) {
+        result = growTable( hashmap );
+    }
+    if ( result == 0 ) {
+        insertEntry( hashmap, mixHash( hash ), value );
+    }
+
+    return result;
+}
+
+tError hashMapFind( tHashMap * hashmap, tHash hash, const void * key, void ** value )
+{
+    ssize_t index = findIndex( hashmap, mixHash( hash ), key );
+    if ( index < 0 ) {
+        return -ENOENT;
+    }
+    *value = hashmap->entries[ index ].value;
+    return 0;
+}
+
+/**
+ * @brief step through the values, in no particular order. Nothing may be
+ * added or removed until it's finished
+ * @param hashmap
+ * @param index zero to start with, then left where to carry on from
+ * @return the next value, or NULL if there are no more
+ */
+void * hashMapNext( const tHashMap * hashmap, size_t * index )
+{
+    while ( *index < hashmap->capacity ) {
+        size_t i = (*index)++;
+        if ( hashmap->control[ i ] != kControlEmpty ) {
+            return hashmap->entries[ i ].value;
         }
     }
-    return -ENOENT;
+    return NULL;
 }
 
-tError hashMapRemove(tHashMap * hashmap, tHash hash )
+tError hashMapRemove( tHashMap * hashmap, tHash hash, const void * key )
 {
-    unsigned short index = hashToBucketIndex( hash );
-    tHashBucket * bucket = hashmap->bucket[index];
-    if ( bucket != NULL ) {
-        for (unsigned int i = 0; i < bucket->count; ++i) {
-            if (bucket->entries[i].hash == hash) {
-                while ( i < (bucket->count - 1) ) {
-                    bucket->entries[i].hash  = bucket->entries[i+1].hash;
-                    bucket->entries[i].value = bucket->entries[i+1].value;
-                    ++i;
-                }
-                bucket->entries[i].value = 0;
-                bucket->entries[i].value = NULL;
-                return 0;
-            }
+    ssize_t found = findIndex( hashmap, mixHash( hash ), key );
+    if ( found < 0 ) {
+        return -ENOENT;
+    }
+
+    /* shift back any following entries in the same run that would no longer
+     * be reachable from their home slot once this one is empty */
+    const size_t mask = hashmap->capacity - 1;
+    size_t hole = (size_t)found;
+    size_t next = hole;
+    for (;;) {
+        next = (next + 1) & mask;
+        if ( hashmap->control[ next ] == kControlEmpty ) break;
+
+        size_t home = hashmap->entries[ next ].hash & mask;
+        /* can stay put if its home is cyclically in (hole, next] */
+        bool reachable = ( hole <= next ) ? ( hole < home && home <= next )
+                                          : ( hole < home || home <= next );
+        if ( !reachable ) {
+            hashmap->entries[ hole ] = hashmap->entries[ next ];
+            setControl( hashmap, hole, hashmap->control[ next ] );
+            hole = next;
         }
     }
-    return -ENOENT;}
+    setControl( hashmap, hole, kControlEmpty );
+    --hashmap->count;
+
+    return 0;
+}
@@ -5,30 +5,47 @@
 #ifndef PROCESSNEWFILES_HASHMAP_H
 #define PROCESSNEWFILES_HASHMAP_H
 
-#define HASH_BUCKET_COUNT   256
+#include <stdint.h>
+
+/*
+ * Open-addressing hash table, in the style of a 'Swiss table'. A separate
+ * array of control bytes holds 7 bits of each entry's hash (or 'empty'),
+ * so a probe compares 16 slots at once with SSE2, and only touches the
+ * entries whose control byte matches. Linear probing lets removal shift
+ * the following entries back, so there are never any tombstones.
+ */
+
+#define kHashGroupWidth     16
+#define kHashMinCapacity    16
+
+/* Since hashes can collide, the caller can provide a function that checks
+ * whether a stored value really corresponds to the key being looked for.
+ * If the hash *is* the key (e.g. a watchID), it can be NULL */
+typedef bool (*fHashMatch)( const void * value, const void * key );
 
 typedef struct sHashEntry {
-    tHash hash;
+    tHash hash;     // already mixed, so it can be moved without being recalculated
     void * value;
 } tHashEntry;
 
-typedef struct sHashBucket {
-    unsigned int count;     // count of allocated void pointers in the array
-    tHashEntry * entries;   // an array of 'count' entries
- } tHashBucket;
-
 typedef struct {
-    tHashBucket * bucket[ HASH_BUCKET_COUNT ];
+    uint8_t *       control;    // 'capacity' bytes, plus a copy of the first kHashGroupWidth bytes
+    tHashEntry *    entries;    // an array of 'capacity' entries
+    size_t          capacity;   // always a power of 2
+    size_t          count;      // entries currently in use
+    fHashMatch      match;
 } tHashMap;
 
-static inline tHashMap * newHashMap(void) { return calloc(1, sizeof(tHashMap)); }
+tHashMap * newHashMap( fHashMatch match );
 
-tError freeHashMap(tHashMap * hashmap );
+tError freeHashMap( tHashMap * hashmap );
 
 tError hashMapAdd( tHashMap * hashmap, tHash hash, void * value );
 
-tError hashMapFind( tHashMap * hashmap, tHash hash, void ** value );
+tError hashMapFind( tHashMap * hashmap, tHash hash, const void * key, void ** value );
+
+tError hashMapRemove( tHashMap * hashmap, tHash hash, const void * key );
 
-tError hashMapRemove( tHashMap * hashmap, tHash hash );
+void * hashMapNext( const tHashMap * hashmap, size_t * index );
 
 #endif //PROCESSNEWFILES_HASHMAP_H
@@ -5,14 +5,98 @@
 #include "processNewFiles.h"
 
 #include <poll.h>
+#include <stddef.h>
 #include <sys/epoll.h>
 #include <time.h>
-#include <ftw.h>
 #include <sys/inotify.h>
 
 #include "events.h"
 #include "rescan.h"
 #include "inotify.h"
+#include "watchTable.h"
+
+
+/* one inotify instance is shared by every tree, so a single fd (and kernel queue)
+ * covers them all. Watch descriptors are unique within it, so one table maps
+ * them back to the node, and node->watchedTree gives the tree */
+static struct {
+    tFileDscr       fd;
+    uint64_t        epollData;  // what epoll hands back when it has events
+    tWatchTable *   watches;
+    unsigned long   overflows;  // IN_Q_OVERFLOW events seen
+
+    /* directories that have had events recently, least recent first. They're
+     * linked through their 'dirty' entry, as 'queue' is the timer wheel's */
+    tListRoot       dirty;
+} gInotify = { .fd = -1 };
+
+/* time is divided into epochs, and each directory remembers the last epoch it had an event in */
+#define kDirtyEpochMs       1000
+/* after an overflow, the directories with events in this many recent epochs are rescanned */
+#define kDirtyEpochWindow   60
+/* beyond this many, the set of directories is no longer much of a guide, so rescan everything */
+#define kDirtyLimit         4096
+
+
+static inline uint32_t currentEpoch( void )
+{
+    return (uint32_t)(monotonicMs() / kDirtyEpochMs);
+}
+
+static inline tFSNode * dirtyNode( tListEntry * entry )
+{
+    return (tFSNode *)( (char *)entry - offsetof( tFSNode, dirty ) );
+}
+
+
+/**
+ * @brief drop directories from the front of the dirty list that haven't had
+ * an event within the window
+ * @param epoch
+ */
+static void pruneDirty( uint32_t epoch )
+{
+    tListEntry * entry;
+    while ( !listAtEnd( &gInotify.dirty, entry = listStart( &gInotify.dirty ) )
+         && epoch - dirtyNode( entry )->dirtyEpoch > kDirtyEpochWindow ) {
+        listRemove( entry );
+    }
+}
+
+
+/**
+ * @brief note that a directory just had an event, moving it to the back of the dirty list
+ * @param dirNode
+ */
+static void markDirty( tFSNode * dirNode )
+{
+    uint32_t epoch = currentEpoch();
+
+    if ( dirNode->type != kDirectory ) return;
+
+    /* a node that's never been on the list has NULL links, one that's been removed points at itself */
+    bool listed = listEntryValid( &dirNode->dirty ) && listNext( &dirNode->dirty ) != &dirNode->dirty;
+    if ( listed ) {
+        if ( dirNode->dirtyEpoch == epoch ) return;
+        listRemove( &dirNode->dirty );
+    }
+    dirNode->dirtyEpoch = epoch;
+    listAppend( &gInotify.dirty, &dirNode->dirty );
+
+    pruneDirty( epoch );
+}
+
+
+/**
+ * @brief take a directory that's being forgotten off the dirty list
+ * @param dirNode
+ */
+void forgetDirty( tFSNode * dirNode )
+{
+    if ( listEntryValid( &dirNode->dirty ) ) {
+        listRemove( &dirNode->dirty );
+    }
+}
 
 
 const char * const fsTypeAsStr[] = {
@@ -24,13 +108,13 @@ const char * const fsTypeAsStr[] = {
 
 
 /**
- * @brief
+ * @brief describe the event's mask, e.g. "Cl_Wr | IsDir"
+ * @param event
  * @param buffer
  * @param bufferSize
- * @param event
- * @return
+ * @return buffer
  */
-const char * inotifyEventTypeAsStr( const struct inotify_event * event )
+const char * inotifyEventTypeAsStr( const struct inotify_event * event, char * buffer, size_t bufferSize )
 {
 
     static struct {
@@ -58,25 +142,16 @@ const char * inotifyEventTypeAsStr( const struct inotify_event * event )
         { 0, NULL }
     };
 
-
-    size_t bufferSize = 1;  /* for the trailing null */
-    for ( int i = 0; iNotifyFlags[ i ].mask != 0; ++i ) {
-        if ( event->mask & iNotifyFlags[ i ].mask ) {
-            bufferSize += strlen( iNotifyFlags[ i ].label ) + sizeof(" | ");
-        }
-    }
-
-    char * buffer = (char *)calloc( 1, bufferSize );
-
-    if ( buffer == NULL ) return NULL;
+    if ( bufferSize == 0 ) return buffer;
+    buffer[0] = '\0';
 
     bool needSeparator = false;
     for ( int i = 0; iNotifyFlags[ i ].mask != 0; ++i ) {
         if ( event->mask & iNotifyFlags[ i ].mask ) {
             if ( needSeparator ) {
-                strncat( buffer, " | ", bufferSize );
+                strncat( buffer, " | ", bufferSize - strlen( buffer ) - 1 );
             }
-            strncat( buffer, iNotifyFlags[ i ].label, bufferSize );
+            strncat( buffer, iNotifyFlags[ i ].label, bufferSize - strlen( buffer ) - 1 );
             needSeparator = true;
         }
     }
@@ -86,55 +161,95 @@ const char * inotifyEventTypeAsStr( const struct inotify_event * event )
 
 
 /**
- * @brief
- * @param buffer
- * @param remaining
+ * @brief translate the name of an inotify event, as used in the config file,
+ * into its bit in the event mask. Names are the IN_* constants without the
+ * prefix, in any case, e.g. "close_write".
+ * @param name
+ * @param mask the event's bit(s) are OR'd in
+ * @return 0 on success, or -EINVAL if the name isn't recognized
+ */
+tError eventMaskFromName( const char * name, uint32_t * mask )
+{
+    static const struct {
+        const char * name;
+        uint32_t     mask;
+    } eventNames[] = {
+        { "access",        IN_ACCESS },
+        { "modify",        IN_MODIFY },
+        { "attrib",        IN_ATTRIB },
+        { "close_write",   IN_CLOSE_WRITE },
+        { "close_nowrite", IN_CLOSE_NOWRITE },
+        { "close",         IN_CLOSE },
+        { "open",          IN_OPEN },
+        { "moved_from",    IN_MOVED_FROM },
+        { "moved_to",      IN_MOVED_TO },
+        { "move",          IN_MOVE },
+        { "create",        IN_CREATE },
+        { "delete",        IN_DELETE },
+        { "delete_self",   IN_DELETE_SELF },
+        { "move_self",     IN_MOVE_SELF },
+        { "all",           IN_ALL_EVENTS },
+        /* mark the end of the table */
+        { NULL, 0 }
+    };
+
+    for ( int i = 0; eventNames[ i ].name != NULL; ++i ) {
+        if ( strcasecmp( name, eventNames[ i ].name ) == 0 ) {
+            *mask |= eventNames[ i ].mask;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+
+/**
+ * @brief log how many inotify events the tree has seen, if there have been any since last time
  * @param watchedTree
+ */
+void logEventStats( tWatchedTree * watchedTree )
+{
+    unsigned long received = watchedTree->inotify.count.received;
+    if ( received != watchedTree->inotify.count.logged ) {
+        logInfo( "\'%s\': %lu inotify events received, %lu of them ignored (mask 0x%08x)",
+                 watchedTree->root.path,
+                 received,
+                 watchedTree->inotify.count.ignored,
+                 watchedTree->inotify.mask );
+        watchedTree->inotify.count.logged = received;
+    }
+}
+
+
+/**
+ * @brief describe the node, for debugging
  * @param fsNode
+ * @param buffer
+ * @param bufferSize
+ * @return buffer
  */
-const char * fsNodeAsStr( const tFSNode * fsNode )
+const char * fsNodeAsStr( const tFSNode * fsNode, char * buffer, size_t bufferSize )
 {
-    char * result = NULL;
+    if ( bufferSize == 0 ) return buffer;
+    buffer[0] = '\0';
 
-    const char * emptyStr = "";
     /* Print the name of the watched node */
     if ( fsNode != NULL )
     {
-        const char * cookieStr = emptyStr;
+        char cookieStr[24] = "";
         if ( fsNode->cookie != 0 ) {
-            if ( asprintf( (char **)&cookieStr, " {%u}", fsNode->cookie ) < 1 ) {
-                logError( "unable to generate cookie message");
-            }
-        }
-
-        const char * expiresStr = emptyStr;
-#if 0
-        if ( fsNode->expires != 0 )
-        {
-            if ( asprintf( (char **)&expiresStr,
-                           " %s expires in %lu secs",
-                           expiredReasonAsStr[ fsNode->expiredReason ],
-                           fsNode->expires - time(NULL ) ) < 1 ) {
-                logDebug( "unable to generate timeout message" );
-            }
-        }
-#endif
-
-        if ( asprintf( &result,
-                       "%s [%02d] \'%s\'%s%s",
-                       fsTypeAsStr[ fsNode->type ],
-                       fsNode->watchID,
-                       fsNode->path,
-                       cookieStr,
-                       expiresStr ) < 1 ) {
-            logDebug( "unable to generate debug message" );
+            snprintf( cookieStr, sizeof( cookieStr ), " {%u}", fsNode->cookie );
         }
 
-        if ( cookieStr  != emptyStr ) free( (void *)cookieStr );
-        if ( expiresStr != emptyStr ) free( (void *)expiresStr );
+        snprintf( buffer, bufferSize,
+                  "%s [%02d] \'%s\'%s",
+                  fsTypeAsStr[ fsNode->type ],
+                  fsNode->watchID,
+                  fsNode->path,
+                  cookieStr );
     }
 
-    return result;
+    return buffer;
 }
 
 
@@ -145,11 +260,13 @@ const char * fsNodeAsStr( const tFSNode * fsNode )
  */
 void logFsNode( const tFSNode * fsNode )
 {
-    const char * buffer;
+#ifdef DEBUG
+    char buffer[PATH_MAX + 64];
 
-    buffer = fsNodeAsStr( fsNode );
-    logDebug( "%s", buffer );
-    free( (void *)buffer );
+    logDebug( "%s", fsNodeAsStr( fsNode, buffer, sizeof( buffer ) ) );
+#else
+    (void)fsNode;
+#endif
 }
 
 
@@ -165,14 +282,12 @@ void logEvent( const struct inotify_event * event, const tFSNode * watchedNode )
     if ( event != NULL && !(event->mask & IN_ISDIR) )
     {
         /* display event type. */
-        const char * eventTypeStr = inotifyEventTypeAsStr( event );
+        char eventTypeStr[128];
+        inotifyEventTypeAsStr( event, eventTypeStr, sizeof( eventTypeStr ) );
 
-        char * cookieStr = NULL;
-        if ( asprintf( &cookieStr, " (%u)", event->cookie ) < 1 ) {
-            logDebug( "unable to generate debug message" );
-        }
-        if ( event->cookie == 0 ) {
-            cookieStr[0] = '\0';
+        char cookieStr[16] = "";
+        if ( event->cookie != 0 ) {
+            snprintf( cookieStr, sizeof( cookieStr ), " (%u)", event->cookie );
         }
 
         /* the name of the file, if any. */
@@ -181,54 +296,57 @@ void logEvent( const struct inotify_event * event, const tFSNode * watchedNode )
             nameStr = "";
         }
 
-        const char * nodeStr = NULL;
+        char nodeStr[PATH_MAX + 64] = "";
+        fsNodeAsStr( watchedNode, nodeStr, sizeof( nodeStr ) );
 
-        const tWatchedTree * watchedTree = watchedNode->watchedTree;
-        if ( watchedTree != NULL ) {
-            tFSNode * fsNode;
-            hashMapFind(watchedTree->watchMap, event->wd, (void **)&fsNode);
-            if ( fsNode == NULL ) {
-                logError( "Error: watchID [%02d] not found", event->wd );
-            } else {
-                nodeStr = fsNodeAsStr( watchedNode );
-            }
-        }
         logDebug( "[%02u] %-20s %-8s %s (%s)", event->wd, eventTypeStr, cookieStr, nodeStr, nameStr );
-
-        free( (void *)eventTypeStr );
-        free( (void *)nodeStr );
     }
+#else
+    (void)event;
+    (void)watchedNode;
 #endif
 }
 
 
 /**
- * @brief
+ * @brief continue hashing from a previous result, so a child's path can be
+ * hashed without going over its parent's path again.
+ * @param hash  the hash of the preceding part of the string
  * @param string
  * @return
  */
-tHash calcHash( const char * string )
+tHash calcHashAppend( tHash hash, const char * string )
 {
-    tHash result = 0xDeadBeef;
-
     const char * p = string;
     while ( *p != '\0' ) {
-        result = (result * 43) ^ *p++;
+        hash = (hash * 43) ^ *p++;
     }
 
-    return result;
+    return hash;
+}
+
+
+/**
+ * @brief
+ * @param string
+ * @return
+ */
+tHash calcHash( const char * string )
+{
+    return calcHashAppend( 0xDeadBeef, string );
 }
 
 
 /**
- * @brief function to ensure expiringList is in ascending order of expiration
- * @param newEntry
- * @param existingEntry
+ * @brief the pathMap's check that a node really is the one for the path,
+ * and not just a node whose path has the same hash
+ * @param value the tFSNode in the map
+ * @param key the full path being looked up
  * @return
  */
-bool orderedByExpiration(tListEntry * newEntry, tListEntry * existingEntry )
+bool fsNodePathMatches( const void * value, const void * key )
 {
-    return ( ((tFSNode *)newEntry)->expires.at > ((tFSNode *)existingEntry)->expires.at );
+    return strcmp( ((const tFSNode *)value)->path, (const char *)key ) == 0;
 }
 
 
@@ -243,90 +361,136 @@ void resetExpiration( tFSNode * node, tExpiredReason reason )
 {
     if (node != NULL)
     {
-        time_t when = time(NULL ) + node->expires.every;
+        if ( node->child.pid != 0 ) {
+            /* it's on the executingList. Leave it there, reapChildren() will requeue it if needed */
+            node->expires.because = reason;
+            return;
+        }
+
+        tTick when = monotonicMs() + node->expires.every;
 
         node->expires.because = reason;
         if (node->expires.at != when ) {
-            if ( listEntryValid( &node->queue ) )
+            if ( node->expires.filed == 0 && listEntryValid( &node->queue ) )
             {
                 listRemove( &node->queue );
             }
             node->expires.at = when;
-            listInsert( g.expiringList, &node->queue, orderedByExpiration );
+            /* if it's already in the wheel, and this moves it later, it won't be re-linked */
+            timerWheelAdd( g.expiring, node );
 
-            logDebug( "Expiration of %s was reset to %ld secs", node->relPath, node->expires.at - time( NULL ) );
+            logDebug( "Expiration of %s was reset to %lu ms", node->relPath, node->expires.every );
         }
     }
 }
 
 
 /**
- * @brief
+ * @brief start watching a new directory node, or take over the watch a
+ * previous process had on it, from the inotify instance it handed over
+ * @param node
+ * @param adopted the watch to take over, or zero to add one
+ */
+static void watchDirectory( tFSNode * node, tWatchID adopted )
+{
+    const char * fullPath = node->path;
+
+    if ( adopted > 0 ) {
+        node->watchID = adopted;
+        logDebug( "adopted watch [%d] %s", node->watchID, fullPath );
+    } else {
+        /* a directory that's in another tree too has the one watch, so add to
+         * its mask rather than replace it, and leave that tree what it asked for */
+        node->watchID = inotify_add_watch( gInotify.fd, fullPath, node->watchedTree->inotify.mask | IN_MASK_ADD );
+        logInfo( "watch [%d] %s", node->watchID, fullPath );
+    }
+    if (node->watchID == -1 ) {
+        logError( "problem watching directory \'%s\'", fullPath );
+    } else if ( watchTableFind( gInotify.watches, node->watchID ) != NULL ) {
+        /* inotify returns the existing watch for a directory that's already watched */
+        logWarning( "\'%s\' is already watched by another tree, so its events will only go to that tree",
+                    fullPath );
+        node->watchID = 0;
+    } else if ( watchTableAdd( gInotify.watches, node->watchID, node ) != 0 ) {
+        logError( "unable to record watch [%d] for \'%s\'", node->watchID, fullPath );
+    }
+}
+
+
+/**
+ * @brief find the node for a path whose hash has already been calculated,
+ * creating it if it's new. Only a new node causes any allocation.
  * @param watchedTree
  * @param fullPath
+ * @param hash calcHash( fullPath )
+ * @param type
+ * @param adopted a new directory node takes over this watch, if it's non-zero
  * @return
  */
-tFSNode * fsNodeFromPath( tWatchedTree * watchedTree, const char * fullPath, tFSNodeType type )
+static tFSNode * findOrMakeNode( tWatchedTree * watchedTree, const char * fullPath, tHash hash,
+                                 tFSNodeType type, tWatchID adopted )
 {
-    tFSNode * node;
+    tFSNode * node = NULL;
 
-    if ( strncmp( fullPath, watchedTree->shadow.path, watchedTree->shadow.pathLen ) == 0 ) {
-        /* don't generate nodes for anything in the shadow hierarchy */
+    if ( strncmp( fullPath, watchedTree->seen.path, watchedTree->seen.pathLen ) == 0 ) {
+        /* don't generate nodes for the state store, or anything else in '.seen' */
         return NULL;
     }
 
-    tHash hash = calcHash( fullPath );
-    hashMapFind(watchedTree->pathMap, hash, (void **)&node);
+    hashMapFind(watchedTree->pathMap, hash, fullPath, (void **)&node);
 
     if ( node == NULL ) {
+        size_t len = strlen( fullPath ) + 1; // for the trailing null
+
         node = (tFSNode *)calloc( 1, sizeof( tFSNode ) );
+        if ( node == NULL ) {
+            return NULL;
+        }
+        node->path = malloc( len );
+        if ( node->path == NULL ) {
+            free( node );
+            return NULL;
+        }
+        memcpy( (char *)node->path, fullPath, len );
+
         node->type        = type;
         node->watchedTree = watchedTree;
-        node->path        = strdup(fullPath );
-        node->pathHash    = calcHash(node->path );
+        node->pathHash    = hash;
         node->relPath     = &node->path[ watchedTree->root.pathLen ];
         if ( *node->relPath == '/' ) {
             ++node->relPath;
         }
 
-        hashMapFind(watchedTree->pathMap, node->pathHash, (void **)&node);
+        hashMapAdd(watchedTree->pathMap, node->pathHash, node);
 
         switch (type)
         {
         case kFile:
-            node->expires.at      = time( NULL ) + g.timeout.idle;
-            node->expires.every   = g.timeout.idle;
+            node->expires.at      = monotonicMs() + watchedTree->idle;
+            node->expires.every   = watchedTree->idle;
             node->expires.because = kFirstSeen;
-            listInsert( g.expiringList, &node->queue, orderedByExpiration );
+            timerWheelAdd( g.expiring, node );
             break;
 
         case kDirectory:
-            node->watchID = inotify_add_watch( watchedTree->inotify.fd, fullPath, IN_ALL_EVENTS );
-            logInfo( "watch [%d] %s", node->watchID, fullPath );
-            if (node->watchID == -1 ) {
-                logError( "problem watching directory \'%s\'", fullPath );
-            } else {
-                hashMapAdd(watchedTree->watchMap, node->watchID, node);
-            }
+            watchDirectory( node, adopted );
             break;
 
         default:
             break;
         }
 
-        size_t len = strlen(fullPath) + 1; // for the trailing null
-        char * path = malloc( len + 1);
-        if (path != NULL)
+        /* the radix tree copies the key, so it can be built on the stack */
+        char key[ PATH_MAX + 2 ];
+        if ( len < sizeof( key ) - 1 )
         {
-            memcpy( path, fullPath, len );
-
+            memcpy( key, fullPath, len );
             if ( type != kFile )
             {
-                strcat( path, "/" );
+                key[ len - 1 ] = '/';
+                key[ len ]     = '\0';
             }
-            radixTreeAdd(g.pathTree, path, node);
-
-            free( path );
+            radixTreeAdd(g.pathTree, key, node);
         }
         // logFsNode( node );
     }
@@ -335,35 +499,89 @@ tFSNode * fsNodeFromPath( tWatchedTree * watchedTree, const char * fullPath, tFS
 }
 
 
+/**
+ * @brief find the node for a path whose hash has already been calculated,
+ * creating it if it's new. Only a new node causes any allocation.
+ * @param watchedTree
+ * @param fullPath
+ * @param hash calcHash( fullPath )
+ * @param type
+ * @return
+ */
+tFSNode * fsNodeFromHashedPath( tWatchedTree * watchedTree, const char * fullPath, tHash hash, tFSNodeType type )
+{
+    return findOrMakeNode( watchedTree, fullPath, hash, type, 0 );
+}
+
+
 /**
  * @brief
  * @param watchedTree
- * @param watchID
+ * @param fullPath
  * @return
  */
-tFSNode * fsNodeFromWatchID( const tWatchedTree * watchedTree, tWatchID watchID )
+tFSNode * fsNodeFromPath( tWatchedTree * watchedTree, const char * fullPath, tFSNodeType type )
 {
-    tFSNode * fsNode;
+    return fsNodeFromHashedPath( watchedTree, fullPath, calcHash( fullPath ), type );
+}
+
 
-    hashMapFind(watchedTree->watchMap, watchID, (void **)&fsNode);
-    return fsNode;
+/**
+ * @brief make the node for a directory that's still watched by the inotify
+ * instance a previous process handed over, so it isn't watched all over again
+ * @param watchedTree
+ * @param fullPath
+ * @param watchID the directory's watch in that instance
+ * @return
+ */
+tFSNode * adoptDirectory( tWatchedTree * watchedTree, const char * fullPath, tWatchID watchID )
+{
+    return findOrMakeNode( watchedTree, fullPath, calcHash( fullPath ), kDirectory, watchID );
 }
 
+
 /**
- *
+ * @brief
+ * @param watchID
+ * @return
+ */
+tFSNode * fsNodeFromWatchID( tWatchID watchID )
+{
+    return watchTableFind( gInotify.watches, watchID );
+}
+
+/**
+ * @brief stop watching the node's directory, if it is one
  * @param fsNode
  */
 void forgetWatch(const tFSNode *fsNode)
 {
-    if (fsNode != NULL && fsNode->watchID != 0 ) {
-        inotify_rm_watch( fsNode->watchedTree->inotify.fd, fsNode->watchID );
+    if (fsNode != NULL && fsNode->watchID > 0 ) {
+        /* only remove the watch if it's this node's, not another tree's */
+        if ( watchTableFind( gInotify.watches, fsNode->watchID ) == fsNode ) {
+            inotify_rm_watch( gInotify.fd, fsNode->watchID );
+            watchTableRemove( gInotify.watches, fsNode->watchID );
+        }
+    }
+}
+
+
+/**
+ * @brief stop watching a directory that no node has, e.g. one in a tree
+ * that was handed over, but is no longer configured
+ * @param watchID
+ */
+void dropWatch( tWatchID watchID )
+{
+    if ( watchTableFind( gInotify.watches, watchID ) == NULL ) {
+        inotify_rm_watch( gInotify.fd, watchID );
     }
 }
 
 
 /**
  * @brief node is disappearing, so remove it from our structures, too.
- * Removes any file that may have been created in the shadow hierarchy, too.
+ * If it's a file, the state store forgets it, too.
  * @see forgetNode()
  * @param fsNode
  */
@@ -378,9 +596,9 @@ void removeNode( tFSNode * fsNode )
     const tWatchedTree * const watchedTree = fsNode->watchedTree;
     if ( fsNode->type == kFile ) {
         /* if a file is created and then deleted before it's ever processed, then
-         * it won't be present in the shadow hierarchy yet - and that's normal */
-        if ( unlinkat( watchedTree->shadow.fd, fsNode->relPath, 0 ) == -1 && errno != ENOENT ) {
-            logError( "failed to delete \'%s\'", fsNode->path );
+         * there won't be a record of it yet - and that's normal */
+        if ( storeForget( watchedTree->state, fsNode->relPath ) != 0 ) {
+            logError( "failed to forget \'%s\'", fsNode->path );
         }
         logSetErrno( 0 );
     }
@@ -391,16 +609,13 @@ void removeNode( tFSNode * fsNode )
 
 /**
  * @brief
- * @param watchedTree
  * @param watchID
  */
-void removeWatchID( tWatchedTree * watchedTree, tWatchID watchID )
+void removeWatchID( tWatchID watchID )
 {
     /* the inotify ID has already been removed, and we won't be
      * seeing it again. so clean up our parallel structures */
-    tFSNode * fsNode;
-
-    hashMapFind(watchedTree->watchMap, watchID, (void **)&fsNode);
+    tFSNode * fsNode = watchTableFind( gInotify.watches, watchID );
     if ( fsNode != NULL ) {
         logDebug( "ignore [%d]", watchID );
         removeNode( fsNode );
@@ -414,13 +629,7 @@ void removeWatchID( tWatchedTree * watchedTree, tWatchID watchID )
  */
 void doiNotifyDelete( tFSNode * pathNode )
 {
-    if ( pathNode->type == kFile ) {
-        const tWatchedTree * const watchedTree = pathNode->watchedTree;
-        if ( unlinkat( watchedTree->shadow.fd, pathNode->relPath, 0 ) == -1 ) {
-            logError( "Error: unable to delete the shadow file \'%s%s\'",
-                      watchedTree->shadow.path, pathNode->relPath );
-        }
-    }
+    /* removeNode() takes care of any record of it */
     removeNode( pathNode );
 }
 
@@ -467,8 +676,8 @@ void doiNotifyMove( tFSNode * pathNode,
     /* The IN_MOVED_FROM and IN_MOVED_TO are issued in pairs,
      * tied together with the same (non-zero) cookie value  */
     if ( event->cookie != 0 ) {
-        tFSNode * cookieNode;
-        hashMapFind(watchedTree->cookieMap, event->cookie, (void **)&cookieNode);
+        tFSNode * cookieNode = NULL;
+        hashMapFind(watchedTree->cookieMap, event->cookie, NULL, (void **)&cookieNode);
         if ( cookieNode == NULL ) {
             cookieNode = pathNode;
             cookieNode->cookie = event->cookie;
@@ -483,16 +692,40 @@ void doiNotifyMove( tFSNode * pathNode,
 
         // occurs second of the pair - update the root.path in the cookieNode identified in the IN_MOVED_FROM
         if ( event->mask & IN_MOVED_TO && cookieNode != NULL ) {
-            hashMapRemove(watchedTree->pathMap, cookieNode->cookie);
+            /* if it was moved over an existing file, that file's node is now stale */
+            tHash hash = calcHash( fullPath );
+            tFSNode * replaced = NULL;
+            hashMapFind(watchedTree->pathMap, hash, fullPath, (void **)&replaced);
+            if ( replaced != NULL && replaced != cookieNode ) {
+                forgetNode( replaced );
+            }
+
+            /* there's nothing at its old path any more, whatever its record there says */
+            if ( cookieNode->type == kFile ) {
+                if ( storeForget( watchedTree->state, cookieNode->relPath ) != 0 ) {
+                    logError( "failed to forget \'%s\'", cookieNode->path );
+                }
+                logSetErrno( 0 );
+            }
+
+            hashMapRemove(watchedTree->pathMap, cookieNode->pathHash, cookieNode->path);
             free((void *)cookieNode->path );
             cookieNode->path     = strdup( fullPath );
-            cookieNode->pathHash = calcHash( cookieNode->path );
+            cookieNode->pathHash = hash;
+            /* relPath pointed into the old path */
+            cookieNode->relPath  = &cookieNode->path[ watchedTree->root.pathLen ];
+            if ( *cookieNode->relPath == '/' ) {
+                ++cookieNode->relPath;
+            }
             hashMapAdd(watchedTree->pathMap, cookieNode->pathHash, cookieNode);
 
-            hashMapRemove(watchedTree->cookieMap, cookieNode->cookie);
+            hashMapRemove(watchedTree->cookieMap, cookieNode->cookie, NULL);
             cookieNode->cookie = 0;
 
-            resetExpiration( cookieNode, kMoved );
+            /* a directory isn't processed, its files are found by the rescan of its new parent */
+            if ( cookieNode->type == kFile ) {
+                resetExpiration( cookieNode, kMoved );
+            }
 
             logDebug( "{%u} move [%02d] to \'%s\'",
                       cookieNode->cookie, cookieNode->watchID, cookieNode->path );
@@ -517,15 +750,12 @@ void doiNotifyEvent( tFSNode * pathNode,
 
     tWatchedTree * watchedTree = pathNode->watchedTree;
 
-    if ( event->mask & IN_Q_OVERFLOW ) {
-        /* dropped events - so force full rescan ASAP */
-        rescanAllTrees();
-    }
-
     if ( event->mask & IN_IGNORED ) {
         /* for whatever reason, the watchID for this node will be invalid
          * after this event, so clean up any references we have to it */
-        removeWatchID( watchedTree, event->wd );
+        removeWatchID( event->wd );
+        /* pathNode is the watched directory, and has just been freed */
+        return;
     }
 
     if ( event->mask & IN_CREATE ) {
@@ -536,32 +766,52 @@ void doiNotifyEvent( tFSNode * pathNode,
         doiNotifyMove( pathNode, event, fullPath );
     } else if ( event->mask & IN_DELETE ) {
         doiNotifyDelete( pathNode );
-    } else { /* all other events */
+    } else if ( event->mask & IN_MODIFY ) {
+        /* still being written to */
         if ( pathNode->expires.at != 0 ) {
             resetExpiration( pathNode, pathNode->expires.because );
             logDebug( "event delayed expiration of \'%s\'",
                       pathNode->relPath );
         }
+    } else if ( event->mask & IN_DELETE_SELF ) {
+        /* the IN_IGNORED that follows will clean up */
+    } else { /* all other events, if the tree's mask asks for them */
+        ++watchedTree->inotify.count.ignored;
     }
 }
 
 
 /**
  * @brief
- * @param watchedTree
  * @param event
  * @return
  */
-tError processOneInotifyEvent( tWatchedTree * watchedTree, const struct inotify_event *event )
+tError processOneInotifyEvent( const struct inotify_event *event )
 {
     tError result = 0;
 
-    const tFSNode * watchedNode = fsNodeFromWatchID( watchedTree, event->wd );
+    /* reused for every event, so resolving an event's path doesn't touch the heap */
+    static char fullPath[ PATH_MAX ];
+
+    tFSNode * watchedNode = fsNodeFromWatchID( event->wd );
     if ( watchedNode == NULL ) {
-        logError( "internal: couldn't find a FSNode with the watchID %d", event->wd );
-        return -ENOENT;
+        /* forgetNode() already dropped the watch, so the IN_IGNORED that
+         * inotify_rm_watch() generates is expected. Anything else isn't,
+         * but it's not a reason to stop processing events */
+        if ( !(event->mask & IN_IGNORED) ) {
+            logError( "internal: couldn't find a FSNode with the watchID %d", event->wd );
+        }
+        return 0;
     }
 
+    tWatchedTree * watchedTree = watchedNode->watchedTree;
+    if ( (event->mask & IN_ALL_EVENTS) != 0 && (event->mask & watchedTree->inotify.mask) == 0 ) {
+        /* the watch is shared with another tree, which asked for this one */
+        return 0;
+    }
+    ++watchedTree->inotify.count.received;
+    markDirty( watchedNode );
+
     logEvent( event, watchedNode );
 
     /*
@@ -574,49 +824,100 @@ tError processOneInotifyEvent( tWatchedTree * watchedTree, const struct inotify_
      * event->len is zero, don't use event->name, there's NO C string there.
      */
 
-    char * fullPath;
-    if ( event->len > 0 ) {
-        if ( asprintf( &fullPath, "%s/%s", watchedNode->path, event->name ) < 1 ) {
-            logDebug( "unable to generate full path" );
-        }
+    tFSNode * pathNode = NULL;
+    if ( event->len == 0 ) {
+        /* the event is about the watched directory itself */
+        pathNode = watchedNode;
     } else {
-        fullPath = strdup( watchedNode->path );
-    }
+        size_t dirLen  = strlen( watchedNode->path );
+        size_t nameLen = strlen( event->name );
+        if ( dirLen + 1 + nameLen >= sizeof( fullPath ) ) {
+            logError( "path too long: \'%s/%s\'", watchedNode->path, event->name );
+            return 0;
+        }
+        memcpy( fullPath, watchedNode->path, dirLen );
+        fullPath[ dirLen ] = '/';
+        memcpy( &fullPath[ dirLen + 1 ], event->name, nameLen + 1 );
+
+        /* the destination of a move is the node already seen by IN_MOVED_FROM,
+         * so don't create a second one for its new path */
+        if ( (event->mask & IN_MOVED_TO) && event->cookie != 0 ) {
+            hashMapFind( watchedTree->cookieMap, event->cookie, NULL, (void **)&pathNode );
+        }
 
-    // logInfo( "path: \'%s\' ", fullPath );
-    tFSNode * pathNode = fsNodeFromPath( watchedTree,
-                                         fullPath,
-                                         (event->mask & IN_ISDIR) ? kDirectory : kFile );
+        if ( pathNode == NULL ) {
+            /* the parent's hash covers the start of the path already */
+            tHash hash = calcHashAppend( calcHashAppend( watchedNode->pathHash, "/" ), event->name );
+            if ( event->mask & IN_DELETE ) {
+                /* no point creating a node just to delete it again */
+                hashMapFind( watchedTree->pathMap, hash, fullPath, (void **)&pathNode );
+            } else {
+                pathNode = fsNodeFromHashedPath( watchedTree,
+                                                 fullPath,
+                                                 hash,
+                                                 (event->mask & IN_ISDIR) ? kDirectory : kFile );
+            }
+        }
+    }
 
     if ( pathNode != NULL ) {
-        doiNotifyEvent( pathNode, event, fullPath );
+        doiNotifyEvent( pathNode, event, event->len > 0 ? fullPath : watchedNode->path );
     }
 
-    free( (void *)fullPath );
-
     return result;
 }
 
 
 /**
- * @brief
- * @param watchedTree
+ * @brief read a single number from a file in /proc, e.g. one of the inotify limits
+ * @param path
+ * @return the value, or -1 if it couldn't be read
+ */
+static long readProcValue( const char * path )
+{
+    long value = -1;
+
+    FILE * file = fopen( path, "re" );
+    if ( file != NULL ) {
+        if ( fscanf( file, "%ld", &value ) != 1 ) {
+            value = -1;
+        }
+        fclose( file );
+    }
+    return value;
+}
+
+
+/**
+ * @brief create the one inotify instance that all the trees share, and have
+ * epoll tell us when it has events for us
+ * @param epollData what epoll should hand back when events are waiting
  * @return
  */
-tError registerForInotifyEvents( tWatchedTree * watchedTree )
+tError registerForInotifyEvents( uint64_t epollData )
 {
     tError result = 0;
 
-    watchedTree->inotify.fd = inotify_init();
-    if ( watchedTree->inotify.fd == -1 ) {
+    gInotify.watches = newWatchTable();
+    if ( gInotify.watches == NULL ) {
+        return -ENOMEM;
+    }
+    listInit( &gInotify.dirty );
+
+    gInotify.fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( gInotify.fd == -1 ) {
         logError( "Unable to register for filesystem events" );
         result = -errno;
     } else {
-        if ( registerFdToEpoll( watchedTree->inotify.fd, (uint64_t)watchedTree ) == -1 ) {
-            logError( "unable to register inotify fd %d",
-                      watchedTree->inotify.fd );
+        gInotify.epollData = epollData;
+        if ( registerFdToEpoll( gInotify.fd, epollData ) == -1 ) {
+            logError( "unable to register inotify fd %d", gInotify.fd );
             result = -errno;
         }
+        /* the kernel queue is now shared by every tree, so the limits apply to the workload as a whole */
+        logInfo( "inotify limits: %ld queued events, %ld watches",
+                 readProcValue( "/proc/sys/fs/inotify/max_queued_events" ),
+                 readProcValue( "/proc/sys/fs/inotify/max_user_watches" ) );
     }
 
     return result;
@@ -624,12 +925,90 @@ tError registerForInotifyEvents( tWatchedTree * watchedTree )
 
 
 /**
- * @brief
- * @param watchedTree
- * @param event
+ * @return the inotify instance every tree shares, to hand over to the process taking over from us
+ */
+tFileDscr inotifyFd( void )
+{
+    return gInotify.fd;
+}
+
+
+/**
+ * @brief replace our inotify instance with one handed over by a previous
+ * process, whose watches are still in place. Only before any tree is created
+ * @param fd
  * @return
  */
-tError processInotifyEvents( tWatchedTree * watchedTree )
+tError adoptInotifyFd( tFileDscr fd )
+{
+    tError result = 0;
+
+    /* closing it also takes it out of the epoll set */
+    close( gInotify.fd );
+    gInotify.fd = fd;
+    if ( fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK ) == -1
+      || fcntl( fd, F_SETFD, FD_CLOEXEC ) == -1 ) {
+        result = -errno;
+        logError( "unable to configure the inotify fd %d that was handed over", fd );
+    } else {
+        result = registerFdToEpoll( fd, gInotify.epollData );
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief events were dropped because the kernel queue filled up.
+ * The dropped events were most likely for the directories that were busy
+ * when it happened, so rescan just those. Only if that set is unknown (or
+ * too large to be useful) fall back to rescanning every tree. The periodic
+ * rescan remains the backstop for a quiet directory whose first events
+ * were the ones dropped.
+ */
+static void inotifyOverflowed( void )
+{
+    ++gInotify.overflows;
+
+    pruneDirty( currentEpoch() );
+
+    unsigned int count = 0;
+    tListEntry * entry;
+    listForEachEntry( &gInotify.dirty, entry )
+    {
+        if ( ++count > kDirtyLimit ) break;
+    }
+
+    /* what the catching up costs is logged once each tree's rescan is done (see overflowRecovered()) */
+    tTick now = monotonicMs();
+    if ( count == 0 || count > kDirtyLimit ) {
+        logWarning( "inotify queue overflowed (%lu times so far), rescanning all trees", gInotify.overflows );
+        tWatchedTree * watchedTree;
+        listForEachEntry( g.treeList, watchedTree )
+        {
+            if ( watchedTree->scan.overflow.at == 0 ) watchedTree->scan.overflow.at = now;
+            watchedTree->scan.overflow.full = true;
+        }
+        /* dropped events - so force full rescan ASAP */
+        rescanAllTrees();
+    } else {
+        listForEachEntry( &gInotify.dirty, entry )
+        {
+            tFSNode * dirNode = dirtyNode( entry );
+            if ( dirNode->watchedTree->scan.overflow.at == 0 ) dirNode->watchedTree->scan.overflow.at = now;
+            rescanDirectory( dirNode );
+        }
+        logWarning( "inotify queue overflowed (%lu times so far), rescanning %u recently active directories",
+                    gInotify.overflows, count );
+    }
+}
+
+
+/**
+ * @brief read and process inotify events until there are no more waiting
+ * @return
+ */
+tError processInotifyEvents( void )
 {
     int result = 0;
 
@@ -643,27 +1022,44 @@ tError processInotifyEvents( tWatchedTree * watchedTree )
      * A compiler may automagically handle aligning the buffer too, but better
      * safe than sorry. */
 
-    static char buf[8192] __attribute__ ((aligned(__alignof__(int))));
+    static char buf[65536] __attribute__ ((aligned(__alignof__(int))));
 
-    ssize_t len = read( watchedTree->inotify.fd, buf, sizeof( buf ));
+    int     count = 0;
+    int     reads = 0;
+    ssize_t total = 0;
+
+    for (;;) {
+        ssize_t len = read( gInotify.fd, buf, sizeof( buf ));
+
+        /* If the nonblocking read() found nothing (more) to read, then it returns
+         * -1 with errno set to EAGAIN. That's a normal case, not an error */
+        if ( len == -1 ) {
+            if ( errno == EINTR ) continue;
+            if ( errno != EAGAIN ) {
+                logError( "unable to read from iNotify fd %d", gInotify.fd );
+                result = -errno;
+            }
+            break;
+        }
+        ++reads;
+        total += len;
 
-    /* If the nonblocking read() found nothing to read, then it returns
-     * -1 with errno set to EAGAIN. That's a normal case, not an error */
-    if ( len == -1 && errno != EAGAIN ) {
-        logError( "unable to read from iNotify fd %d", watchedTree->inotify.fd );
-        result = -errno;
-    } else {
         /* Loop over all iNotify events packed into the buffer we just filled */
-        int count = 0;
         const char * event = buf;
         const char * end = buf + len;
         while ( event < end ) {
+            const struct inotify_event * inotifyEvent = (const struct inotify_event *)event;
             ++count;
-            result = processOneInotifyEvent( watchedTree, (const struct inotify_event *)event );
-            event += sizeof( struct inotify_event ) + ((struct inotify_event *)event)->len;
+            /* an overflow isn't tied to a watch (its wd is -1), so deal with it first */
+            if ( inotifyEvent->mask & IN_Q_OVERFLOW ) {
+                inotifyOverflowed();
+            } else {
+                processOneInotifyEvent( inotifyEvent );
+            }
+            event += sizeof( struct inotify_event ) + inotifyEvent->len;
         }
-        logDebug( "processed %d iNotify events from a %ld byte buffer", count, len );
     }
+    logDebug( "processed %d iNotify events from %d reads, %ld bytes", count, reads, total );
 
     return result;
 }
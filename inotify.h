@@ -5,11 +5,31 @@
 #ifndef PROCESSNEWFILES__INOTIFY_H_
 #define PROCESSNEWFILES__INOTIFY_H_
 
-tError    processInotifyEvents( tWatchedTree * watchedTree );
-tError    registerForInotifyEvents( tWatchedTree * watchedTree );
+#include <sys/inotify.h>
+
+/* the events a tree's directories are watched for, unless its config says otherwise.
+ * Reads (IN_ACCESS, IN_OPEN, IN_CLOSE_NOWRITE) are left out, as every client playing
+ * back a recording would generate a stream of them. */
+#define kDefaultEventMask   ( IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO \
+                            | IN_DELETE | IN_DELETE_SELF | IN_MODIFY )
+
+/* always requested, whatever the config says, or the tree's nodes get out of step with the filesystem */
+#define kRequiredEventMask  ( IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF )
+
+tError    processInotifyEvents( void );
+tError    registerForInotifyEvents( uint64_t epollData );
 void      resetExpiration(tFSNode * node, tExpiredReason reason );
-time_t    nextExpiration( void );
+tTick     nextExpiration( void );
 tFSNode * fsNodeFromPath( tWatchedTree * watchedTree, const char * fullPath, tFSNodeType type );
+tFSNode * adoptDirectory( tWatchedTree * watchedTree, const char * fullPath, tWatchID watchID );
+tError    adoptInotifyFd( tFileDscr fd );
+tFileDscr inotifyFd( void );
 void      forgetWatch(const tFSNode *fsNode);
+void      dropWatch( tWatchID watchID );
+void      forgetDirty( tFSNode * dirNode );
+bool      fsNodePathMatches( const void * value, const void * key );
+tHash     calcHash( const char * string );
+tError    eventMaskFromName( const char * name, uint32_t * mask );
+void      logEventStats( tWatchedTree * watchedTree );
 
 #endif //PROCESSNEWFILES__INOTIFY_H_
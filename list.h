@@ -18,6 +18,14 @@ typedef tListEntry tListRoot;
     (void *)current != (void *)root; current = (void *)(((tListEntry *)current)->next) )
 
 tListRoot * newList(void);
+
+/* initialise a list root that's embedded in another structure (or on the stack) */
+static inline void listInit( tListRoot * root )
+{
+    root->next = root;
+    root->prev = root;
+}
+
 void freeList( tListRoot * root );
 
 static inline bool listAtEnd(const void * const root, const void * const current )
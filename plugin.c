@@ -0,0 +1,317 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "events.h"
+#include "pnfPlugin.h"
+#include "plugin.h"
+
+typedef struct sPlugin {
+    struct sPlugin *    next;       // every plugin that's been loaded
+    const char *        path;
+    void *              handle;
+    void *              context;    // the plugin's, from pnfInit()
+    tPnfProcess         process;
+    tPnfShutdown        shutdown;
+} tPlugin;
+
+/* a file handed to a plugin */
+typedef struct sPluginJob {
+    struct sPluginJob * next;       // on the queue, then on its way back to the event loop
+    tPlugin *           plugin;
+    tFSNode *           node;       // only looked at by the event loop
+    int                 status;
+    tPnfFile            file;       // points into 'path', so it doesn't change if the node does
+    char                path[];
+} tPluginJob;
+
+static struct {
+    tPlugin *       loaded;
+
+    pthread_t *     threads;
+    unsigned int    count;
+    bool            stopping;
+
+    pthread_mutex_t lock;       // guards the queue, and 'stopping'
+    pthread_cond_t  wake;
+    struct {
+        tPluginJob *    head;
+        tPluginJob *    tail;
+    } queue;
+
+    _Atomic(tPluginJob *) done; // pushed by the plugins, taken all at once by the event loop
+    tFileDscr       eventFd;
+} gPlugins = {
+    .lock    = PTHREAD_MUTEX_INITIALIZER,
+    .wake    = PTHREAD_COND_INITIALIZER,
+    .eventFd = -1
+};
+
+
+/**
+ * @brief create the eventfd that wakes the event loop when a plugin is done with a file
+ * @param epollData what epoll should hand back when there are jobs to collect
+ * @return
+ */
+tError initPlugins( uint64_t epollData )
+{
+    gPlugins.eventFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( gPlugins.eventFd == -1 ) {
+        logError( "unable to create the plugins' eventfd" );
+        return -errno;
+    }
+    return registerFdToEpoll( gPlugins.eventFd, epollData );
+}
+
+
+/**
+ * @brief load a plugin for a tree, and initialize it
+ * @param path of the shared object
+ * @param tree the tree's root
+ * @return NULL if it couldn't be loaded, or it refused to be
+ */
+tPlugin * loadPlugin( const char * path, const char * tree )
+{
+    void * handle = dlopen( path, RTLD_NOW | RTLD_LOCAL );
+    if ( handle == NULL ) {
+        logSetErrno( 0 );
+        logError( "unable to load plugin \'%s\': %s", path, dlerror() );
+        return NULL;
+    }
+
+    tPnfInit     init     = (tPnfInit)dlsym( handle, "pnfInit" );
+    tPnfProcess  process  = (tPnfProcess)dlsym( handle, "pnfProcess" );
+    tPnfShutdown shutdown = (tPnfShutdown)dlsym( handle, "pnfShutdown" );
+    if ( init == NULL || process == NULL || shutdown == NULL ) {
+        logSetErrno( 0 );
+        logError( "plugin \'%s\' doesn't export pnfInit, pnfProcess and pnfShutdown", path );
+        dlclose( handle );
+        return NULL;
+    }
+
+    tPlugin * plugin = calloc( 1, sizeof( tPlugin ) );
+    if ( plugin == NULL ) {
+        dlclose( handle );
+        return NULL;
+    }
+    plugin->path     = strdup( path );
+    plugin->handle   = handle;
+    plugin->process  = process;
+    plugin->shutdown = shutdown;
+
+    int err = init( kPnfPluginVersion, tree, &plugin->context );
+    if ( err != 0 ) {
+        logSetErrno( 0 );
+        logError( "plugin \'%s\' refused to handle \'%s\' (%d)", path, tree, err );
+        dlclose( handle );
+        free( (void *)plugin->path );
+        free( plugin );
+        return NULL;
+    }
+
+    plugin->next = gPlugins.loaded;
+    gPlugins.loaded = plugin;
+    logInfo( "loaded plugin \'%s\' for \'%s\'", path, tree );
+
+    return plugin;
+}
+
+
+/**
+ * @brief tPnfDone: the plugin is done with a file. May be called on any thread
+ * @param token the job
+ * @param status
+ */
+static void pluginDone( void * token, int status )
+{
+    tPluginJob * job = token;
+    job->status = status;
+
+    tPluginJob * head = atomic_load( &gPlugins.done );
+    do {
+        job->next = head;
+    } while ( !atomic_compare_exchange_weak( &gPlugins.done, &head, job ) );
+
+    /* only the first needs to wake the event loop, it takes the whole list */
+    if ( head == NULL ) {
+        uint64_t one = 1;
+        if ( write( gPlugins.eventFd, &one, sizeof( one ) ) != sizeof( one ) ) {
+            logError( "unable to wake the event loop" );
+        }
+    }
+}
+
+
+/**
+ * @brief one of the pool's threads
+ * @param arg unused
+ * @return
+ */
+static void * pluginThread( void * arg )
+{
+    (void)arg;
+
+    pthread_mutex_lock( &gPlugins.lock );
+    for (;;) {
+        while ( gPlugins.queue.head == NULL && !gPlugins.stopping ) {
+            pthread_cond_wait( &gPlugins.wake, &gPlugins.lock );
+        }
+        if ( gPlugins.stopping ) break;
+
+        tPluginJob * job = gPlugins.queue.head;
+        gPlugins.queue.head = job->next;
+        pthread_mutex_unlock( &gPlugins.lock );
+
+        job->plugin->process( job->plugin->context, &job->file, pluginDone, job );
+
+        pthread_mutex_lock( &gPlugins.lock );
+    }
+    pthread_mutex_unlock( &gPlugins.lock );
+
+    return NULL;
+}
+
+
+/**
+ * @brief start the threads, the first time they're needed. As many as may
+ * be processing files at once
+ * @return
+ */
+static tError startPluginThreads( void )
+{
+    unsigned int count = ( g.jobs.limit > 0 ) ? g.jobs.limit : 1;
+
+    gPlugins.threads = calloc( count, sizeof( pthread_t ) );
+    if ( gPlugins.threads == NULL ) {
+        return -ENOMEM;
+    }
+
+    for ( unsigned int i = 0; i < count; ++i ) {
+        /* signals stay blocked in the new thread, as they are in this one, so they're only seen by the signalfd */
+        int err = pthread_create( &gPlugins.threads[ i ], NULL, pluginThread, NULL );
+        if ( err != 0 ) {
+            logSetErrno( err );
+            logError( "unable to start plugin thread %u", i );
+            logSetErrno( 0 );
+            if ( i == 0 ) return -err;
+            break;
+        }
+        gPlugins.count = i + 1;
+    }
+    logInfo( "started %u plugin threads", gPlugins.count );
+
+    return 0;
+}
+
+
+/**
+ * @brief queue the file for its tree's plugin
+ * @param fileNode
+ * @return
+ */
+tError sendToPlugin( tFSNode * fileNode )
+{
+    if ( gPlugins.threads == NULL ) {
+        tError result = startPluginThreads();
+        if ( result != 0 ) return result;
+    }
+
+    size_t length = strlen( fileNode->path ) + 1;
+    tPluginJob * job = calloc( 1, sizeof( tPluginJob ) + length );
+    if ( job == NULL ) {
+        return -ENOMEM;
+    }
+    memcpy( job->path, fileNode->path, length );
+
+    const tWatchedTree * watchedTree = fileNode->watchedTree;
+    job->plugin       = watchedTree->plugin;
+    job->node         = fileNode;
+    job->file.path    = job->path;
+    job->file.relPath = &job->path[ fileNode->relPath - fileNode->path ];
+    job->file.reason  = expiredReasonAsStr[ fileNode->expires.because ];
+    job->file.tree    = watchedTree->root.path;
+    job->file.attempt = (unsigned int)fileNode->expires.retries + 1;
+
+    pthread_mutex_lock( &gPlugins.lock );
+    if ( gPlugins.queue.head == NULL ) {
+        gPlugins.queue.head = job;
+    } else {
+        gPlugins.queue.tail->next = job;
+    }
+    gPlugins.queue.tail = job;
+    pthread_cond_signal( &gPlugins.wake );
+    pthread_mutex_unlock( &gPlugins.lock );
+
+    logDebug( "queued \'%s\' for plugin \'%s\'", fileNode->relPath, job->plugin->path );
+
+    /* it's running here, in our own process */
+    fileNode->child.pid    = getpid();
+    fileNode->child.pidfd  = -1;
+    fileNode->child.plugin = job;
+
+    return 0;
+}
+
+
+/**
+ * @brief record the outcome of each file the plugins are done with
+ * @return
+ */
+tError processPluginResults( void )
+{
+    uint64_t count;
+
+    /* reset the eventfd *before* taking the list, so a job posted after this is sure to wake us again */
+    if ( read( gPlugins.eventFd, &count, sizeof( count ) ) == -1 && errno != EAGAIN ) {
+        logError( "unable to read the plugins' eventfd" );
+    }
+    logSetErrno( 0 );
+
+    tPluginJob * job = atomic_exchange( &gPlugins.done, NULL );
+    while ( job != NULL ) {
+        tPluginJob * next = job->next;
+
+        tFSNode * node = job->node;
+        if ( node->child.plugin != job ) {
+            logError( "(Internal) a plugin finished with \'%s\' when it wasn't expected to", job->file.relPath );
+        } else {
+            siginfo_t info = { .si_pid = node->child.pid, .si_code = CLD_EXITED, .si_status = job->status };
+            childExited( node, &info );
+        }
+        free( job );
+
+        job = next;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief stop the threads, letting them finish the files they're in the
+ * middle of, then shut down the plugins. Files still queued are left for
+ * next time, as nothing has been recorded for them
+ */
+void stopPlugins( void )
+{
+    pthread_mutex_lock( &gPlugins.lock );
+    gPlugins.stopping = true;
+    pthread_cond_broadcast( &gPlugins.wake );
+    pthread_mutex_unlock( &gPlugins.lock );
+
+    for ( unsigned int i = 0; i < gPlugins.count; ++i ) {
+        pthread_join( gPlugins.threads[ i ], NULL );
+    }
+
+    /* they're left loaded: a plugin's own threads may still be running its code */
+    for ( tPlugin * plugin = gPlugins.loaded; plugin != NULL; plugin = plugin->next ) {
+        plugin->shutdown( plugin->context );
+    }
+}
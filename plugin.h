@@ -0,0 +1,25 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_PLUGIN_H
+#define PROCESSNEWFILES_PLUGIN_H
+
+#include <stdint.h>
+
+/*
+ * Loads the plugins trees are configured with (see pnfPlugin.h), and runs
+ * them on a pool of threads, started the first time a file is handed to
+ * one. The threads never touch the nodes: each file is copied into a job,
+ * and when the plugin is done with it, the job goes back to the event loop
+ * on a lock-free list, with an eventfd to wake it up, as the scan threads'
+ * results do.
+ */
+
+tError             initPlugins( uint64_t epollData );
+struct sPlugin *   loadPlugin( const char * path, const char * tree );
+tError             sendToPlugin( tFSNode * fileNode );
+tError             processPluginResults( void );
+void               stopPlugins( void );
+
+#endif //PROCESSNEWFILES_PLUGIN_H
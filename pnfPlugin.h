@@ -0,0 +1,55 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_PNFPLUGIN_H
+#define PROCESSNEWFILES_PNFPLUGIN_H
+
+/*
+ * The interface for in-process handlers. A watch group configured with
+ *     plugin = "/usr/lib/processNewFiles/example.so";
+ * rather than 'exec' loads the shared object with dlopen(), and hands each
+ * file to it instead of starting a child. It must export:
+ *
+ *   int  pnfInit( unsigned int version, const char * tree, void ** context );
+ *       Called once, on the daemon's main thread, when the tree is created.
+ *       'version' is kPnfPluginVersion, as the daemon was built with. Return
+ *       zero if all is well, and anything else to refuse to load. Whatever
+ *       is put in 'context' is passed to the other two.
+ *
+ *   void pnfProcess( void * context, const tPnfFile * file, tPnfDone done, void * token );
+ *       Called on one of a small pool of threads, for each file. Several
+ *       files may be processed at once, so it must be thread-safe. Call
+ *       'done' exactly once for each file, from any thread, before or after
+ *       returning, with zero if the file was processed. Anything else is
+ *       taken as a failure, and the file is retried, as it would be if a
+ *       child exited with that status. 'file' is only valid until 'done'
+ *       has been called.
+ *
+ *   void pnfShutdown( void * context );
+ *       Called on the main thread as the daemon exits, once the pool's
+ *       threads have stopped. Any 'done' calls after this are ignored.
+ *
+ * As they share the daemon's process, a plugin that crashes takes the
+ * daemon with it, and one that blocks holds up one of the pool's threads.
+ * So they're best kept to lightweight work: renaming, updating an index,
+ * sending a notification...
+ */
+
+#define kPnfPluginVersion   1
+
+typedef struct {
+    const char *    path;       // the file's full path
+    const char *    relPath;    // ...relative to the tree's root
+    const char *    reason;     // why it's being processed, e.g. "is new"
+    const char *    tree;       // the tree's root
+    unsigned int    attempt;    // 1 the first time, counting up with each retry
+} tPnfFile;
+
+typedef void (* tPnfDone)( void * token, int status );
+
+typedef int  (* tPnfInit)( unsigned int version, const char * tree, void ** context );
+typedef void (* tPnfProcess)( void * context, const tPnfFile * file, tPnfDone done, void * token );
+typedef void (* tPnfShutdown)( void * context );
+
+#endif //PROCESSNEWFILES_PNFPLUGIN_H
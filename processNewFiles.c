@@ -10,6 +10,9 @@
 #include <libconfig.h>
 
 #include "events.h"
+#include "inotify.h"
+#include "takeover.h"
+#include "forkServer.h"
 
 
 /** shared globals */
@@ -33,6 +36,96 @@ tError printUsage( void ** argtable )
 }
 
 
+/**
+ * @brief look up an optional duration, given in seconds as either an integer or a float
+ * @param setting the group to look in
+ * @param name
+ * @param milliseconds left unchanged if the setting isn't present or isn't valid
+ * @return
+ */
+tError lookupMilliseconds( const config_setting_t * setting, const char * name, tTick * milliseconds )
+{
+    tError result = 0;
+    double seconds;
+
+    const config_setting_t * member = config_setting_get_member( setting, name );
+    if ( member != NULL ) {
+        switch ( config_setting_type( member ) )
+        {
+        case CONFIG_TYPE_INT:
+            seconds = config_setting_get_int( member );
+            break;
+
+        case CONFIG_TYPE_FLOAT:
+            seconds = config_setting_get_float( member );
+            break;
+
+        default:
+            seconds = -1;
+            break;
+        }
+
+        if ( seconds <= 0 ) {
+            logError( "in %s at line %d: '%s' must be a positive number of seconds",
+                      config_setting_source_file( member ),
+                      config_setting_source_line( member ),
+                      name );
+            result = -EINVAL;
+        } else {
+            *milliseconds = (tTick)(seconds * 1000 + 0.5);
+            logDebug( "%s = %lu ms", name, *milliseconds );
+        }
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief look up an optional list of inotify event names, e.g.
+ *     events = [ "create", "close_write", "move", "delete" ];
+ * @param setting the group to look in
+ * @param name
+ * @param mask left unchanged if the setting isn't present or isn't valid
+ * @return
+ */
+tError lookupEventMask( const config_setting_t * setting, const char * name, uint32_t * mask )
+{
+    tError   result = 0;
+    uint32_t events = 0;
+
+    const config_setting_t * member = config_setting_get_member( setting, name );
+    if ( member != NULL ) {
+        if ( !config_setting_is_aggregate( member ) ) {
+            logError( "in %s at line %d: '%s' must be a list of event names",
+                      config_setting_source_file( member ),
+                      config_setting_source_line( member ),
+                      name );
+            return -EINVAL;
+        }
+
+        int count = config_setting_length( member );
+        for ( int i = 0; i < count && result == 0; ++i ) {
+            const char * event = config_setting_get_string_elem( member, i );
+            if ( event == NULL || eventMaskFromName( event, &events ) != 0 ) {
+                logError( "in %s at line %d: '%s' is not an inotify event",
+                          config_setting_source_file( member ),
+                          config_setting_source_line( member ),
+                          event != NULL ? event : "(not a string)" );
+                result = -EINVAL;
+            }
+        }
+
+        if ( result == 0 ) {
+            *mask = events;
+            logDebug( "%s = 0x%08x", name, events );
+        }
+    }
+
+    return result;
+}
+
+
 /**
  * @brief
  * @param group
@@ -44,6 +137,13 @@ tError importTree( const config_setting_t * group )
     if ( config_setting_is_group( group ) ) {
         const char * path = NULL;
         const char * exec = NULL;
+        int          jobs = 0;
+        tTick        idle = 0;
+        uint32_t     events = 0;
+        const char * state = NULL;
+        int          scripts = 0;
+        const char * worker = NULL;
+        const char * plugin = NULL;
         const config_setting_t * member;
 
         member = config_setting_get_member( group, "path" );
@@ -56,11 +156,21 @@ tError importTree( const config_setting_t * group )
             path = config_setting_get_string( member );
             if ( path != NULL ) {
                 logDebug( "path = \"%s\"", path );
+                /* either 'exec', run for each file, 'worker', which each file is sent to,
+                 * or 'plugin', which handles each file in-process */
+                if ( config_setting_lookup_string( group, "worker", &worker ) == CONFIG_TRUE ) {
+                    logDebug( "worker = \"%s\"", worker );
+                }
+                if ( config_setting_lookup_string( group, "plugin", &plugin ) == CONFIG_TRUE ) {
+                    logDebug( "plugin = \"%s\"", plugin );
+                }
                 member = config_setting_get_member( group, "exec" );
                 if ( member == NULL ) {
-                    logError("in %s at line %d: watch group doesn't have a \'exec\' element",
-                             config_setting_source_file(group),
-                             config_setting_source_line(group));
+                    if ( worker == NULL && plugin == NULL ) {
+                        logError("in %s at line %d: watch group doesn't have a \'exec\' element",
+                                 config_setting_source_file(group),
+                                 config_setting_source_line(group));
+                    }
                 } else {
                     exec = config_setting_get_string( member );
                     if ( exec != NULL ) {
@@ -68,12 +178,57 @@ tError importTree( const config_setting_t * group )
                     }
                 }
             }
-            if ( path == NULL || exec == NULL )
+            /* optional: limit how many of this tree's files are processed at once */
+            if ( config_setting_lookup_int( group, "jobs", &jobs ) == CONFIG_TRUE && jobs < 0 ) {
+                logError( "in %s at line %d: 'jobs' must not be negative",
+                          config_setting_source_file( group ),
+                          config_setting_source_line( group ) );
+                jobs = 0;
+            }
+            /* optional: override the global idle time, e.g. sub-second for small sidecar files */
+            lookupMilliseconds( group, "idle", &idle );
+            /* optional: which inotify events to watch for (see kDefaultEventMask) */
+            if ( lookupEventMask( group, "events", &events ) != 0 ) {
+                result = -EINVAL;
+            }
+            /* optional: where to keep track of which files have been processed.
+             * "log" (the default) is the state store in '.seen', "xattr" is an
+             * xattr on each file, which falls back to the log where it's rejected */
+            if ( config_setting_lookup_string( group, "state", &state ) == CONFIG_TRUE
+              && strcmp( state, "log" ) != 0 && strcmp( state, "xattr" ) != 0 ) {
+                logError( "in %s at line %d: 'state' must be \"log\" or \"xattr\"",
+                          config_setting_source_file( group ),
+                          config_setting_source_line( group ) );
+                result = -EINVAL;
+            }
+            /* optional: a debugging aid. Write each job out as a script in '.seen/scripts',
+             * which runs it again just as it was run. Kept until the job succeeds */
+            config_setting_lookup_bool( group, "scripts", &scripts );
+
+            if ( result != 0 ) {
+                /* already reported */
+            } else if ( path == NULL || ( exec == NULL && worker == NULL && plugin == NULL ) )
             {
                 logError( "both 'path' and 'exec' elements must be present in a watch group");
                 result = -EINVAL;
+            } else if ( ( exec != NULL ) + ( worker != NULL ) + ( plugin != NULL ) > 1 ) {
+                logError( "in %s at line %d: a watch group can only have one of 'exec', 'worker' or 'plugin'",
+                          config_setting_source_file( group ),
+                          config_setting_source_line( group ) );
+                result = -EINVAL;
             } else {
-                result = createTree( path, exec );
+                tTreeConfig treeConfig = {
+                    .path = path,
+                    .exec = exec,
+                    .jobs = (unsigned int)jobs,
+                    .idle = idle,
+                    .events = events,
+                    .useXattr = ( state != NULL && strcmp( state, "xattr" ) == 0 ),
+                    .writeScripts = ( scripts != 0 ),
+                    .worker = worker,
+                    .plugin = plugin
+                };
+                result = createTree( &treeConfig );
             }
         }
     } else {
@@ -98,6 +253,41 @@ tError importConfig( const config_t * config )
     config_write( config, stdout );
 #endif
 
+    lookupMilliseconds( config_root_setting( config ), "idle",     &g.timeout.idle );
+    lookupMilliseconds( config_root_setting( config ), "rescan",   &g.timeout.rescan );
+    lookupMilliseconds( config_root_setting( config ), "deepScan", &g.timeout.deepScan );
+
+    int jobs;
+    if ( config_lookup_int( config, "jobs", &jobs ) == CONFIG_TRUE ) {
+        if ( jobs < 1 ) {
+            logError( "'jobs' must be at least 1" );
+        } else {
+            g.jobs.limit = (unsigned int)jobs;
+            logDebug( "jobs = %u", g.jobs.limit );
+        }
+    }
+
+    int scanThreads;
+    if ( config_lookup_int( config, "scanThreads", &scanThreads ) == CONFIG_TRUE ) {
+        if ( scanThreads < 0 ) {
+            logError( "'scanThreads' cannot be negative" );
+        } else {
+            g.scanThreads = (unsigned int)scanThreads;
+            logDebug( "scanThreads = %u", g.scanThreads );
+        }
+    }
+
+    /* while we're still small, and before there are any threads, so before any tree is created.
+     * Not fatal: children are started directly */
+    int forkServer = 0;
+    if ( config_lookup_bool( config, "forkServer", &forkServer ) == CONFIG_TRUE && forkServer ) {
+        logDebug( "forkServer = true" );
+        if ( !forkServerRunning() && startForkServer() != 0 ) {
+            logWarning( "unable to start the fork server" );
+            logSetErrno( 0 );
+        }
+    }
+
     const config_setting_t * setting = config_lookup( config, "watch" );
     if ( setting == NULL ) {
         logError( "unable to find 'watch' element" );
@@ -268,6 +458,7 @@ tError processArgs( int argc, char * argv[] )
         struct arg_lit *   help;
         struct arg_lit *   version;
         struct arg_lit *   killDaemon;
+        struct arg_lit *   takeover;
         struct arg_int *   debugLevel;
         struct arg_file *  configFile;
         struct arg_file *  path;
@@ -283,6 +474,8 @@ tError processArgs( int argc, char * argv[] )
                                             "display version info (and exit)" ),
          option.killDaemon =  arg_lit0( "k", "kill",
                                             "shut down the background daemon (and exit)" ),
+         option.takeover   =  arg_lit0( NULL, "takeover",
+                                            "take over the running daemon's watches, so none of its events are missed" ),
          option.debugLevel =  arg_int0( "d", "debug-level", "",
                                             "set the level of detail being logged (0-7, 0 is least detailed)" ),
          option.configFile = arg_filen( "c", "config-file", "<file>",
@@ -314,8 +507,28 @@ tError processArgs( int argc, char * argv[] )
             return 0;
         }
 
-        g.timeout.idle   = 10;
-        g.timeout.rescan = 30;
+        g.timeout.idle     = 10 * 1000;
+        g.timeout.rescan   = 30 * 1000;
+        g.timeout.deepScan = 60 * 60 * 1000;   /* the safety net for anything the directory stamps miss */
+
+        /* by default, process as many files at once as there are CPUs */
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        g.jobs.limit = ( cpus > 0 ) ? (unsigned int)cpus : 1;
+
+        /* scanning is mostly waiting on metadata I/O, so a few threads help even on one CPU.
+         * Zero scans on the event loop instead */
+        g.scanThreads = 4;
+
+        /* the handover has to arrive before the trees are created */
+        if ( option.takeover->count > 0 ) {
+            result = takeOver();
+            if ( result != 0 ) {
+                logSetErrno( -result );
+                logWarning( "unable to take over from the running daemon, so starting afresh" );
+                logSetErrno( 0 );
+                result = 0;
+            }
+        }
 
         config = (config_t *)calloc( 1, sizeof(config_t));
         if ( config != NULL ) {
@@ -324,6 +537,9 @@ tError processArgs( int argc, char * argv[] )
             config_destroy( config );
         }
 
+        /* any trees that were handed over but are no longer configured */
+        finishTakeover();
+
         /* release each non-null entry in argtable[] */
         arg_freetable( argtable, sizeof( argtable ) / sizeof( argtable[ 0 ] ) );
     }
@@ -349,7 +565,7 @@ tError main( int argc, char * argv[] )
     }
     initLogStuff( g.executableName );
 
-    g.expiringList = newList();
+    g.expiring = newTimerWheel( monotonicMs() );
     g.readyList = newList();
     g.executingList = newList();
 
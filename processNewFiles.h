@@ -18,10 +18,10 @@
 #include <signal.h>
 
 #include <string.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <ftw.h>
 
 typedef unsigned long   tHash;
 typedef int             tError;
@@ -35,26 +35,46 @@ typedef int     		tFileDscr;
 //typedef struct nextNode tFSNode;
 typedef struct sFSNode tFSNode;
 
+#include "timerWheel.h"
+
+/* milliseconds on CLOCK_MONOTONIC. Deadlines use this, so changes to the wall clock don't skew them */
+static inline tTick monotonicMs( void )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (tTick)now.tv_sec * 1000 + (tTick)now.tv_nsec / 1000000;
+}
+
 typedef struct {
     const char *  executableName;   /* basename used to invoke us */
 
     char *        pidFilename;
 
     struct {
-        time_t    idle;
-        time_t    rescan;
+        tTick     idle;             /* in milliseconds */
+        tTick     rescan;           /* in milliseconds */
+        tTick     deepScan;         /* in milliseconds. How often a rescan looks at every file, not just those in changed directories */
     } timeout;
 
-    tListRoot *  expiringList;      /* linked list of nodes waiting to expire, ordered by ascending expiration time */
+    tTimerWheel * expiring;         /* nodes waiting to expire, filed by expiration time */
     tListRoot *  readyList;         /* linked list of nodes ready to be executed */
     int          readyCount;        /* number of nodes currently in the list. We only maintain a limited number at
                                        any point in time, otherwise there could be tens of thousands of nodes made
                                        'ready' nodes from the first scan of a large hierarchy */
     tListRoot *  executingList;     /* linked list of nodes currently executing. If it returns a non-zero exit code,
-                                       it'll be put back on the expiringList, and be retried after am 'idle' delay */
+                                       it'll be put back on the expiring wheel, and be retried after am 'idle' delay */
+
+    struct {
+        unsigned int limit;         /* maximum number of children running at once, across all trees */
+        unsigned int running;       /* number of nodes currently on the executingList */
+    } jobs;
+
+    unsigned int scanThreads;       /* threads that walk the trees. zero means the event loop does it */
 
     tRadixTree * pathTree;          /* radix tree of full paths */
 
+    tListRoot *  treeList;          /* linked list of every tWatchedTree */
+
 } tGlobals;
 
 extern tGlobals g;
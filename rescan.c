@@ -5,247 +5,1056 @@
 #include "processNewFiles.h"
 
 #include <time.h>
-#include <ftw.h>
+#include <dirent.h>
+#include <sys/syscall.h>
 
 #include "rescan.h"
 #include "events.h"
 #include "inotify.h"
+#include "scanPool.h"
 
 
-/* Unfortunately, the API for nftw() doesn't support the caller
- * providing an opaque structure to be passed through to the
- * function pointer. So we're forced to use a global */
+/* the layout getdents64() fills the buffer with. glibc only declares its own
+ * wrapper for it in recent versions, so use the syscall directly */
+typedef struct {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+} tDirent64;
 
-tWatchedTree *  gWatchedTree;
+
+/**
+ * @brief
+ * @param scan
+ * @param relPath
+ * @param shallow
+ * @return
+ */
+static tError queuePending( tTreeScan * scan, const char * relPath, bool shallow )
+{
+    if ( scan->pending.count >= scan->pending.size ) {
+        unsigned int size = ( scan->pending.size > 0 ) ? scan->pending.size * 2 : 64;
+        tPendingDir ** dirs = realloc( scan->pending.dirs, size * sizeof( tPendingDir * ) );
+        if ( dirs == NULL ) {
+            return -ENOMEM;
+        }
+        scan->pending.dirs = dirs;
+        scan->pending.size = size;
+    }
+
+    size_t len = strlen( relPath ) + 1;
+    tPendingDir * dir = malloc( sizeof( tPendingDir ) + len );
+    if ( dir == NULL ) {
+        return -ENOMEM;
+    }
+    dir->shallow = shallow;
+    memcpy( dir->relPath, relPath, len );
+    scan->pending.dirs[ scan->pending.count++ ] = dir;
+
+    return 0;
+}
+
+
+/**
+ * @brief the event loop's fScanQueueDir
+ */
+static tError pushDir( tTreeScan * scan, const char * relPath )
+{
+    return queuePending( scan, relPath, false );
+}
+
+
+/**
+ * @brief
+ * @param scan
+ * @return the next directory to scan (to be freed by the caller), or NULL when there are none left
+ */
+static tPendingDir * popDir( tTreeScan * scan )
+{
+    if ( scan->pending.count == 0 ) {
+        return NULL;
+    }
+    return scan->pending.dirs[ --scan->pending.count ];
+}
+
+
+/**
+ * @brief the event loop's way of handling what a scan finds
+ */
+static void foundNode( tTreeScan * scan, const char * fullPath, tFSNodeType type )
+{
+    fsNodeFromPath( scan->watchedTree, fullPath, type );
+}
 
 
 /**
- *
+ * @brief point the scan at a (different) tree
+ * @param scan
  * @param watchedTree
- * @param sb
- * @param fullPath
- * @param ftwbuf
  * @return
  */
-tNFTWresult scanFileNode( tWatchedTree *      watchedTree,
-                          const struct stat * sb,
-                          const char *        fullPath,
-                          const struct FTW *  ftwbuf )
+tError setScanTree( tTreeScan * scan, tWatchedTree * watchedTree )
 {
-#if 0
-    const char * status = NULL;
-#endif
+    scan->watchedTree = watchedTree;
 
-    const char * relPath = &fullPath[ watchedTree->root.pathLen ];
-    if ( *relPath == '/' ) {
-        ++relPath;
+    scan->rootLen = watchedTree->root.pathLen;
+    if ( scan->rootLen + 2 > sizeof( scan->path ) ) {
+        return -ENAMETOOLONG;
     }
+    memcpy( scan->path, watchedTree->root.path, scan->rootLen );
+    scan->path[ scan->rootLen++ ] = '/';
 
-    if ( fullPath[ ftwbuf->base ] != '.' )
-    {
-        struct stat shadowInfo;
-        if (fstatat(watchedTree->shadow.fd, relPath, &shadowInfo, 0  ) == -1 ) {
-            if ( errno == ENOENT ) {
-                /* shadow file does not exist, so create a fresh file node */
-                fsNodeFromPath( watchedTree, fullPath, kFile );
-#if 0
-                status = "first seen";
-#endif
-            } else {
-                logError( "Failed to get info about shadow file \'%s\'", relPath );
-            }
-        } else if ( S_ISREG(shadowInfo.st_mode ) ) {
-            if (shadowInfo.st_mode & (S_IXUSR | S_IXGRP) ) {
-                /* shadow file is *already* present and executable */
-                fsNodeFromPath( watchedTree, fullPath, kFile );
-#if 0
-                status = "retry";
+    return 0;
+}
+
+
+/**
+ * @brief set up a scan that runs on the event loop, and creates nodes as it goes
+ * @param scan
+ * @param watchedTree
+ * @return
+ */
+tError initTreeScan( tTreeScan * scan, tWatchedTree * watchedTree )
+{
+    memset( scan, 0, sizeof( tTreeScan ) );
+    scan->started    = monotonicMs();
+    scan->progressAt = scan->started + kScanProgressMs;
+    scan->found      = foundNode;
+    scan->queueDir   = pushDir;
+    scan->dir.fd     = -1;
+
+    scan->buffer = malloc( kScanBufferSize );
+    if ( scan->buffer == NULL ) {
+        return -ENOMEM;
+    }
+
+#ifdef USE_IO_URING
+    /* without a ring, each file is stat'ed individually, as usual */
+    scan->ring          = malloc( sizeof( tRing ) );
+    scan->batch.results = malloc( kScanBatchFiles * sizeof( struct statx ) );
+    if ( scan->ring == NULL || scan->batch.results == NULL
+      || ringInit( scan->ring, kScanBatchFiles ) != 0 ) {
+        free( scan->ring );
+        scan->ring = NULL;
+    }
 #endif
-            }
-            /* is the shadow file much older than the original? */
-            if ( (sb->st_mtim.tv_sec - shadowInfo.st_mtim.tv_sec ) > g.timeout.idle ) {
-                /* queue up the file to expire. Don't expire immediately in case we
-                 * started up while the file was in the midst if being modified */
-                fsNodeFromPath( watchedTree, fullPath, kFile );
-#if 0
-                status = "modified";
+
+    /* a scan thread's scan is pointed at a tree as each piece of work comes along */
+    if ( watchedTree == NULL ) {
+        return 0;
+    }
+    return setScanTree( scan, watchedTree );
+}
+
+
+static void freeListing( tListing * listing )
+{
+    free( listing->entries );
+    free( listing->names.buffer );
+    memset( listing, 0, sizeof( tListing ) );
+}
+
+
+/**
+ * @brief
+ * @param scan
+ */
+void freeTreeScan( tTreeScan * scan )
+{
+    tPendingDir * dir;
+    while ( (dir = popDir( scan )) != NULL ) {
+        free( dir );
+    }
+    if ( scan->dir.fd != -1 ) {
+        close( scan->dir.fd );
+        scan->dir.fd = -1;
+    }
+    free( scan->pending.dirs );
+    free( scan->buffer );
+    scan->pending.dirs = NULL;
+    scan->buffer = NULL;
+
+    freeListing( &scan->dir.listing );
+
+#ifdef USE_IO_URING
+    if ( scan->ring != NULL ) {
+        ringFree( scan->ring );
+        free( scan->ring );
+        scan->ring = NULL;
+    }
+    free( scan->batch.stats );
+    free( scan->batch.results );
+    scan->batch.stats   = NULL;
+    scan->batch.results = NULL;
+    scan->batch.size    = 0;
 #endif
+}
+
+
+static inline bool sameTime( const struct timespec * a, const struct timespec * b )
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+
+/**
+ * @brief has the directory changed since its files were last looked at?
+ * @param watchedTree
+ * @param hash of the directory's relative path
+ * @param stamp the directory's current stamp
+ * @return true if it hasn't
+ */
+static bool dirUnchanged( tWatchedTree * watchedTree, tHash hash, const tDirStamp * stamp )
+{
+    tDirStamp * recorded = NULL;
+
+    pthread_mutex_lock( &watchedTree->scan.stampLock );
+    hashMapFind( watchedTree->scan.stamps, hash, NULL, (void **)&recorded );
+    /* if two paths' hashes collide, they overwrite each other's stamp, and just get looked at more often */
+    bool unchanged = ( recorded != NULL
+                    && sameTime( &recorded->mtime, &stamp->mtime )
+                    && sameTime( &recorded->ctime, &stamp->ctime ) );
+    pthread_mutex_unlock( &watchedTree->scan.stampLock );
+
+    return unchanged;
+}
+
+
+/**
+ * @brief remember the directory's stamp, now that all its files have been looked at
+ * @param watchedTree
+ * @param hash of the directory's relative path
+ * @param stamp the directory's stamp from before it was read, so anything
+ * that changed while it was being read is picked up next time
+ */
+void recordDirStamp( tWatchedTree * watchedTree, tHash hash, const tDirStamp * stamp )
+{
+    tDirStamp * recorded = NULL;
+
+    pthread_mutex_lock( &watchedTree->scan.stampLock );
+    hashMapFind( watchedTree->scan.stamps, hash, NULL, (void **)&recorded );
+    if ( recorded == NULL ) {
+        recorded = malloc( sizeof( tDirStamp ) );
+        if ( recorded != NULL && hashMapAdd( watchedTree->scan.stamps, hash, recorded ) != 0 ) {
+            free( recorded );
+            recorded = NULL;
+        }
+    }
+    if ( recorded != NULL ) {
+        *recorded = *stamp;
+    }
+    pthread_mutex_unlock( &watchedTree->scan.stampLock );
+}
+
+
+/**
+ * @brief
+ * @param watchedTree
+ * @param hash of the directory's relative path
+ * @param stamp filled in with its stamp, if it has one
+ * @return true if it has one
+ */
+bool lookupDirStamp( tWatchedTree * watchedTree, tHash hash, tDirStamp * stamp )
+{
+    tDirStamp * recorded = NULL;
+
+    pthread_mutex_lock( &watchedTree->scan.stampLock );
+    hashMapFind( watchedTree->scan.stamps, hash, NULL, (void **)&recorded );
+    if ( recorded != NULL ) {
+        *stamp = *recorded;
+    }
+    pthread_mutex_unlock( &watchedTree->scan.stampLock );
+
+    return ( recorded != NULL );
+}
+
+
+/**
+ * @brief the directory has gone, so its stamp isn't needed any more
+ * @param dirNode
+ */
+void forgetDirStamp( tFSNode * dirNode )
+{
+    tWatchedTree * watchedTree = dirNode->watchedTree;
+    tHash          hash        = calcHash( dirNode->relPath );
+    tDirStamp *    recorded    = NULL;
+
+    pthread_mutex_lock( &watchedTree->scan.stampLock );
+    if ( hashMapFind( watchedTree->scan.stamps, hash, NULL, (void **)&recorded ) == 0 ) {
+        hashMapRemove( watchedTree->scan.stamps, hash, NULL );
+        free( recorded );
+    }
+    pthread_mutex_unlock( &watchedTree->scan.stampLock );
+}
+
+
+/**
+ * @brief append an entry to a listing
+ * @param listing
+ * @param name
+ * @param type the d_type getdents64() reported
+ * @return
+ */
+static tError addToListing( tListing * listing, const char * name, unsigned char type )
+{
+    size_t len = strlen( name ) + 1;
+
+    if ( listing->count >= listing->size ) {
+        unsigned int size = ( listing->size > 0 ) ? listing->size * 2 : 256;
+        tScanEntry * entries = realloc( listing->entries, size * sizeof( tScanEntry ) );
+        if ( entries == NULL ) {
+            return -ENOMEM;
+        }
+        listing->entries = entries;
+        listing->size    = size;
+    }
+    if ( listing->names.used + len > listing->names.size ) {
+        size_t size = ( listing->names.size > 0 ) ? listing->names.size * 2 : 4096;
+        while ( size < listing->names.used + len ) size *= 2;
+        char * names = realloc( listing->names.buffer, size );
+        if ( names == NULL ) {
+            return -ENOMEM;
+        }
+        listing->names.buffer = names;
+        listing->names.size   = size;
+    }
+
+    tScanEntry * entry = &listing->entries[ listing->count++ ];
+    entry->name = listing->names.used;
+    entry->type = type;
+    memcpy( &listing->names.buffer[ listing->names.used ], name, len );
+    listing->names.used += len;
+
+    return 0;
+}
+
+
+/**
+ * @brief read a whole directory
+ * Hidden entries are left out, which includes '.seen'.
+ * @param scan
+ * @param fd the directory
+ * @param listing filled in
+ * @return
+ */
+static tError readListing( tTreeScan * scan, tFileDscr fd, tListing * listing )
+{
+    tError result = 0;
+
+    listing->count      = 0;
+    listing->names.used = 0;
+
+    for (;;) {
+        long len = syscall( SYS_getdents64, fd, scan->buffer, kScanBufferSize );
+        if ( len <= 0 ) {
+            if ( len == -1 ) {
+                result = -errno;
             }
-        } else {
-            logError( "the shadow file \'%s/%s\' is not a regular file", watchedTree->shadow.path, relPath );
+            break;
         }
-#if 0
-        if ( status != NULL ) {
-            logDebug( "%d%-*c file: %s (%s)", ftwbuf->level, ftwbuf->level * 4, ':', relPath, status );
+        for ( long pos = 0; pos < len && result == 0; ) {
+            const tDirent64 * entry = (const tDirent64 *)&scan->buffer[ pos ];
+            pos += entry->d_reclen;
+
+            if ( entry->d_name[0] != '.' ) {
+                result = addToListing( listing, entry->d_name, entry->d_type );
+            }
         }
-#endif
+        if ( result != 0 ) break;
     }
 
-    return FTW_CONTINUE;
+    return result;
+}
+
+
+static inline const char * entryName( const tListing * listing, unsigned int index )
+{
+    return &listing->names.buffer[ listing->entries[ index ].name ];
 }
 
 
+#ifdef USE_IO_URING
 /**
- * @brief
- * @param watchedTree
- * @param fullPath
- * @param ftwbuf
+ * @brief wait for a batch of statx() calls, and note what they found
+ * user_data is the index into batch.results, and into 'files'.
+ * @param scan
+ * @param files the entries of dir.listing in the batch
+ * @param count
  * @return
  */
-tNFTWresult scanDirNode( tWatchedTree *      watchedTree,
-                         const struct stat * sb,
-                         const char *        fullPath,
-                         const struct FTW *  ftwbuf )
+static tError finishStatBatch( tTreeScan * scan, const unsigned int * files, unsigned int count )
 {
-    int result = FTW_SKIP_SUBTREE;
-    (void)sb;
+    tError result = ringSubmit( scan->ring, count );
 
-    if ( strncmp( fullPath,
-                  watchedTree->shadow.path,
-                  watchedTree->shadow.pathLen ) != 0
-      && fullPath[ ftwbuf->base ] != '.' )
-    {
-        result = FTW_CONTINUE;
+    unsigned int seen = 0;
+    while ( result == 0 && seen < count ) {
+        struct io_uring_cqe * cqe = ringNextCqe( scan->ring );
+        if ( cqe == NULL ) {
+            /* interrupted before they had all completed */
+            result = ringSubmit( scan->ring, count - seen );
+            if ( result == -EINTR ) result = 0;
+            continue;
+        }
+        unsigned int slot = (unsigned int)cqe->user_data;
+        tFileStat * stat = &scan->batch.stats[ files[ slot ] ];
+        const struct statx * info = &scan->batch.results[ slot ];
+        stat->err   = ( cqe->res < 0 ) ? -cqe->res : 0;
+        stat->mtime = info->stx_mtime;
+        stat->size  = info->stx_size;
+        ringCqeSeen( scan->ring );
+        ++seen;
+    }
 
-        const char * relPath = &fullPath[ watchedTree->root.pathLen ];
-        if ( *relPath == '/' ) {
-            ++relPath;
+    if ( result == 0 ) {
+        for ( unsigned int i = 0; i < count; ++i ) {
+            scan->batch.stats[ files[ i ] ].valid = true;
         }
+    }
+    return result;
+}
 
-#if 0
-        logDebug( "%d%-*c  dir: %s",
-                  ftwbuf->level,
-                  ftwbuf->level * 4, ':',
-                  relPath );
-#endif
 
-        /* make sure that the corresponding shadow directory exists */
-        if ( strlen( relPath ) > 0 ) {
-            if ( mkdirat( watchedTree->shadow.fd, relPath, S_IRWXU ) == -1
-                && errno != EEXIST )
-            {
-                logError( "Unable to create directory %s{%s}",
-                          watchedTree->shadow.path,
-                          relPath );
+/**
+ * @brief stat the regular files in the directory a batch at a time through
+ * the scan's ring. This is one io_uring_enter() per kScanBatchFiles files,
+ * rather than a syscall per file. A deep scan looks up each file's record
+ * first, and only stats the ones that have been processed before. A periodic
+ * scan stats them all, so scanFile() can ask the state store's filter.
+ * @param scan
+ */
+static void batchFileStats( tTreeScan * scan )
+{
+    const tListing * listing     = &scan->dir.listing;
+    tWatchedTree *   watchedTree = scan->watchedTree;
+
+    if ( listing->count > scan->batch.size ) {
+        tFileStat * stats = realloc( scan->batch.stats, listing->count * sizeof( tFileStat ) );
+        if ( stats == NULL ) return;
+        scan->batch.stats = stats;
+        scan->batch.size  = listing->count;
+    }
+    memset( scan->batch.stats, 0, listing->count * sizeof( tFileStat ) );
+    scan->batch.active = true;
+
+    unsigned int files[ kScanBatchFiles ];
+    unsigned int count = 0;
+    tError       result = 0;
+
+    for ( unsigned int i = 0; i < listing->count && result == 0; ++i ) {
+        if ( listing->entries[ i ].type != DT_REG ) continue;
+
+        /* scan->path holds '<root>/<relPath>/', as it does for scanEntry() */
+        const char * name    = entryName( listing, i );
+        size_t       nameLen = strlen( name );
+        if ( scan->dir.pathLen + nameLen + 1 > sizeof( scan->path ) ) continue;
+        memcpy( &scan->path[ scan->dir.pathLen ], name, nameLen + 1 );
+
+        tFileStat * stat = &scan->batch.stats[ i ];
+        if ( watchedTree->scan.generation != 0 ) {
+            storeLookupAt( watchedTree->state, &scan->path[ scan->rootLen ], scan->dir.fd, name,
+                           watchedTree->scan.generation, &stat->record );
+            stat->looked = true;
+            if ( !stateIsSettled( stat->record.state ) ) {
+                /* it needs a node whatever its mtime is */
+                stat->valid = true;
+                continue;
             }
-            logSetErrno( 0 );
         }
 
-        fsNodeFromPath( watchedTree, fullPath, kDirectory );
+        struct io_uring_sqe * sqe = ringGetSqe( scan->ring );
+        sqe->opcode      = IORING_OP_STATX;
+        sqe->fd          = scan->dir.fd;
+        sqe->addr        = (uintptr_t)name;
+        sqe->len         = STATX_MTIME | STATX_SIZE;
+        sqe->statx_flags = AT_STATX_DONT_SYNC;
+        sqe->addr2       = (uintptr_t)&scan->batch.results[ count ];
+        sqe->user_data   = count;
+
+        ++scan->count.stats;
+        files[ count++ ] = i;
+        if ( count == kScanBatchFiles ) {
+            result = finishStatBatch( scan, files, count );
+            count  = 0;
+        }
+    }
+    if ( count > 0 && result == 0 ) {
+        result = finishStatBatch( scan, files, count );
     }
 
-    return result;
+    if ( result != 0 ) {
+        /* the ring's in an unknown state, so stop using it. Anything not
+         * marked valid is looked up & stat'ed individually */
+        logSetErrno( -result );
+        logError( "batched statx() failed, carrying on without io_uring" );
+        logSetErrno( 0 );
+        ringFree( scan->ring );
+        free( scan->ring );
+        scan->ring = NULL;
+    }
 }
+#endif
 
 
 /**
- * @brief nftw handler for (re)scanning the tree
+ * @brief decide whether a regular file needs a node. It does unless the
+ * state store says it was processed (or given up on), and the file hasn't
+ * changed since.
+ * A deep scan looks up the record first, since it has to mark it as seen,
+ * and only then stats the file, to compare its mtime & size with the record.
+ * A periodic scan stats it first, and if the store's filter says a file with
+ * that mtime & size was processed, doesn't look up the record at all.
+ * @param scan
+ * @param index of the file in dir.listing
  * @param fullPath
- * @param sb
- * @param typeflag
- * @param ftwbuf
+ * @param relPath
+ */
+static void scanFile( tTreeScan * scan, unsigned int index, const char * fullPath, const char * relPath )
+{
+    tWatchedTree * watchedTree = scan->watchedTree;
+    tFileRecord    record;
+    bool           looked = false;  // record has been looked up
+    bool           periodic = ( watchedTree->scan.generation == 0 );
+    struct statx   info;
+    int            err = -1;    // the file hasn't been stat'ed yet
+
+    ++scan->count.files;
+
+#ifdef USE_IO_URING
+    const tFileStat * batched = scan->batch.active ? &scan->batch.stats[ index ] : NULL;
+    if ( batched != NULL && batched->valid ) {
+        looked = batched->looked;
+        record = batched->record;
+        if ( !looked || stateIsSettled( record.state ) ) {
+            err            = batched->err;
+            info.stx_mtime = batched->mtime;
+            info.stx_size  = batched->size;
+        }
+    }
+#endif
+
+    if ( periodic && !looked ) {
+        if ( err == -1 ) {
+            ++scan->count.stats;
+            err = ( statx( scan->dir.fd, entryName( &scan->dir.listing, index ), AT_STATX_DONT_SYNC,
+                           STATX_MTIME | STATX_SIZE, &info ) == -1 ) ? errno : 0;
+        }
+        if ( err == 0 && storeProbablyDone( watchedTree->state, relPath, statxNs( &info.stx_mtime ), info.stx_size ) ) {
+            return;
+        }
+    }
+
+    if ( !looked ) {
+        storeLookupAt( watchedTree->state, relPath, scan->dir.fd, entryName( &scan->dir.listing, index ),
+                       watchedTree->scan.generation, &record );
+    }
+
+    if ( !stateIsSettled( record.state ) ) {
+        /* never processed, or it was interrupted, so create a fresh file node */
+        scan->found( scan, fullPath, kFile );
+        return;
+    }
+
+    if ( err == -1 ) {
+        ++scan->count.stats;
+        err = ( statx( scan->dir.fd, entryName( &scan->dir.listing, index ), AT_STATX_DONT_SYNC,
+                       STATX_MTIME | STATX_SIZE, &info ) == -1 ) ? errno : 0;
+    }
+    if ( err == 0 ) {
+        if ( statxNs( &info.stx_mtime ) != record.mtime || info.stx_size != record.size ) {
+            /* modified since it was processed (or given up on). Queue up the file to expire. Don't expire
+             * immediately in case we started up while the file was in the midst if being modified */
+            scan->found( scan, fullPath, kFile );
+        } else if ( periodic && record.state == kStateDone ) {
+            /* so the filter knows next time */
+            storeNoteDone( watchedTree->state, relPath, record.mtime, record.size );
+        }
+    } else if ( err != ENOENT ) {
+        logSetErrno( err );
+        logError( "Failed to get info about \'%s\'", relPath );
+    }
+    logSetErrno( 0 );
+}
+
+
+/**
+ * @brief start scanning a directory. It's read in one go, and then its
+ * entries are looked at one at a time by scanNextEntry()
+ * @param scan
+ * @param relPath relative to the root of the tree, "" for the root itself
+ * @param shallow only queue the subdirectories we don't have a node for yet.
+ * This looks in the tree's pathMap, so only the event loop can use it.
  * @return
  */
-tNFTWresult scanNode( const char * fullPath, const struct stat * sb, int typeflag, struct FTW * ftwbuf )
+static tError openScanDir( tTreeScan * scan, const char * relPath, bool shallow )
 {
-    tNFTWresult result = FTW_CONTINUE;
+    tError result = 0;
+    tWatchedTree * watchedTree = scan->watchedTree;
 
-    if ( gWatchedTree != NULL )
-    {
-        switch ( typeflag )
-        {
-        case FTW_F: // fullPath is a regular file.
-            result = scanFileNode( gWatchedTree, sb, fullPath, ftwbuf );
-            break;
+    scan->dir.fd = -1;
 
-        case FTW_D: // fullPath is a directory.
-            result = scanDirNode( gWatchedTree, sb, fullPath, ftwbuf );
-            break;
+    size_t relLen = strlen( relPath );
+    if ( scan->rootLen + relLen + 2 > sizeof( scan->path ) ) {
+        return -ENAMETOOLONG;
+    }
 
-        default:
-            logError( "Error: %d: unhandled typeflag %d for %s", ftwbuf->level, typeflag, fullPath );
-            break;
+    tFileDscr fd = openat( watchedTree->root.fd, relLen > 0 ? relPath : ".",
+                           O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if ( fd == -1 ) {
+        /* it may have been deleted since it was queued */
+        result = -errno;
+        if ( result != -ENOENT ) {
+            ++scan->count.errors;
         }
+        logDebug( "unable to open \'%s\'", relPath );
+        logSetErrno( 0 );
+        return result;
     }
 
-    tFSNode * fsNode;
+    /* don't wander into other filesystems mounted within the tree */
+    struct stat info;
+    if ( fstat( fd, &info ) == -1 || info.st_dev != watchedTree->scan.device ) {
+        close( fd );
+        return 0;
+    }
+
+    ++scan->count.dirs;
+
+    /* Unless this is a deep scan, only look at the files in a directory that
+     * has changed. Its subdirectories are always scanned, as a change to
+     * them doesn't show up in its stamp. A shallow rescan is catching up on
+     * dropped events, so always looks */
+    scan->dir.hash          = calcHash( relPath );
+    scan->dir.stamp.mtime   = info.st_mtim;
+    scan->dir.stamp.ctime   = info.st_ctim;
+    scan->dir.examine       = true;
+    if ( !watchedTree->scan.deep && !shallow && dirUnchanged( watchedTree, scan->dir.hash, &scan->dir.stamp ) ) {
+        scan->dir.examine = false;
+        ++scan->count.unchanged;
+    }
+
+    result = readListing( scan, fd, &scan->dir.listing );
+    /* a partial listing mustn't make the directory look done */
+    scan->dir.complete = ( result == 0 );
+    if ( result != 0 ) {
+        ++scan->count.errors;
+        logError( "unable to read directory \'%s\'", relPath );
+        logSetErrno( 0 );
+    }
+    scan->dir.fd = fd;
+
+    /* scan->path holds '<root>/<relPath>/', and each entry's name is appended to it */
+    char * fullPath = scan->path;
+    memcpy( &fullPath[ scan->rootLen ], relPath, relLen );
+    /* the directory's own path has no trailing slash */
+    size_t dirLen = ( relLen > 0 ) ? scan->rootLen + relLen : scan->rootLen - 1;
+    fullPath[ dirLen ] = '\0';
+
+    scan->found( scan, fullPath, kDirectory );
 
-    size_t len = strlen( fullPath ) + 1;
-    char * path = malloc( len + 2 );
-    if ( path != NULL )
+    fullPath[ dirLen++ ] = '/';
+
+    scan->dir.shallow = shallow;
+    scan->dir.pathLen = dirLen;
+    scan->dir.next    = 0;
+
+#ifdef USE_IO_URING
+    scan->batch.active = false;
+    if ( scan->ring != NULL && scan->dir.examine ) {
+        batchFileStats( scan );
+    }
+#endif
+
+    return result;
+}
+
+
+/**
+ * @brief
+ * @param scan
+ */
+static void closeScanDir( tTreeScan * scan )
+{
+    close( scan->dir.fd );
+    scan->dir.fd = -1;
+}
+
+
+/**
+ * @brief a directory entry: report it if it's a file that needs a
+ * node, or queue it to be scanned in turn if it's a subdirectory
+ * @param scan
+ * @param index of the entry in dir.listing
+ */
+static void scanEntry( tTreeScan * scan, unsigned int index )
+{
+    const char *   name        = entryName( &scan->dir.listing, index );
+    unsigned char  type        = scan->dir.listing.entries[ index ].type;
+    tWatchedTree * watchedTree = scan->watchedTree;
+    char *         fullPath    = scan->path;
+    size_t         dirLen      = scan->dir.pathLen;
+    const char *   relPath     = &fullPath[ scan->rootLen ];
+
+    size_t nameLen = strlen( name );
+    if ( dirLen + nameLen + 1 > sizeof( scan->path ) ) {
+        logError( "path too long: \'%.*s%s\'", (int)(dirLen - scan->rootLen), relPath, name );
+        return;
+    }
+    memcpy( &fullPath[ dirLen ], name, nameLen + 1 );
+
+    if ( type == DT_UNKNOWN || type == DT_LNK ) {
+        /* the filesystem didn't say, or it's a symlink, which nftw() used to follow */
+        struct stat info;
+        ++scan->count.stats;
+        if ( fstatat( scan->dir.fd, name, &info, 0 ) == -1 ) {
+            logSetErrno( 0 );
+            return;
+        }
+        type = S_ISDIR( info.st_mode ) ? DT_DIR : S_ISREG( info.st_mode ) ? DT_REG : DT_UNKNOWN;
+    }
+
+    switch ( type )
     {
-        strncpy( path, fullPath, len );
-        if ( typeflag == FTW_D )
-        {
-            strncat( path, "/", len + 1 );
+    case DT_DIR:
+        if ( strncmp( fullPath, watchedTree->seen.path, watchedTree->seen.pathLen ) == 0 ) {
+            break;
+        }
+        if ( scan->dir.shallow ) {
+            tFSNode * node = NULL;
+            hashMapFind( watchedTree->pathMap, calcHash( fullPath ), fullPath, (void **)&node );
+            if ( node != NULL ) break;
         }
+        if ( scan->queueDir( scan, relPath ) != 0 ) {
+            logError( "unable to queue \'%s\' to be scanned", relPath );
+        }
+        break;
 
-        if (radixTreeFind(g.pathTree, path, (void **) &fsNode) != 0 )
-        {
-            logError( "\'%s\' does not match", path );
+    case DT_REG:
+        if ( scan->dir.examine ) {
+            scanFile( scan, index, fullPath, relPath );
         }
-        else
-        {
-            if ( fsNode == NULL )
-                logInfo( "matched \'%s\', but value is null", path );
-#if 0
-            else
-                logInfo( "\'%s\' matches", fsNode->path );
-#endif
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+/**
+ * @brief look at the next entry of the directory being scanned
+ * @param scan
+ * @return 1 if there may be more entries, 0 once the directory is finished (and has been closed)
+ */
+static tError scanNextEntry( tTreeScan * scan )
+{
+    if ( scan->dir.next >= scan->dir.listing.count ) {
+        if ( scan->dir.examine && scan->dir.complete ) {
+            recordDirStamp( scan->watchedTree, scan->dir.hash, &scan->dir.stamp );
         }
+        closeScanDir( scan );
+        return 0;
+    }
+
+    scanEntry( scan, scan->dir.next++ );
+
+    return 1;
+}
+
+
+/**
+ * @brief read one whole directory, reporting the files that need a node,
+ * and queueing its subdirectories to be scanned in turn
+ * @param scan
+ * @param relPath relative to the root of the tree, "" for the root itself
+ * @param shallow only queue the subdirectories we don't have a node for yet
+ * @return
+ */
+tError scanDir( tTreeScan * scan, const char * relPath, bool shallow )
+{
+    tError result = openScanDir( scan, relPath, shallow );
 
-        free( path );
+    while ( scan->dir.fd != -1 ) {
+        tError err = scanNextEntry( scan );
+        if ( err < 0 ) result = err;
     }
 
-    logSetErrno( 0 );
     return result;
 }
 
 
 /**
- * @brief Walk the hierarchy for files we have not seen before.
- * This is a backstop for the iNotify event mechanism.
+ * @brief carry on with a scan, from wherever it was put down
+ * @param scan
+ * @param budget roughly how many directory entries to look at before returning
+ * @return true if there's more to do
+ */
+bool scanSome( tTreeScan * scan, unsigned int budget )
+{
+    while ( budget > 0 ) {
+        if ( scan->dir.fd == -1 ) {
+            tPendingDir * dir = popDir( scan );
+            if ( dir == NULL ) {
+                return false;
+            }
+            openScanDir( scan, dir->relPath, dir->shallow );
+            free( dir );
+            --budget;
+        } else if ( scanNextEntry( scan ) > 0 ) {
+            --budget;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief the tree's scan on the event loop, creating it if need be
  * @param watchedTree
+ * @return NULL if it couldn't be created
+ */
+static tTreeScan * treeCursor( tWatchedTree * watchedTree )
+{
+    tTreeScan * scan = watchedTree->scan.cursor;
+
+    if ( scan == NULL ) {
+        scan = malloc( sizeof( tTreeScan ) );
+        if ( scan != NULL && initTreeScan( scan, watchedTree ) != 0 ) {
+            freeTreeScan( scan );
+            free( scan );
+            scan = NULL;
+        }
+        watchedTree->scan.cursor = scan;
+    }
+
+    return scan;
+}
+
+
+/**
+ * @brief the tree's scan on the event loop has nothing left to do
+ * @param watchedTree
+ */
+static void cursorFinished( tWatchedTree * watchedTree )
+{
+    tTreeScan * scan = watchedTree->scan.cursor;
+
+    logDebug( "scanned \'%s\'%s: %lu directories (%lu unchanged, %lu unreadable), %lu files, "
+              "%lu stat calls in %lu ms (%lu slices)",
+              watchedTree->root.path, watchedTree->scan.deep ? " deeply" : "",
+              scan->count.dirs, scan->count.unchanged, scan->count.errors, scan->count.files,
+              scan->count.stats, monotonicMs() - scan->started, scan->count.slices );
+
+    unsigned long errors  = scan->count.errors;
+    unsigned long entries = scan->count.dirs + scan->count.files;
+    freeTreeScan( scan );
+    free( scan );
+    watchedTree->scan.cursor = NULL;
+
+    /* a shallow rescan queued while the scan threads are walking the tree
+     * doesn't finish their scan. Only the scan that started it does */
+    bool finished = ( watchedTree->scan.running && !watchedTree->scan.background );
+
+    /* the recently active directories are only ever rescanned on the event loop */
+    if ( finished || !watchedTree->scan.overflow.full ) {
+        overflowRecovered( watchedTree, entries );
+    }
+
+    if ( finished ) {
+        watchedTree->scan.running = false;
+
+        forgetVanishedFiles( watchedTree, errors );
+
+        logEventStats( watchedTree );
+        logStoreStats( watchedTree->state );
+
+        /* the next rescan is timed from the end of this one */
+        resetExpiration( watchedTree->rootNode, kRescan );
+    }
+}
+
+
+/**
+ * @brief the rescan catching up on an inotify overflow is done, so log what it cost
+ * @param watchedTree
+ * @param entries how many directory entries the rescan looked at
+ */
+void overflowRecovered( tWatchedTree * watchedTree, unsigned long entries )
+{
+    if ( watchedTree->scan.overflow.at == 0 ) {
+        return;
+    }
+
+    logWarning( "caught up on \'%s\' after an inotify overflow, by rescanning %s (%lu entries) in %lu ms",
+                watchedTree->root.path,
+                watchedTree->scan.overflow.full ? "all of it" : "its recently active directories",
+                entries, monotonicMs() - watchedTree->scan.overflow.at );
+    logSetErrno( 0 );
+
+    watchedTree->scan.overflow.at   = 0;
+    watchedTree->scan.overflow.full = false;
+}
+
+
+/**
+ * @brief a deep scan comes across every file in the tree, so any record it
+ * didn't come across is for a file that was deleted while we weren't
+ * watching. Unless some directories couldn't be read, as they may still be
+ * in there.
+ * @param watchedTree
+ * @param errors how many directories couldn't be read
+ */
+void forgetVanishedFiles( tWatchedTree * watchedTree, unsigned long errors )
+{
+    if ( watchedTree->scan.generation == 0 ) {
+        return;
+    }
+    if ( errors > 0 ) {
+        logWarning( "%lu directories of \'%s\' couldn't be read, so keeping the records of any files not found",
+                    errors, watchedTree->root.path );
+        return;
+    }
+
+    unsigned long count = storeSweep( watchedTree->state, watchedTree->scan.generation );
+    if ( count > 0 ) {
+        logInfo( "forgot %lu files that were deleted from \'%s\'", count, watchedTree->root.path );
+    }
+}
+
+
+/**
+ * @brief give each tree's scan on the event loop a slice of time, and let
+ * the event loop create the nodes the scan threads have found
+ * @return true if there's still work to do, so the event loop shouldn't
+ * wait for events before calling again
+ */
+bool continueRescans( void )
+{
+    tTick now      = monotonicMs();
+    tTick deadline = now + kScanSliceMs;
+
+    bool busy = drainScanResults( deadline );
+
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        tTreeScan * scan = watchedTree->scan.cursor;
+        if ( scan == NULL ) continue;
+
+        ++scan->count.slices;
+
+        bool more;
+        do {
+            more = scanSome( scan, kScanSliceEntries );
+            now  = monotonicMs();
+        } while ( more && now < deadline );
+
+        if ( !more ) {
+            cursorFinished( watchedTree );
+        } else {
+            busy = true;
+            if ( now >= scan->progressAt ) {
+                scan->progressAt = now + kScanProgressMs;
+                logInfo( "scanning \'%s\': %lu directories, %lu files so far, %u waiting, %lu ms",
+                         watchedTree->root.path, scan->count.dirs, scan->count.files,
+                         scan->pending.count, now - scan->started );
+            }
+        }
+    }
+    logSetErrno( 0 );
+
+    return busy;
+}
+
+
+/**
+ * @brief Walk the hierarchy for files we have not seen before.
+ * This is a backstop for the iNotify event mechanism. Only the files in
+ * directories that have changed since the last scan are looked at, except
+ * for a deep scan every g.timeout.deepScan.
+ * The walk is done by the scan threads, or a slice at a time on the event
+ * loop, and the node's next rescan is scheduled once it has finished.
+ * @param node
  * @return
  */
 tError rescanTree( tFSNode * node )
 {
-    int result = 0;
+    tError         result      = 0;
+    tWatchedTree * watchedTree = node->watchedTree;
 
-    gWatchedTree = node->watchedTree;
+    if ( watchedTree->scan.running ) {
+        logWarning( "\'%s\' is still being scanned from last time", node->path );
+        resetExpiration( node, kRescan );
+        return 0;
+    }
 
-    result = nftw( node->path, scanNode, 12, FTW_ACTIONRETVAL | FTW_MOUNT );
-    if ( result != 0 ) {
+    /* every so often, look at every file as a safety net. The first scan is always deep */
+    tTick now = monotonicMs();
+    watchedTree->scan.deep       = ( now >= watchedTree->scan.deepAt );
+    watchedTree->scan.generation = 0;
+    if ( watchedTree->scan.deep ) {
+        watchedTree->scan.deepAt     = now + g.timeout.deepScan;
+        watchedTree->scan.generation = storeNewGeneration( watchedTree->state );
+    }
+
+    if ( g.scanThreads > 0 ) {
+        result = scanTreeInBackground( watchedTree );
+        if ( result == 0 ) {
+            return 0;
+        }
+        logError( "unable to scan \'%s\' in the background, scanning it here instead", node->path );
+    }
+
+    tTreeScan * scan = treeCursor( watchedTree );
+    if ( scan == NULL ) {
         logError( "Error: failed to scan for new files in the \'%s\' directory", node->path );
-        result = -errno;
+        resetExpiration( node, kRescan );
+        return -ENOMEM;
     }
 
-    gWatchedTree = NULL;
+    watchedTree->scan.running = true;
+    watchedTree->scan.started = monotonicMs();
 
-    resetExpiration( node, kRescan );
+    return queuePending( scan, "", false );
+}
 
-    // radixTreeDump( &g.pathTree );
 
-    return result;
+/**
+ * @brief a shallow rescan: look at the files directly within one directory,
+ * and only descend into subdirectories we don't already know about.
+ * Used to catch up on a directory that may have had events dropped.
+ * It's queued on the tree's scan on the event loop.
+ * @param dirNode
+ * @return
+ */
+tError rescanDirectory( tFSNode * dirNode )
+{
+    tTreeScan * scan = treeCursor( dirNode->watchedTree );
+    if ( scan == NULL ) {
+        return -ENOMEM;
+    }
+
+    return queuePending( scan, dirNode->relPath, true );
 }
 
+
 tError rescanAllTrees( void )
 {
     tError result = 0;
-    time_t now = time( NULL );
-    tFSNode * node;
-    listForEachEntry(&g.expiringList, node )
+    tTick now = monotonicMs();
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
     {
-        if ( node->type == kTree )
+        tFSNode * node = watchedTree->rootNode;
+        if ( node->expires.filed != 0 )
         {
-            /* unlink it from its current position in expiringList */
-            listRemove( &node->queue );
-            /* force it to expire immediately */
+            /* force it to expire immediately. An earlier deadline always re-files it */
             node->expires.at = now;
-            /* put it first on expiringList */
-            listPrepend( g.expiringList, &node->queue );
+            timerWheelAdd( g.expiring, node );
         }
     }
 
     return result;
-}
\ No newline at end of file
+}
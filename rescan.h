@@ -3,11 +3,147 @@
 //
 
 #include "events.h"
+#include "uring.h"
+#include "stateStore.h"
 
 #ifndef PROCESSNEWFILES__RESCAN_H_
 #define PROCESSNEWFILES__RESCAN_H_
 
+/* how much of a directory to read with each getdents64() call */
+#define kScanBufferSize     (64 * 1024)
+
+typedef struct sTreeScan tTreeScan;
+
+/* what to do with the directories and files a scan finds. On the event
+ * loop, nodes are created directly. A scan thread can't touch the nodes,
+ * so it passes what it finds back to the event loop instead */
+typedef void   (*fScanFound)( tTreeScan * scan, const char * fullPath, tFSNodeType type );
+typedef tError (*fScanQueueDir)( tTreeScan * scan, const char * relPath );
+
+/* on the event loop, a scan is done a slice at a time, so inotify events
+ * still get read promptly while a large tree is being scanned */
+#define kScanSliceMs        5
+#define kScanSliceEntries   64      // how often to check if the slice is used up
+#define kScanProgressMs     1000    // how often to log a long scan's progress
+
+/* a directory's mtime & ctime. If neither has changed since its files were
+ * last looked at, no entries have been added, removed or renamed since */
+typedef struct {
+    struct timespec mtime;
+    struct timespec ctime;
+} tDirStamp;
+
+/* one entry of a directory listing */
+typedef struct {
+    uint32_t        name;       // offset of its name in the listing's names
+    unsigned char   type;       // the d_type getdents64() reported
+} tScanEntry;
+
+/* the (non-hidden) entries of a directory. The buffers are kept from one
+ * directory to the next */
+typedef struct {
+    tScanEntry *    entries;
+    unsigned int    count;
+    unsigned int    size;
+    struct {
+        char *          buffer;
+        size_t          used;
+        size_t          size;
+    } names;
+} tListing;
+
+#ifdef USE_IO_URING
+/* how many files' statx() calls go in one batch */
+#define kScanBatchFiles     64
+
+/* a file's record, and if it's been processed, what a batched statx() found.
+ * A periodic scan stats every file, and leaves the record to scanFile() */
+typedef struct {
+    bool                    valid;
+    bool                    looked;     // 'record' has been looked up
+    tFileRecord             record;
+    int                     err;        // errno from stat'ing the file, or 0
+    struct statx_timestamp  mtime;
+    uint64_t                size;
+} tFileStat;
+#endif
+
+/* a directory waiting to be scanned */
+typedef struct {
+    bool            shallow;    // only descend into its subdirectories that don't have a node yet
+    char            relPath[];
+} tPendingDir;
+
+/* the state of a walk through (part of) a tree. Everything the walk needs
+ * is in here, so several can be in progress at once, and a walk can be
+ * put down after any entry and picked up again later */
+struct sTreeScan {
+    tWatchedTree *  watchedTree;
+    tTick           started;
+    tTick           progressAt;     // when to next log how far it's got
+
+    fScanFound      found;
+    fScanQueueDir   queueDir;
+    void *          context;    // for the use of the above
+
+    struct {
+        tPendingDir **  dirs;   // the directories still to be scanned
+        unsigned int    count;
+        unsigned int    size;
+    } pending;
+
+    /* the directory currently being scanned. It's read in one go, and then
+     * its entries are looked at one at a time */
+    struct {
+        tFileDscr       fd;         // -1 between directories
+        bool            shallow;
+        bool            examine;    // look at its files, not just its subdirectories
+        bool            complete;   // the whole directory was read
+        tHash           hash;       // of its relative path
+        tDirStamp       stamp;      // as it was just before it was read
+        size_t          pathLen;    // length of '<root>/<relPath>/' in path
+        tListing        listing;
+        unsigned int    next;       // the next entry of the listing to look at
+    } dir;
+
+#ifdef USE_IO_URING
+    tRing *         ring;       // NULL if io_uring isn't available
+    struct {
+        bool            active;     // the current directory's files were stat'ed in batches
+        tFileStat *     stats;      // one for each entry of dir.listing
+        unsigned int    size;
+        struct statx *  results;    // where each batch's statx() calls put their results
+    } batch;
+#endif
+
+    char *          buffer;     // for getdents64()
+    size_t          rootLen;    // length of the '<root>/' prefix of path
+    char            path[ PATH_MAX ];   // full path of the entry being looked at
+
+    struct {
+        unsigned long   dirs;
+        unsigned long   unchanged;  // directories whose files weren't looked at
+        unsigned long   files;
+        unsigned long   stats;  // calls to stat files (a deep scan only stats the ones that have been processed before)
+        unsigned long   errors; // directories that couldn't be read
+        unsigned long   slices; // how many times the walk was resumed
+    } count;
+};
+
+tError initTreeScan( tTreeScan * scan, tWatchedTree * watchedTree );
+tError setScanTree( tTreeScan * scan, tWatchedTree * watchedTree );
+void   freeTreeScan( tTreeScan * scan );
+tError scanDir( tTreeScan * scan, const char * relPath, bool shallow );
+bool   scanSome( tTreeScan * scan, unsigned int budget );
+
 tError rescanTree( tFSNode * watchedTree );
 tError rescanAllTrees( void );
+tError rescanDirectory( tFSNode * dirNode );
+void   recordDirStamp( tWatchedTree * watchedTree, tHash hash, const tDirStamp * stamp );
+bool   lookupDirStamp( tWatchedTree * watchedTree, tHash hash, tDirStamp * stamp );
+void   forgetDirStamp( tFSNode * dirNode );
+void   forgetVanishedFiles( tWatchedTree * watchedTree, unsigned long errors );
+void   overflowRecovered( tWatchedTree * watchedTree, unsigned long entries );
+bool   continueRescans( void );
 
 #endif //PROCESSNEWFILES__RESCAN_H_
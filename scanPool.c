@@ -0,0 +1,528 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "events.h"
+#include "rescan.h"
+#include "inotify.h"
+#include "scanPool.h"
+
+
+/* a directory waiting to be scanned */
+typedef struct {
+    tWatchedTree *  watchedTree;
+    char            relPath[];
+} tScanWork;
+
+/* something a scan thread found, on its way back to the event loop */
+typedef struct sScanResult {
+    struct sScanResult *    next;
+    tWatchedTree *          watchedTree;
+    tFSNodeType             type;       // kTree means the tree's scan has finished
+    char                    path[];
+} tScanResult;
+
+/* a ring buffer of work items. The owner pushes & pops at the tail, thieves take from the head */
+typedef struct {
+    pthread_mutex_t lock;
+    tScanWork **    items;
+    unsigned int    head;
+    unsigned int    count;
+    unsigned int    size;
+} tWorkDeque;
+
+typedef struct {
+    pthread_t       thread;
+    unsigned int    index;
+    tWorkDeque      deque;
+    tTreeScan       scan;
+} tScanWorker;
+
+static struct {
+    tScanWorker *   workers;
+    unsigned int    count;
+    unsigned int    next;       // round-robin, for the work the event loop hands out
+
+    atomic_uint     queued;     // work items sitting in all of the deques
+    atomic_uint     sleeping;   // workers waiting for work
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+
+    _Atomic(tScanResult *) results;    // pushed by the workers, taken all at once by the event loop
+    tFileDscr       eventFd;
+
+    struct {
+        tScanResult *   head;   // taken from 'results', waiting for the event loop to get to them
+        tScanResult *   tail;
+    } backlog;
+} gPool = {
+    .lock    = PTHREAD_MUTEX_INITIALIZER,
+    .wake    = PTHREAD_COND_INITIALIZER,
+    .eventFd = -1
+};
+
+
+/**
+ * @brief
+ * @param deque
+ * @param work
+ * @return
+ */
+static tError dequePush( tWorkDeque * deque, tScanWork * work )
+{
+    tError result = 0;
+
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->count == deque->size ) {
+        unsigned int size = ( deque->size > 0 ) ? deque->size * 2 : 64;
+        tScanWork ** items = malloc( size * sizeof( tScanWork * ) );
+        if ( items == NULL ) {
+            result = -ENOMEM;
+        } else {
+            /* unwrap the ring while copying it */
+            for ( unsigned int i = 0; i < deque->count; ++i ) {
+                items[ i ] = deque->items[ (deque->head + i) % deque->size ];
+            }
+            free( deque->items );
+            deque->items = items;
+            deque->head  = 0;
+            deque->size  = size;
+        }
+    }
+    if ( result == 0 ) {
+        deque->items[ (deque->head + deque->count) % deque->size ] = work;
+        ++deque->count;
+    }
+    pthread_mutex_unlock( &deque->lock );
+
+    return result;
+}
+
+
+/**
+ * @brief the owner's end: most recently pushed first, so a thread tends to
+ * go deeper into the part of the tree it's already in
+ */
+static tScanWork * dequePop( tWorkDeque * deque )
+{
+    tScanWork * work = NULL;
+
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->count > 0 ) {
+        --deque->count;
+        work = deque->items[ (deque->head + deque->count) % deque->size ];
+    }
+    pthread_mutex_unlock( &deque->lock );
+
+    return work;
+}
+
+
+/**
+ * @brief the thieves' end: the oldest item, which is likely to be the biggest subtree
+ */
+static tScanWork * dequeSteal( tWorkDeque * deque )
+{
+    tScanWork * work = NULL;
+
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->count > 0 ) {
+        work = deque->items[ deque->head ];
+        deque->head = (deque->head + 1) % deque->size;
+        --deque->count;
+    }
+    pthread_mutex_unlock( &deque->lock );
+
+    return work;
+}
+
+
+/**
+ * @brief hand a result back to the event loop
+ * @param watchedTree
+ * @param type
+ * @param path may be NULL
+ */
+static void postResult( tWatchedTree * watchedTree, tFSNodeType type, const char * path )
+{
+    size_t len = ( path != NULL ) ? strlen( path ) + 1 : 1;
+
+    tScanResult * result = malloc( sizeof( tScanResult ) + len );
+    if ( result == NULL ) {
+        logError( "unable to allocate a scan result" );
+        return;
+    }
+    result->watchedTree = watchedTree;
+    result->type        = type;
+    if ( path != NULL ) {
+        memcpy( result->path, path, len );
+    } else {
+        result->path[0] = '\0';
+    }
+
+    tScanResult * head = atomic_load( &gPool.results );
+    do {
+        result->next = head;
+    } while ( !atomic_compare_exchange_weak( &gPool.results, &head, result ) );
+
+    /* only the first result needs to wake the event loop, it takes the whole list */
+    if ( head == NULL ) {
+        uint64_t one = 1;
+        if ( write( gPool.eventFd, &one, sizeof( one ) ) != sizeof( one ) ) {
+            logError( "unable to wake the event loop" );
+        }
+    }
+}
+
+
+/**
+ * @brief queue a directory to be scanned
+ * @param deque where to put it
+ * @param watchedTree
+ * @param relPath
+ * @return
+ */
+static tError queueWork( tWorkDeque * deque, tWatchedTree * watchedTree, const char * relPath )
+{
+    size_t len = strlen( relPath ) + 1;
+    tScanWork * work = malloc( sizeof( tScanWork ) + len );
+    if ( work == NULL ) {
+        return -ENOMEM;
+    }
+    work->watchedTree = watchedTree;
+    memcpy( work->relPath, relPath, len );
+
+    /* count it before it can possibly be finished, so the tree's total can't reach zero early */
+    atomic_fetch_add( &watchedTree->scan.outstanding, 1 );
+
+    tError result = dequePush( deque, work );
+    if ( result != 0 ) {
+        atomic_fetch_sub( &watchedTree->scan.outstanding, 1 );
+        free( work );
+        return result;
+    }
+
+    atomic_fetch_add( &gPool.queued, 1 );
+    if ( atomic_load( &gPool.sleeping ) > 0 ) {
+        pthread_mutex_lock( &gPool.lock );
+        pthread_cond_signal( &gPool.wake );
+        pthread_mutex_unlock( &gPool.lock );
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief fScanFound for the scan threads
+ */
+static void workerFound( tTreeScan * scan, const char * fullPath, tFSNodeType type )
+{
+    postResult( scan->watchedTree, type, fullPath );
+}
+
+
+/**
+ * @brief fScanQueueDir for the scan threads: onto the worker's own deque
+ */
+static tError workerQueueDir( tTreeScan * scan, const char * relPath )
+{
+    tScanWorker * worker = scan->context;
+    return queueWork( &worker->deque, scan->watchedTree, relPath );
+}
+
+
+/**
+ * @brief find some work: our own first, then anyone else's
+ * @param worker
+ * @return
+ */
+static tScanWork * findWork( tScanWorker * worker )
+{
+    tScanWork * work = dequePop( &worker->deque );
+
+    for ( unsigned int i = 1; work == NULL && i < gPool.count; ++i ) {
+        work = dequeSteal( &gPool.workers[ (worker->index + i) % gPool.count ].deque );
+    }
+    if ( work != NULL ) {
+        atomic_fetch_sub( &gPool.queued, 1 );
+    }
+    return work;
+}
+
+
+/**
+ * @brief scan one directory
+ * @param worker
+ * @param work
+ */
+static void doWork( tScanWorker * worker, tScanWork * work )
+{
+    tWatchedTree * watchedTree = work->watchedTree;
+    tTreeScan *    scan        = &worker->scan;
+
+    memset( &scan->count, 0, sizeof( scan->count ) );
+    if ( setScanTree( scan, watchedTree ) == 0 ) {
+        scanDir( scan, work->relPath, false );
+    }
+    free( work );
+
+    atomic_fetch_add_explicit( &watchedTree->scan.dirs,  scan->count.dirs,  memory_order_relaxed );
+    atomic_fetch_add_explicit( &watchedTree->scan.unchanged, scan->count.unchanged, memory_order_relaxed );
+    atomic_fetch_add_explicit( &watchedTree->scan.files, scan->count.files, memory_order_relaxed );
+    atomic_fetch_add_explicit( &watchedTree->scan.stats, scan->count.stats, memory_order_relaxed );
+    atomic_fetch_add_explicit( &watchedTree->scan.errors, scan->count.errors, memory_order_relaxed );
+
+    /* the subdirectories were counted before this one is uncounted, so zero means we're done */
+    if ( atomic_fetch_sub( &watchedTree->scan.outstanding, 1 ) == 1 ) {
+        postResult( watchedTree, kTree, NULL );
+    }
+}
+
+
+/**
+ * @brief a scan thread
+ * @param arg its tScanWorker
+ * @return
+ */
+static void * scanWorker( void * arg )
+{
+    tScanWorker * worker = arg;
+
+    for (;;) {
+        tScanWork * work = findWork( worker );
+        if ( work != NULL ) {
+            doWork( worker, work );
+        } else {
+            pthread_mutex_lock( &gPool.lock );
+            atomic_fetch_add( &gPool.sleeping, 1 );
+            while ( atomic_load( &gPool.queued ) == 0 ) {
+                pthread_cond_wait( &gPool.wake, &gPool.lock );
+            }
+            atomic_fetch_sub( &gPool.sleeping, 1 );
+            pthread_mutex_unlock( &gPool.lock );
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief start the threads, the first time they're needed. If only some of
+ * them can be, the pool makes do with those
+ * @param count
+ * @return non-zero if none could be, in which case there's no pool
+ */
+static tError startScanThreads( unsigned int count )
+{
+    tError result = 0;
+
+    gPool.workers = calloc( count, sizeof( tScanWorker ) );
+    if ( gPool.workers == NULL ) {
+        return -ENOMEM;
+    }
+
+    for ( unsigned int i = 0; i < count && result == 0; ++i ) {
+        tScanWorker * worker = &gPool.workers[ i ];
+        worker->index = i;
+        pthread_mutex_init( &worker->deque.lock, NULL );
+
+        result = initTreeScan( &worker->scan, NULL );
+        if ( result == 0 ) {
+            worker->scan.found    = workerFound;
+            worker->scan.queueDir = workerQueueDir;
+            worker->scan.context  = worker;
+
+            /* signals stay blocked in the new thread, as they are in this one, so they're only seen by the signalfd */
+            int err = pthread_create( &worker->thread, NULL, scanWorker, worker );
+            if ( err != 0 ) {
+                result = -err;
+            }
+        }
+        if ( result != 0 ) {
+            logSetErrno( -result );
+            logError( "unable to start scan thread %u", i );
+            freeTreeScan( &worker->scan );
+            pthread_mutex_destroy( &worker->deque.lock );
+            break;
+        }
+        /* only count it once it exists, as findWork() may look at its deque */
+        gPool.count = i + 1;
+    }
+    logSetErrno( 0 );
+
+    if ( gPool.count == 0 ) {
+        /* so the next scan tries again, or scans on the event loop if it can't */
+        free( gPool.workers );
+        gPool.workers = NULL;
+        return ( result != 0 ) ? result : -EINVAL;
+    }
+    logInfo( "started %u scan threads", gPool.count );
+
+    return 0;
+}
+
+
+/**
+ * @brief create the eventfd the scan threads use to wake the event loop
+ * @param epollData what epoll should hand back when there are results waiting
+ * @return
+ */
+tError initScanPool( uint64_t epollData )
+{
+    gPool.eventFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( gPool.eventFd == -1 ) {
+        logError( "unable to create the scan threads' eventfd" );
+        return -errno;
+    }
+    return registerFdToEpoll( gPool.eventFd, epollData );
+}
+
+
+/**
+ * @brief have the scan threads walk the tree. processScanResults() reports when it's done.
+ * @param watchedTree
+ * @return -EBUSY if the tree is still being scanned from last time
+ */
+tError scanTreeInBackground( tWatchedTree * watchedTree )
+{
+    tError result = 0;
+
+    if ( watchedTree->scan.running ) {
+        return -EBUSY;
+    }
+
+    if ( gPool.count == 0 ) {
+        result = startScanThreads( g.scanThreads );
+        if ( result != 0 ) return result;
+    }
+
+    watchedTree->scan.running    = true;
+    watchedTree->scan.background = true;
+    watchedTree->scan.started    = monotonicMs();
+    atomic_store( &watchedTree->scan.dirs,  0 );
+    atomic_store( &watchedTree->scan.unchanged, 0 );
+    atomic_store( &watchedTree->scan.files, 0 );
+    atomic_store( &watchedTree->scan.stats, 0 );
+    atomic_store( &watchedTree->scan.errors, 0 );
+
+    /* spread the trees across the threads to start with */
+    result = queueWork( &gPool.workers[ gPool.next++ % gPool.count ].deque, watchedTree, "" );
+    if ( result != 0 ) {
+        watchedTree->scan.running    = false;
+        watchedTree->scan.background = false;
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief the tree's scan has finished
+ * @param watchedTree
+ */
+static void scanFinished( tWatchedTree * watchedTree )
+{
+    watchedTree->scan.running    = false;
+    watchedTree->scan.background = false;
+
+    logDebug( "scanned \'%s\'%s: %lu directories (%lu unchanged, %lu unreadable), %lu files, "
+              "%lu stat calls in %lu ms",
+              watchedTree->root.path, watchedTree->scan.deep ? " deeply" : "",
+              atomic_load( &watchedTree->scan.dirs ),
+              atomic_load( &watchedTree->scan.unchanged ),
+              atomic_load( &watchedTree->scan.errors ),
+              atomic_load( &watchedTree->scan.files ),
+              atomic_load( &watchedTree->scan.stats ),
+              monotonicMs() - watchedTree->scan.started );
+
+    forgetVanishedFiles( watchedTree, atomic_load( &watchedTree->scan.errors ) );
+
+    /* the recently active directories are rescanned on the event loop, which logs what that cost */
+    if ( watchedTree->scan.overflow.full ) {
+        overflowRecovered( watchedTree, atomic_load( &watchedTree->scan.dirs ) + atomic_load( &watchedTree->scan.files ) );
+    }
+
+    logEventStats( watchedTree );
+    logStoreStats( watchedTree->state );
+
+    /* the next rescan is timed from the end of this one */
+    resetExpiration( watchedTree->rootNode, kRescan );
+}
+
+
+/**
+ * @brief take what the scan threads have found so far. The nodes are
+ * created a slice at a time by drainScanResults().
+ * @return
+ */
+tError processScanResults( void )
+{
+    uint64_t count;
+
+    /* reset the eventfd *before* taking the list, so a result posted after this is sure to wake us again */
+    if ( read( gPool.eventFd, &count, sizeof( count ) ) == -1 && errno != EAGAIN ) {
+        logError( "unable to read the scan threads' eventfd" );
+    }
+
+    tScanResult * list = atomic_exchange( &gPool.results, NULL );
+
+    /* it's a stack, so reverse it to handle the results in the order they were found */
+    tScanResult * ordered = NULL;
+    tScanResult * last    = list;
+    while ( list != NULL ) {
+        tScanResult * next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    if ( ordered != NULL ) {
+        if ( gPool.backlog.head == NULL ) {
+            gPool.backlog.head = ordered;
+        } else {
+            gPool.backlog.tail->next = ordered;
+        }
+        gPool.backlog.tail = last;
+    }
+    logSetErrno( 0 );
+
+    return 0;
+}
+
+
+/**
+ * @brief create the nodes for what the scan threads have found
+ * @param deadline when to stop, if there are still results left
+ * @return true if there are results left
+ */
+bool drainScanResults( tTick deadline )
+{
+    unsigned int count = 0;
+
+    while ( gPool.backlog.head != NULL ) {
+        tScanResult * result = gPool.backlog.head;
+        gPool.backlog.head = result->next;
+
+        if ( result->type == kTree ) {
+            scanFinished( result->watchedTree );
+        } else {
+            fsNodeFromPath( result->watchedTree, result->path, result->type );
+        }
+        free( result );
+
+        if ( ++count % kScanSliceEntries == 0 && monotonicMs() >= deadline ) {
+            break;
+        }
+    }
+    logSetErrno( 0 );
+
+    return ( gPool.backlog.head != NULL );
+}
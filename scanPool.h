@@ -0,0 +1,25 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_SCANPOOL_H
+#define PROCESSNEWFILES_SCANPOOL_H
+
+/*
+ * A pool of threads that walk trees in the background. Each directory is a
+ * work item. A thread pushes the subdirectories it finds onto its own deque,
+ * and takes from the end it pushes to; an idle thread steals from the other
+ * end of someone else's. So a deep or wide tree spreads itself across the
+ * pool, and there are many metadata requests in flight at once.
+ *
+ * The threads never touch the nodes. What they find goes back to the event
+ * loop on a lock-free list, with an eventfd to wake it up. The event loop
+ * creates the nodes a slice at a time, between reading inotify events.
+ */
+
+tError initScanPool( uint64_t epollData );
+tError scanTreeInBackground( tWatchedTree * watchedTree );
+tError processScanResults( void );
+bool   drainScanResults( tTick deadline );
+
+#endif //PROCESSNEWFILES_SCANPOOL_H
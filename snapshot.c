@@ -0,0 +1,363 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include "events.h"
+#include "inotify.h"
+#include "rescan.h"
+#include "snapshot.h"
+
+/* in the tree's '.seen' directory, alongside the state store */
+#define kSnapshotName       ".state.snap"
+#define kSnapshotNewName    ".state.snap.new"
+
+static const char kSnapshotMagic[8] = "pnfSnp2";
+
+/* the buffer the snapshot is built in starts this big, and doubles as needed */
+#define kSnapshotBufferSize (64 * 1024)
+
+typedef struct {
+    char        magic[8];
+    uint64_t    length;     // of the whole snapshot, this header included
+    uint64_t    count;      // records following the header
+    int64_t     deepDue;    // when the next deep scan is due, in seconds since the epoch
+} tSnapshotHeader;
+
+/* a directory, or a file that was waiting to be processed. The path, relative
+ * to the root, follows with a NUL, and padding to a multiple of 8 bytes */
+typedef struct {
+    uint8_t     type;       // kDirectory or kFile
+    uint8_t     because;    // a file's tExpiredReason
+    uint16_t    pathLen;
+    int32_t     retries;    // how many times processing a file has failed
+    tWatchID    watchID;    // a directory's watch. Only means anything to the inotify instance it came from
+    uint32_t    stamped;    // non-zero if a directory's files have been looked at, and 'stamp' says when
+    union {
+        tDirStamp   stamp;      // a directory's, when its files were last looked at
+        tTick       every;      // how long a file is left alone before it's (re)tried
+    };
+    char        path[];
+} tSnapshotRecord;
+
+
+static inline size_t recordLength( size_t pathLen )
+{
+    return (sizeof( tSnapshotRecord ) + pathLen + 1 + 7) & ~(size_t)7;
+}
+
+
+/**
+ * @brief serialize the tree's directory nodes, with their stamps and watches,
+ * and the files that are waiting to be processed
+ * @param watchedTree
+ * @param snapshot set to the snapshot, which the caller frees
+ * @param length set to its length
+ * @return -EBUSY if the tree is being scanned, as a directory's stamp may be
+ * recorded before the nodes for its files are made
+ */
+tError buildSnapshot( tWatchedTree * watchedTree, char ** snapshot, size_t * length )
+{
+    size_t        size  = kSnapshotBufferSize;
+    size_t        used  = sizeof( tSnapshotHeader );
+    unsigned long count = 0;
+
+    if ( watchedTree->scan.running ) {
+        return -EBUSY;
+    }
+
+    char * buffer = calloc( 1, size );
+    if ( buffer == NULL ) {
+        return -ENOMEM;
+    }
+
+    size_t    index = 0;
+    tFSNode * node;
+    while ( (node = hashMapNext( watchedTree->pathMap, &index )) != NULL ) {
+        tSnapshotRecord record;
+        memset( &record, 0, sizeof( record ) );
+
+        if ( node->type == kDirectory ) {
+            record.watchID = node->watchID;
+            record.stamped = lookupDirStamp( watchedTree, calcHash( node->relPath ), &record.stamp );
+        } else if ( node->type == kFile ) {
+            record.because = (uint8_t)node->expires.because;
+            record.retries = node->expires.retries;
+            record.every   = node->expires.every;
+        } else {
+            continue;
+        }
+
+        size_t pathLen = strlen( node->relPath );
+        if ( pathLen > UINT16_MAX ) continue;
+        record.type    = (uint8_t)node->type;
+        record.pathLen = (uint16_t)pathLen;
+
+        size_t recLen = recordLength( pathLen );
+        if ( used + recLen > size ) {
+            while ( used + recLen > size ) size *= 2;
+            char * bigger = realloc( buffer, size );
+            if ( bigger == NULL ) {
+                free( buffer );
+                return -ENOMEM;
+            }
+            buffer = bigger;
+        }
+        memset( &buffer[ used ], 0, recLen );
+        memcpy( &buffer[ used ], &record, sizeof( record ) );
+        memcpy( &buffer[ used + sizeof( record ) ], node->relPath, pathLen );
+        used += recLen;
+        ++count;
+    }
+
+    tSnapshotHeader * header = (tSnapshotHeader *)buffer;
+    memcpy( header->magic, kSnapshotMagic, sizeof( kSnapshotMagic ) );
+    header->length  = used;
+    header->count   = count;
+    header->deepDue = time( NULL );
+    tTick now = monotonicMs();
+    if ( watchedTree->scan.deepAt > now ) {
+        header->deepDue += (int64_t)((watchedTree->scan.deepAt - now) / 1000);
+    }
+
+    *snapshot = buffer;
+    *length   = used;
+
+    return 0;
+}
+
+
+/**
+ * @brief check that every record in the snapshot is intact, before any of it is used
+ * @param snapshot
+ * @param length
+ * @return
+ */
+static bool snapshotValid( const char * snapshot, size_t length )
+{
+    const tSnapshotHeader * header = (const tSnapshotHeader *)snapshot;
+
+    if ( length < sizeof( tSnapshotHeader )
+      || memcmp( header->magic, kSnapshotMagic, sizeof( kSnapshotMagic ) ) != 0
+      || header->length != length ) {
+        return false;
+    }
+
+    size_t offset = sizeof( tSnapshotHeader );
+    for ( uint64_t i = 0; i < header->count; ++i ) {
+        if ( offset + sizeof( tSnapshotRecord ) > length ) return false;
+
+        const tSnapshotRecord * record = (const tSnapshotRecord *)&snapshot[ offset ];
+        size_t size = recordLength( record->pathLen );
+        if ( offset + size > length
+          || record->path[ record->pathLen ] != '\0'
+          || ( record->type != kDirectory && record->type != kFile ) ) {
+            return false;
+        }
+        offset += size;
+    }
+    return ( offset == length );
+}
+
+
+/**
+ * @brief restore what a snapshot holds
+ * @param watchedTree
+ * @param snapshot
+ * @param length
+ * @param watchedMask if the snapshot was handed over along with its inotify
+ * instance, the mask its directories are watched for. Their nodes are made
+ * straight away, taking over the watches if the tree's mask is unchanged.
+ * Zero for a snapshot from a file, whose watches are long gone, so the
+ * first scan makes the nodes
+ * @return -EINVAL if it's damaged, in which case nothing was restored
+ */
+tError applySnapshot( tWatchedTree * watchedTree, const char * snapshot, size_t length, uint32_t watchedMask )
+{
+    if ( !snapshotValid( snapshot, length ) ) {
+        return -EINVAL;
+    }
+
+    const tSnapshotHeader * header = (const tSnapshotHeader *)snapshot;
+    unsigned long dirs  = 0;
+    unsigned long files = 0;
+    char          fullPath[ PATH_MAX ];
+
+    size_t offset = sizeof( tSnapshotHeader );
+    for ( uint64_t i = 0; i < header->count; ++i ) {
+        const tSnapshotRecord * record = (const tSnapshotRecord *)&snapshot[ offset ];
+        offset += recordLength( record->pathLen );
+
+        /* the root's relative path is empty, and its full path has no trailing slash */
+        int len = ( record->pathLen == 0 )
+                ? snprintf( fullPath, sizeof( fullPath ), "%s", watchedTree->root.path )
+                : snprintf( fullPath, sizeof( fullPath ), "%s/%s", watchedTree->root.path, record->path );
+        if ( len < 0 || len >= (int)sizeof( fullPath ) ) continue;
+
+        if ( record->type == kDirectory ) {
+            if ( record->stamped ) {
+                recordDirStamp( watchedTree, calcHash( record->path ), &record->stamp );
+                ++dirs;
+            }
+            if ( watchedMask == 0 ) {
+                /* no watch to take over */
+            } else if ( watchedMask == watchedTree->inotify.mask && record->watchID > 0 ) {
+                adoptDirectory( watchedTree, fullPath, record->watchID );
+            } else {
+                /* watching it again through the same inotify instance just changes its mask */
+                fsNodeFromPath( watchedTree, fullPath, kDirectory );
+            }
+        } else {
+            /* it gets a full 'every' from now, as it may have been modified while we weren't watching */
+            tFSNode * node = fsNodeFromPath( watchedTree, fullPath, kFile );
+            if ( node != NULL ) {
+                node->expires.retries = record->retries;
+                if ( record->retries > 0 ) {
+                    /* it's backing off. Otherwise it waits for the tree's idle time, which may have been changed */
+                    node->expires.every = record->every;
+                }
+                resetExpiration( node, (tExpiredReason)record->because );
+                ++files;
+            }
+        }
+    }
+
+    int64_t deepIn = header->deepDue - time( NULL );
+    watchedTree->scan.deepAt = monotonicMs() + ( deepIn > 0 ? (tTick)deepIn * 1000 : 0 );
+
+    logInfo( "restored \'%s\': %lu directory stamps, %lu waiting files, next deep scan in %ld s",
+             watchedTree->root.path, dirs, files, deepIn > 0 ? (long)deepIn : 0L );
+
+    return 0;
+}
+
+
+/**
+ * @brief stop watching the directories in a snapshot that was handed over,
+ * when no tree has taken it over
+ * @param snapshot
+ * @param length
+ */
+void dropSnapshotWatches( const char * snapshot, size_t length )
+{
+    if ( !snapshotValid( snapshot, length ) ) {
+        return;
+    }
+
+    const tSnapshotHeader * header = (const tSnapshotHeader *)snapshot;
+    size_t offset = sizeof( tSnapshotHeader );
+    for ( uint64_t i = 0; i < header->count; ++i ) {
+        const tSnapshotRecord * record = (const tSnapshotRecord *)&snapshot[ offset ];
+        offset += recordLength( record->pathLen );
+
+        if ( record->type == kDirectory && record->watchID > 0 ) {
+            dropWatch( record->watchID );
+        }
+    }
+}
+
+
+/**
+ * @brief write the tree's snapshot to a new file, and swap it in
+ * @param watchedTree
+ * @return
+ */
+static tError saveSnapshot( tWatchedTree * watchedTree )
+{
+    char * snapshot;
+    size_t length;
+
+    tError result = buildSnapshot( watchedTree, &snapshot, &length );
+    if ( result == -EBUSY ) {
+        logInfo( "\'%s\' is being scanned, so it wasn't snapshotted", watchedTree->root.path );
+    }
+    if ( result != 0 ) {
+        return result;
+    }
+
+    tFileDscr dirFd = watchedTree->seen.fd;
+    tFileDscr fd    = openat( dirFd, kSnapshotNewName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP );
+    if ( fd == -1 ) {
+        result = -errno;
+    } else {
+        if ( write( fd, snapshot, length ) != (ssize_t)length ) {
+            result = ( errno != 0 ) ? -errno : -EIO;
+        } else if ( fdatasync( fd ) == -1 ) {
+            result = -errno;
+        }
+        close( fd );
+
+        if ( result == 0 && renameat( dirFd, kSnapshotNewName, dirFd, kSnapshotName ) == -1 ) {
+            result = -errno;
+        }
+        if ( result != 0 ) {
+            unlinkat( dirFd, kSnapshotNewName, 0 );
+        }
+    }
+    free( snapshot );
+
+    if ( result == 0 ) {
+        logInfo( "saved a snapshot of \'%s\' (%lu bytes)", watchedTree->root.path, (unsigned long)length );
+    }
+    return result;
+}
+
+
+/**
+ * @brief snapshot every tree. Only called once the event loop has stopped
+ */
+void saveSnapshots( void )
+{
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        tError result = saveSnapshot( watchedTree );
+        if ( result != 0 && result != -EBUSY ) {
+            logSetErrno( -result );
+            logError( "unable to save a snapshot of \'%s\'", watchedTree->root.path );
+        }
+    }
+    logSetErrno( 0 );
+}
+
+
+/**
+ * @brief if the tree was shut down cleanly, restore what its scans had
+ * learned. The snapshot is removed, so it's never used twice
+ * @param watchedTree
+ * @return
+ */
+tError loadSnapshot( tWatchedTree * watchedTree )
+{
+    tError result = 0;
+
+    tFileDscr fd = openat( watchedTree->seen.fd, kSnapshotName, O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 ) {
+        /* nothing to restore, so the first scan will be a deep one */
+        return ( errno == ENOENT ) ? 0 : -errno;
+    }
+
+    struct stat info;
+    char *      buffer = NULL;
+    if ( fstat( fd, &info ) == -1 ) {
+        result = -errno;
+    } else {
+        buffer = malloc( (size_t)info.st_size );
+        if ( buffer == NULL ) {
+            result = -ENOMEM;
+        } else if ( pread( fd, buffer, (size_t)info.st_size, 0 ) != info.st_size ) {
+            result = ( errno != 0 ) ? -errno : -EIO;
+        }
+    }
+    close( fd );
+    unlinkat( watchedTree->seen.fd, kSnapshotName, 0 );
+
+    if ( result == 0 ) {
+        result = applySnapshot( watchedTree, buffer, (size_t)info.st_size, 0 );
+    }
+    free( buffer );
+    logSetErrno( 0 );
+
+    return result;
+}
@@ -0,0 +1,34 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_SNAPSHOT_H
+#define PROCESSNEWFILES_SNAPSHOT_H
+
+/*
+ * On a clean shutdown, what each tree's scans have learned is saved in
+ * '<root>/.seen/.state.snap': the stamp of every directory whose files had
+ * been looked at, the files that were waiting to be processed, and when the
+ * next deep scan is due. When the tree is created again, the snapshot is
+ * loaded, so the first scan only looks at the files in directories that
+ * have changed, rather than all of them.
+ *
+ * A file modified in place while we weren't running doesn't change its
+ * directory's stamp, so it waits for the next deep scan. That's why only a
+ * clean shutdown writes a snapshot, and why it's removed as it's loaded:
+ * after a crash, the files waiting to be processed are unknown, so the first
+ * scan is deep, as it always used to be.
+ *
+ * A takeover (see takeover.h) hands the same snapshot straight to the new
+ * process, along with the inotify instance. Then every directory's watch is
+ * still live, so the nodes are made from the snapshot, rather than a scan.
+ */
+
+tError buildSnapshot( tWatchedTree * watchedTree, char ** snapshot, size_t * length );
+tError applySnapshot( tWatchedTree * watchedTree, const char * snapshot, size_t length, uint32_t watchedMask );
+void   dropSnapshotWatches( const char * snapshot, size_t length );
+
+tError loadSnapshot( tWatchedTree * watchedTree );
+void   saveSnapshots( void );
+
+#endif //PROCESSNEWFILES_SNAPSHOT_H
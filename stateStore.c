@@ -0,0 +1,1595 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
+
+#include "events.h"
+#include "inotify.h"
+#include "cuckooFilter.h"
+#include "stateStore.h"
+
+/* in the tree's '.seen' directory. The leading '.state' sets them apart
+ * from what's left of the old shadow hierarchy */
+#define kLogName        ".state.log"
+#define kLogNewName     ".state.log.new"
+#define kIndexName      ".state.idx"
+#define kStoreFilePrefix ".state"
+
+static const char kLogMagic[8]   = "pnfLog1";
+static const char kIndexMagic[8] = "pnfIdx1";
+
+/* compaction writes the new log this much at a time */
+#define kCompactBufferSize  (64 * 1024)
+
+typedef struct {
+    char        magic[8];
+    uint64_t    reserved;
+} tLogHeader;
+
+/* a record in the log. The path is followed by a NUL, and padding to a
+ * multiple of 8 bytes, so the next record is aligned */
+typedef struct {
+    uint32_t    checksum;   // crc32 of everything after it, up to the end of the path
+    uint16_t    pathLen;
+    uint8_t     state;
+    uint8_t     attempts;
+    int64_t     mtime;      // in nanoseconds
+    uint64_t    size;
+    char        path[];     // relative to the root of the tree
+} tLogRecord;
+
+typedef struct {
+    char        magic[8];
+    uint64_t    capacity;   // slots, always a power of 2
+    uint64_t    count;      // slots in use, including the ones for deleted files
+    uint64_t    live;       // bytes of the log holding records that haven't been superseded
+    uint64_t    logLength;  // of the log, when the index was last closed
+    uint32_t    clean;      // non-zero if it was closed cleanly, and can be trusted
+    uint32_t    generation; // of the latest deep scan. Kept, so slots marked by an earlier run don't count
+} tIndexHeader;
+
+/* a copy of the latest record for a path, so looking it up doesn't go near
+ * the log, except to check that the path really matches */
+typedef struct {
+    tHash       hash;       // calcHash() of the relative path
+    uint64_t    offset;     // of the latest record in the log, zero if the slot's empty
+    int64_t     mtime;
+    uint64_t    size;
+    uint8_t     state;
+    uint8_t     attempts;
+    uint8_t     seen;       // the generation of the deep scan that last came across it
+    uint8_t     reserved[5];
+} tIndexSlot;
+
+struct sStateStore {
+    tWatchedTree *      watchedTree;
+    pthread_rwlock_t    lock;
+
+    struct {
+        tFileDscr       fd;
+        uint64_t        length;
+        const char *    map;        // read-only, used to check paths & to compact it
+        size_t          mapSize;    // may run past the end of the log, to leave room to grow
+    } log;
+
+    struct {
+        tFileDscr       fd;
+        tIndexHeader *  header;
+        tIndexSlot *    slots;      // immediately follow the header
+        size_t          mapSize;
+    } index;
+
+    tTick               dirtyAt;    // when the oldest append that hasn't been fsync'ed was made (zero if none)
+    bool                xattrRejected;  // a file's filesystem wouldn't take the xattr (so it's only reported once)
+
+    tCuckooFilter *     filter;     // the path, mtime & size of each file that's been processed (NULL if none)
+    tHashMap *          xattrDone;  // the tXattrDone of each file in it only because of its xattr
+    struct {
+        unsigned long   lookups;    // asked by the scans
+        unsigned long   hits;       // ...and found
+        unsigned long   logged;     // 'lookups' when the stats were last logged
+    } filterCount;
+};
+
+/* a file the filter has because its xattr says it's been processed. The
+ * filter can't be asked what it holds for a path, so this is what's taken
+ * out of it again when the xattr changes, or the file goes */
+typedef struct {
+    tHash       hash;       // of its relative path
+    int64_t     mtime;
+    uint64_t    size;
+    uint8_t     seen;       // the generation of the deep scan that last came across it
+} tXattrDone;
+
+static uint32_t gCrcTable[256];
+
+/* how each state is spelled in the xattr, indexed by tFileState */
+static const char * const kStateNames[] = { "none", "pending", "done", "gone", "failed" };
+
+
+static void initCrcTable( void )
+{
+    for ( uint32_t i = 0; i < 256; ++i ) {
+        uint32_t crc = i;
+        for ( int bit = 0; bit < 8; ++bit ) {
+            crc = ( crc & 1 ) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+        gCrcTable[ i ] = crc;
+    }
+}
+
+
+static uint32_t calcCrc( const void * data, size_t len )
+{
+    const uint8_t * p   = data;
+    uint32_t        crc = 0xFFFFFFFF;
+
+    while ( len-- > 0 ) {
+        crc = gCrcTable[ (crc ^ *p++) & 0xFF ] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+static inline size_t recordLength( size_t pathLen )
+{
+    return (sizeof( tLogRecord ) + pathLen + 1 + 7) & ~(size_t)7;
+}
+
+
+static inline uint32_t recordChecksum( const tLogRecord * record )
+{
+    return calcCrc( &record->pathLen, sizeof( tLogRecord ) - sizeof( record->checksum ) + record->pathLen );
+}
+
+
+static inline const tLogRecord * recordAt( const tStateStore * store, uint64_t offset )
+{
+    return (const tLogRecord *)&store->log.map[ offset ];
+}
+
+
+/**
+ * @brief make sure the log's mapping covers all of it
+ * @param store
+ * @return
+ */
+static tError mapLog( tStateStore * store )
+{
+    if ( store->log.length <= store->log.mapSize ) {
+        return 0;
+    }
+
+    size_t size = ( store->log.mapSize > 0 ) ? store->log.mapSize : kStoreCompactBytes;
+    while ( size < store->log.length ) size *= 2;
+
+    void * map = mmap( NULL, size, PROT_READ, MAP_SHARED, store->log.fd, 0 );
+    if ( map == MAP_FAILED ) {
+        return -errno;
+    }
+    if ( store->log.map != NULL ) {
+        munmap( (void *)store->log.map, store->log.mapSize );
+    }
+    store->log.map     = map;
+    store->log.mapSize = size;
+
+    return 0;
+}
+
+
+/**
+ * @brief (re)map the index with room for the given number of slots. If the
+ * file grows, the new slots are zero, i.e. empty
+ * @param store
+ * @param capacity
+ * @return
+ */
+static tError mapIndex( tStateStore * store, uint64_t capacity )
+{
+    size_t size = sizeof( tIndexHeader ) + capacity * sizeof( tIndexSlot );
+
+    if ( ftruncate( store->index.fd, (off_t)size ) == -1 ) {
+        return -errno;
+    }
+    void * map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, store->index.fd, 0 );
+    if ( map == MAP_FAILED ) {
+        return -errno;
+    }
+    if ( store->index.header != NULL ) {
+        munmap( store->index.header, store->index.mapSize );
+    }
+    store->index.header  = map;
+    store->index.slots   = (tIndexSlot *)(store->index.header + 1);
+    store->index.mapSize = size;
+
+    return 0;
+}
+
+
+/**
+ * @brief where a hash's probe sequence starts. calcHash() is weak in
+ * its low bits, so take the top bits of a multiplicative hash instead
+ */
+static inline uint64_t homeSlot( const tStateStore * store, tHash hash )
+{
+    unsigned int bits = (unsigned int)__builtin_ctzll( store->index.header->capacity );
+    return ((uint64_t)hash * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+
+/**
+ * @brief find the slot for a path
+ * @param store
+ * @param hash calcHash( relPath )
+ * @param relPath
+ * @param len strlen( relPath )
+ * @return the slot, or the empty slot where it would go if it isn't there
+ */
+static tIndexSlot * findSlot( tStateStore * store, tHash hash, const char * relPath, size_t len )
+{
+    const uint64_t mask = store->index.header->capacity - 1;
+
+    for ( uint64_t i = homeSlot( store, hash ); ; i = (i + 1) & mask ) {
+        tIndexSlot * slot = &store->index.slots[ i ];
+        if ( slot->offset == 0 ) {
+            return slot;
+        }
+        if ( slot->hash == hash && slot->offset + recordLength( len ) <= store->log.length ) {
+            const tLogRecord * record = recordAt( store, slot->offset );
+            if ( record->pathLen == len && memcmp( record->path, relPath, len ) == 0 ) {
+                return slot;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief the first empty slot in a hash's probe sequence. Only used when
+ * the path is known not to be in the index already
+ */
+static tIndexSlot * emptySlot( tStateStore * store, tHash hash )
+{
+    const uint64_t mask = store->index.header->capacity - 1;
+
+    uint64_t i = homeSlot( store, hash );
+    while ( store->index.slots[ i ].offset != 0 ) {
+        i = (i + 1) & mask;
+    }
+    return &store->index.slots[ i ];
+}
+
+
+/**
+ * @brief double the number of slots, and re-insert everything
+ * @param store
+ * @return
+ */
+static tError growIndex( tStateStore * store )
+{
+    uint64_t     capacity = store->index.header->capacity;
+    tIndexHeader header   = *store->index.header;
+
+    tIndexSlot * old = malloc( capacity * sizeof( tIndexSlot ) );
+    if ( old == NULL ) {
+        return -ENOMEM;
+    }
+    memcpy( old, store->index.slots, capacity * sizeof( tIndexSlot ) );
+
+    tError result = mapIndex( store, capacity * 2 );
+    if ( result == 0 ) {
+        *store->index.header = header;
+        store->index.header->capacity = capacity * 2;
+        memset( store->index.slots, 0, capacity * 2 * sizeof( tIndexSlot ) );
+
+        for ( uint64_t i = 0; i < capacity; ++i ) {
+            if ( old[ i ].offset != 0 ) {
+                *emptySlot( store, old[ i ].hash ) = old[ i ];
+            }
+        }
+    }
+    free( old );
+
+    return result;
+}
+
+
+/**
+ * @brief the filter's key for a processed file. The mtime & size are part
+ * of it, so once the file is modified, it no longer matches
+ * @param hash calcHash() of its relative path
+ * @param mtime
+ * @param size
+ * @return
+ */
+static inline uint64_t filterKey( tHash hash, int64_t mtime, uint64_t size )
+{
+    uint64_t key = (uint64_t)hash;
+    key = (key ^ (uint64_t)mtime) * 0x9E3779B97F4A7C15ULL;
+    key = (key ^ size) * 0xC2B2AE3D27D4EB4FULL;
+    return key ^ (key >> 29);
+}
+
+
+/**
+ * @brief replace the filter with one built from the processed files in the
+ * index, and the ones recorded in xattrs that the scans have come across.
+ * The caller holds the write lock (or is opening the store)
+ * @param store
+ * @param capacity at least how many files it should have room for
+ * @return
+ */
+static tError buildFilter( tStateStore * store, size_t capacity )
+{
+    const tIndexHeader * header = store->index.header;
+
+    size_t done = 0;
+    for ( uint64_t i = 0; i < header->capacity; ++i ) {
+        if ( store->index.slots[ i ].offset != 0 && store->index.slots[ i ].state == kStateDone ) {
+            ++done;
+        }
+    }
+    if ( store->xattrDone != NULL ) {
+        done += store->xattrDone->count;
+    }
+    /* leave room to grow */
+    if ( capacity < done * 2 ) capacity = done * 2;
+
+    tCuckooFilter * filter = newCuckooFilter( capacity );
+    if ( filter == NULL ) {
+        return -ENOMEM;
+    }
+    for ( uint64_t i = 0; i < header->capacity; ++i ) {
+        const tIndexSlot * slot = &store->index.slots[ i ];
+        if ( slot->offset != 0 && slot->state == kStateDone ) {
+            cuckooFilterAdd( filter, filterKey( slot->hash, slot->mtime, slot->size ) );
+        }
+    }
+    if ( store->xattrDone != NULL ) {
+        const tXattrDone * entry;
+        size_t             index = 0;
+        while ( ( entry = hashMapNext( store->xattrDone, &index ) ) != NULL ) {
+            cuckooFilterAdd( filter, filterKey( entry->hash, entry->mtime, entry->size ) );
+        }
+    }
+
+    freeCuckooFilter( store->filter );
+    store->filter = filter;
+
+    return 0;
+}
+
+
+/**
+ * @brief note that a file has been processed. The caller holds the write lock
+ * @param store
+ * @param hash
+ * @param mtime
+ * @param size
+ */
+static void filterAdd( tStateStore * store, tHash hash, int64_t mtime, uint64_t size )
+{
+    tCuckooFilter * filter = store->filter;
+    if ( filter == NULL ) return;
+
+    uint64_t key = filterKey( hash, mtime, size );
+    if ( filter->count >= cuckooFilterCapacity( filter ) || cuckooFilterAdd( filter, key ) != 0 ) {
+        /* it's full, or something had to be dropped to make room */
+        if ( buildFilter( store, 2 * cuckooFilterCapacity( filter ) ) == 0
+          && !cuckooFilterContains( store->filter, key ) ) {
+            cuckooFilterAdd( store->filter, key );
+        }
+    }
+}
+
+
+/**
+ * @brief the file's no longer processed (as it was). The caller holds the write lock
+ */
+static void filterRemove( tStateStore * store, tHash hash, int64_t mtime, uint64_t size )
+{
+    if ( store->filter != NULL ) {
+        cuckooFilterRemove( store->filter, filterKey( hash, mtime, size ) );
+    }
+}
+
+
+/**
+ * @brief bring the index up to date with a record that's in the log
+ * @param store
+ * @param record
+ * @param offset where the record is in the log
+ * @return
+ */
+static tError indexRecord( tStateStore * store, const tLogRecord * record, uint64_t offset )
+{
+    tIndexHeader * header = store->index.header;
+    tHash          hash   = calcHash( record->path );
+
+    tIndexSlot * slot = findSlot( store, hash, record->path, record->pathLen );
+    if ( slot->offset == 0 ) {
+        if ( record->state == kStateGone ) {
+            /* nothing to forget */
+            return 0;
+        }
+        /* keep the load factor under 3/4, so probe sequences stay short */
+        if ( (header->count + 1) * 4 > header->capacity * 3 ) {
+            tError result = growIndex( store );
+            if ( result != 0 ) return result;
+            header = store->index.header;
+            slot   = emptySlot( store, hash );
+        }
+        slot->hash = hash;
+        ++header->count;
+    } else if ( slot->state != kStateGone ) {
+        header->live -= recordLength( record->pathLen );
+        if ( slot->state == kStateDone ) {
+            filterRemove( store, hash, slot->mtime, slot->size );
+        }
+    }
+
+    slot->offset   = offset;
+    slot->mtime    = record->mtime;
+    slot->size     = record->size;
+    slot->state    = record->state;
+    slot->attempts = record->attempts;
+    slot->seen     = (uint8_t)header->generation;
+
+    if ( record->state != kStateGone ) {
+        header->live += recordLength( record->pathLen );
+    }
+    if ( record->state == kStateDone ) {
+        filterAdd( store, hash, record->mtime, record->size );
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief append a record to the log, and index it. The caller holds the write lock
+ * @param store
+ * @param relPath
+ * @param fileRecord
+ * @return
+ */
+static tError appendRecord( tStateStore * store, const char * relPath, const tFileRecord * fileRecord )
+{
+    tError result = 0;
+    size_t len    = strlen( relPath );
+
+    if ( len > UINT16_MAX ) {
+        return -ENAMETOOLONG;
+    }
+
+    size_t length = recordLength( len );
+    tLogRecord * record = calloc( 1, length );
+    if ( record == NULL ) {
+        return -ENOMEM;
+    }
+    record->pathLen  = (uint16_t)len;
+    record->state    = (uint8_t)fileRecord->state;
+    record->attempts = ( fileRecord->attempts > UINT8_MAX ) ? UINT8_MAX : (uint8_t)fileRecord->attempts;
+    record->mtime    = fileRecord->mtime;
+    record->size     = fileRecord->size;
+    memcpy( record->path, relPath, len );
+    record->checksum = recordChecksum( record );
+
+    uint64_t offset  = store->log.length;
+    ssize_t  written = pwrite( store->log.fd, record, length, (off_t)offset );
+    if ( written != (ssize_t)length ) {
+        result = ( written == -1 ) ? -errno : -EIO;
+        /* don't leave part of a record behind for the next one to follow */
+        if ( written > 0 && ftruncate( store->log.fd, (off_t)offset ) == -1 ) {
+            logError( "unable to remove a partial record from the state log" );
+        }
+    } else {
+        store->log.length += length;
+        if ( store->dirtyAt == 0 ) {
+            store->dirtyAt = monotonicMs();
+        }
+        result = mapLog( store );
+        if ( result == 0 ) {
+            result = indexRecord( store, recordAt( store, offset ), offset );
+        }
+    }
+    free( record );
+
+    return result;
+}
+
+
+/**
+ * @brief rebuild the index from the log. If a record is damaged, it was
+ * being written when we stopped, so the log is cut back to just before it
+ * @param store
+ * @return
+ */
+static tError replayLog( tStateStore * store )
+{
+    tError   result = mapLog( store );
+    uint64_t offset = sizeof( tLogHeader );
+    unsigned long count = 0;
+
+    while ( result == 0 && offset + sizeof( tLogRecord ) <= store->log.length ) {
+        const tLogRecord * record = recordAt( store, offset );
+        uint64_t length = recordLength( record->pathLen );
+        if ( offset + length > store->log.length
+          || record->path[ record->pathLen ] != '\0'
+          || recordChecksum( record ) != record->checksum ) {
+            break;
+        }
+        result = indexRecord( store, record, offset );
+        offset += length;
+        ++count;
+    }
+
+    if ( result == 0 && offset < store->log.length ) {
+        logWarning( "discarding %lu bytes of damaged records from the end of \'%s/%s\'",
+                    store->log.length - offset, store->watchedTree->seen.path, kLogName );
+        if ( ftruncate( store->log.fd, (off_t)offset ) == -1 ) {
+            result = -errno;
+            logError( "unable to truncate \'%s/%s\'", store->watchedTree->seen.path, kLogName );
+        }
+        store->log.length = offset;
+    }
+    logSetErrno( 0 );
+    logInfo( "rebuilt the index of \'%s\' from %lu records", store->watchedTree->root.path, count );
+
+    return result;
+}
+
+
+/**
+ * @brief map the index. If it wasn't closed cleanly, or doesn't match the
+ * log, start it again from scratch
+ * @param store
+ * @return
+ */
+static tError loadIndex( tStateStore * store )
+{
+    tIndexHeader header;
+    struct stat  info;
+    bool         valid = false;
+
+    if ( fstat( store->index.fd, &info ) == 0
+      && pread( store->index.fd, &header, sizeof( header ), 0 ) == sizeof( header ) ) {
+        valid = ( memcmp( header.magic, kIndexMagic, sizeof( header.magic ) ) == 0
+               && header.clean != 0
+               && header.logLength == store->log.length
+               && header.capacity >= kStoreMinCapacity
+               && ( header.capacity & (header.capacity - 1) ) == 0
+               && (size_t)info.st_size == sizeof( tIndexHeader ) + header.capacity * sizeof( tIndexSlot ) );
+    }
+
+    tError result = mapIndex( store, valid ? header.capacity : kStoreMinCapacity );
+    if ( result == 0 ) {
+        if ( valid ) {
+            result = mapLog( store );
+        } else {
+            memset( store->index.header, 0, store->index.mapSize );
+            memcpy( store->index.header->magic, kIndexMagic, sizeof( kIndexMagic ) );
+            store->index.header->capacity = kStoreMinCapacity;
+            result = replayLog( store );
+        }
+    }
+
+    if ( result == 0 ) {
+        /* until it's closed cleanly again, what's on disk can't be trusted */
+        store->index.header->clean = 0;
+        if ( msync( store->index.header, sizeof( tIndexHeader ), MS_SYNC ) == -1 ) {
+            result = -errno;
+        }
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief write out only the records that are still current to a new log,
+ * and swap it in. The caller holds the write lock
+ * @param store
+ * @return
+ */
+static tError compactLog( tStateStore * store )
+{
+    tError         result = 0;
+    tIndexHeader * header = store->index.header;
+    tFileDscr      dirFd  = store->watchedTree->seen.fd;
+
+    tIndexSlot * live = malloc( header->count * sizeof( tIndexSlot ) );
+    char *       buffer = malloc( kCompactBufferSize );
+    tFileDscr    fd = openat( dirFd, kLogNewName, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP );
+    if ( live == NULL || buffer == NULL || fd == -1 ) {
+        result = ( fd == -1 ) ? -errno : -ENOMEM;
+    }
+
+    /* copy the latest record for each file that's still around, noting where it ends up */
+    uint64_t length = 0;
+    size_t   used   = 0;
+    uint64_t count  = 0;
+    if ( result == 0 ) {
+        tLogHeader logHeader = { 0 };
+        memcpy( logHeader.magic, kLogMagic, sizeof( kLogMagic ) );
+        memcpy( buffer, &logHeader, sizeof( logHeader ) );
+        used = length = sizeof( logHeader );
+
+        for ( uint64_t i = 0; i < header->capacity && result == 0; ++i ) {
+            const tIndexSlot * slot = &store->index.slots[ i ];
+            if ( slot->offset == 0 || slot->state == kStateGone ) continue;
+
+            const tLogRecord * record = recordAt( store, slot->offset );
+            size_t size = recordLength( record->pathLen );
+            if ( used + size > kCompactBufferSize ) {
+                if ( write( fd, buffer, used ) != (ssize_t)used ) {
+                    result = ( errno != 0 ) ? -errno : -EIO;
+                }
+                used = 0;
+            }
+            memcpy( &buffer[ used ], record, size );
+            used += size;
+
+            live[ count ] = *slot;
+            live[ count++ ].offset = length;
+            length += size;
+        }
+        if ( result == 0 && used > 0 && write( fd, buffer, used ) != (ssize_t)used ) {
+            result = ( errno != 0 ) ? -errno : -EIO;
+        }
+    }
+
+    /* the new log has to be safely on disk before it replaces the old one */
+    if ( result == 0 && fdatasync( fd ) == -1 ) {
+        result = -errno;
+    }
+    if ( result == 0 && renameat( dirFd, kLogNewName, dirFd, kLogName ) == -1 ) {
+        result = -errno;
+    }
+
+    if ( result == 0 ) {
+        fsync( dirFd );
+        logInfo( "compacted the state log of \'%s\' from %lu to %lu bytes",
+                 store->watchedTree->root.path, store->log.length, length );
+
+        close( store->log.fd );
+        munmap( (void *)store->log.map, store->log.mapSize );
+        store->log.fd      = fd;
+        store->log.length  = length;
+        store->log.map     = NULL;
+        store->log.mapSize = 0;
+        result = mapLog( store );
+
+        memset( store->index.slots, 0, header->capacity * sizeof( tIndexSlot ) );
+        header->count = count;
+        header->live  = length - sizeof( tLogHeader );
+        for ( uint64_t i = 0; i < count; ++i ) {
+            *emptySlot( store, live[ i ].hash ) = live[ i ];
+        }
+    } else {
+        logSetErrno( -result );
+        logError( "unable to compact the state log of \'%s\'", store->watchedTree->root.path );
+        if ( fd != -1 ) {
+            close( fd );
+            unlinkat( dirFd, kLogNewName, 0 );
+        }
+    }
+    logSetErrno( 0 );
+
+    free( buffer );
+    free( live );
+
+    return result;
+}
+
+
+/**
+ * @brief make the appends so far durable, and compact the log if most of it
+ * has been superseded. Only called on the event loop
+ * @param store
+ * @return
+ */
+static tError syncStore( tStateStore * store )
+{
+    tError result = 0;
+
+    if ( fdatasync( store->log.fd ) == -1 ) {
+        result = -errno;
+        logError( "unable to sync the state log of \'%s\'", store->watchedTree->root.path );
+        logSetErrno( 0 );
+    }
+    store->dirtyAt = 0;
+
+    const tIndexHeader * header = store->index.header;
+    if ( result == 0 && store->log.length > kStoreCompactBytes && store->log.length > 2 * header->live ) {
+        pthread_rwlock_wrlock( &store->lock );
+        result = compactLog( store );
+        pthread_rwlock_unlock( &store->lock );
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief record what an old shadow file says about its file
+ * A shadow file that's still executable was expired, but never completed.
+ * One that isn't was processed successfully. If the file has been modified
+ * (by more than the idle time) since, it's recorded with the shadow's mtime,
+ * so it doesn't match and is processed again.
+ * @param store
+ * @param relPath
+ * @param shadowInfo
+ * @return true if a record was added
+ */
+static bool importShadowFile( tStateStore * store, const char * relPath, const struct stat * shadowInfo )
+{
+    tWatchedTree * watchedTree = store->watchedTree;
+
+    /* it may have been imported before we were interrupted last time */
+    if ( findSlot( store, calcHash( relPath ), relPath, strlen( relPath ) )->offset != 0 ) {
+        return false;
+    }
+
+    tFileRecord record = { .state = kStatePending, .attempts = 1 };
+    if ( !(shadowInfo->st_mode & (S_IXUSR | S_IXGRP)) ) {
+        struct stat info;
+        if ( fstatat( watchedTree->root.fd, relPath, &info, 0 ) == -1 ) {
+            /* the file it stood for has gone */
+            return false;
+        }
+        long long olderBy = (info.st_mtim.tv_sec - shadowInfo->st_mtim.tv_sec) * 1000LL
+                          + (info.st_mtim.tv_nsec - shadowInfo->st_mtim.tv_nsec) / 1000000;
+        const struct timespec * mtime = ( olderBy > (long long)watchedTree->idle ) ? &shadowInfo->st_mtim : &info.st_mtim;
+
+        record.state = kStateDone;
+        record.mtime = (int64_t)mtime->tv_sec * 1000000000 + mtime->tv_nsec;
+        record.size  = (uint64_t)info.st_size;
+    }
+
+    return ( appendRecord( store, relPath, &record ) == 0 );
+}
+
+
+/**
+ * @brief import the shadow files in one directory of the old shadow
+ * hierarchy, and the directories below it
+ * @param store
+ * @param fd the shadow directory (closed before returning)
+ * @param relPath its path relative to the shadow root, with room to append to
+ * @param relLen
+ * @return how many records were added
+ */
+static unsigned long importShadowDir( tStateStore * store, tFileDscr fd, char * relPath, size_t relLen )
+{
+    unsigned long count = 0;
+
+    DIR * dir = fdopendir( fd );
+    if ( dir == NULL ) {
+        close( fd );
+        return 0;
+    }
+
+    struct dirent * entry;
+    while ( (entry = readdir( dir )) != NULL ) {
+        const char * name = entry->d_name;
+        if ( strcmp( name, "." ) == 0 || strcmp( name, ".." ) == 0 ) continue;
+        if ( relLen == 0 && strncmp( name, kStoreFilePrefix, strlen( kStoreFilePrefix ) ) == 0 ) continue;
+
+        size_t nameLen = strlen( name );
+        if ( relLen + nameLen + 2 > PATH_MAX ) continue;
+        memcpy( &relPath[ relLen ], name, nameLen + 1 );
+
+        struct stat info;
+        if ( fstatat( dirfd( dir ), name, &info, AT_SYMLINK_NOFOLLOW ) == -1 ) continue;
+
+        if ( S_ISDIR( info.st_mode ) ) {
+            tFileDscr subFd = openat( dirfd( dir ), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+            if ( subFd != -1 ) {
+                relPath[ relLen + nameLen ] = '/';
+                count += importShadowDir( store, subFd, relPath, relLen + nameLen + 1 );
+            }
+        } else if ( S_ISREG( info.st_mode ) && name[0] != '.' ) {
+            /* hidden ones are temporary files, that never got renamed into place */
+            if ( importShadowFile( store, relPath, &info ) ) {
+                ++count;
+            }
+        }
+    }
+    closedir( dir );
+    relPath[ relLen ] = '\0';
+    logSetErrno( 0 );
+
+    return count;
+}
+
+
+/**
+ * @brief remove a shadow directory and everything in it
+ * @param parentFd
+ * @param name
+ * @return 0, or -1 with errno set
+ */
+static int removeShadowTree( tFileDscr parentFd, const char * name )
+{
+    tFileDscr fd = openat( parentFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+    if ( fd == -1 ) return -1;
+
+    DIR * dir = fdopendir( fd );
+    if ( dir == NULL ) {
+        close( fd );
+        return -1;
+    }
+
+    struct dirent * entry;
+    while ( (entry = readdir( dir )) != NULL ) {
+        if ( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) continue;
+
+        if ( unlinkat( fd, entry->d_name, 0 ) == -1 && errno == EISDIR ) {
+            removeShadowTree( fd, entry->d_name );
+        }
+    }
+    closedir( dir );
+
+    return unlinkat( parentFd, name, AT_REMOVEDIR );
+}
+
+
+/**
+ * @brief bring in whatever the shadow hierarchy of an older version left in
+ * '.seen', then remove it. The records are synced before anything is
+ * removed, so if we're interrupted, it's picked up again next time.
+ * If there's nothing there but the store's own files, this is cheap.
+ * @param store
+ * @return
+ */
+static tError importShadowHierarchy( tStateStore * store )
+{
+    tWatchedTree * watchedTree = store->watchedTree;
+    tFileDscr      dirFd       = watchedTree->seen.fd;
+    bool           leftovers   = false;
+
+    DIR * dir = fdopendir( openat( dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC ) );
+    if ( dir == NULL ) {
+        return -errno;
+    }
+    struct dirent * entry;
+    while ( !leftovers && (entry = readdir( dir )) != NULL ) {
+        leftovers = ( strcmp( entry->d_name, "." ) != 0 && strcmp( entry->d_name, ".." ) != 0
+                   && strncmp( entry->d_name, kStoreFilePrefix, strlen( kStoreFilePrefix ) ) != 0 );
+    }
+    closedir( dir );
+    if ( !leftovers ) {
+        return 0;
+    }
+
+    char relPath[ PATH_MAX ] = "";
+    tFileDscr fd = openat( dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if ( fd == -1 ) {
+        return -errno;
+    }
+    unsigned long count = importShadowDir( store, fd, relPath, 0 );
+    logInfo( "imported %lu files from the shadow hierarchy in \'%s\'", count, watchedTree->seen.path );
+
+    tError result = syncStore( store );
+    if ( result != 0 ) {
+        return result;
+    }
+
+    dir = fdopendir( openat( dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC ) );
+    if ( dir != NULL ) {
+        while ( (entry = readdir( dir )) != NULL ) {
+            const char * name = entry->d_name;
+            if ( strcmp( name, "." ) == 0 || strcmp( name, ".." ) == 0 ) continue;
+            if ( strncmp( name, kStoreFilePrefix, strlen( kStoreFilePrefix ) ) == 0 ) continue;
+
+            if ( unlinkat( dirfd( dir ), name, 0 ) == -1 && errno == EISDIR
+              && removeShadowTree( dirfd( dir ), name ) == -1 ) {
+                logError( "unable to remove \'%s/%s\'", watchedTree->seen.path, name );
+            }
+        }
+        closedir( dir );
+    }
+    logSetErrno( 0 );
+
+    return 0;
+}
+
+
+/**
+ * @brief
+ * @param store
+ */
+static void freeStateStore( tStateStore * store )
+{
+    if ( store->index.header != NULL ) {
+        munmap( store->index.header, store->index.mapSize );
+    }
+    if ( store->log.map != NULL ) {
+        munmap( (void *)store->log.map, store->log.mapSize );
+    }
+    if ( store->index.fd != -1 ) {
+        close( store->index.fd );
+    }
+    if ( store->log.fd != -1 ) {
+        close( store->log.fd );
+    }
+    freeCuckooFilter( store->filter );
+    if ( store->xattrDone != NULL ) {
+        void * entry;
+        size_t index = 0;
+        while ( ( entry = hashMapNext( store->xattrDone, &index ) ) != NULL ) {
+            free( entry );
+        }
+        freeHashMap( store->xattrDone );
+    }
+    pthread_rwlock_destroy( &store->lock );
+    free( store );
+}
+
+
+/**
+ * @brief open (or create) the tree's state store, in its '.seen' directory
+ * @param watchedTree
+ * @return
+ */
+tError openStateStore( tWatchedTree * watchedTree )
+{
+    tError result = 0;
+
+    if ( gCrcTable[1] == 0 ) {
+        initCrcTable();
+    }
+
+    tStateStore * store = calloc( 1, sizeof( tStateStore ) );
+    if ( store == NULL ) {
+        return -ENOMEM;
+    }
+    store->watchedTree = watchedTree;
+    store->log.fd      = -1;
+    store->index.fd    = -1;
+    pthread_rwlock_init( &store->lock, NULL );
+
+    if ( watchedTree->useXattr ) {
+        store->xattrDone = newHashMap( NULL );
+        if ( store->xattrDone == NULL ) {
+            freeStateStore( store );
+            return -ENOMEM;
+        }
+    }
+
+    store->log.fd = openat( watchedTree->seen.fd, kLogName, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP );
+    if ( store->log.fd == -1 ) {
+        result = -errno;
+        logError( "unable to open \'%s/%s\'", watchedTree->seen.path, kLogName );
+    } else {
+        struct stat info;
+        tLogHeader  header = { 0 };
+        if ( fstat( store->log.fd, &info ) == -1 ) {
+            result = -errno;
+        } else if ( info.st_size == 0 ) {
+            memcpy( header.magic, kLogMagic, sizeof( kLogMagic ) );
+            if ( pwrite( store->log.fd, &header, sizeof( header ), 0 ) != sizeof( header ) ) {
+                result = ( errno != 0 ) ? -errno : -EIO;
+            }
+            store->log.length = sizeof( header );
+        } else {
+            if ( pread( store->log.fd, &header, sizeof( header ), 0 ) != sizeof( header )
+              || memcmp( header.magic, kLogMagic, sizeof( kLogMagic ) ) != 0 ) {
+                result = -EINVAL;
+            }
+            store->log.length = (uint64_t)info.st_size;
+        }
+        if ( result != 0 ) {
+            logSetErrno( -result );
+            logError( "\'%s/%s\' is not a state log", watchedTree->seen.path, kLogName );
+        }
+    }
+
+    if ( result == 0 ) {
+        store->index.fd = openat( watchedTree->seen.fd, kIndexName, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP );
+        if ( store->index.fd == -1 ) {
+            result = -errno;
+            logError( "unable to open \'%s/%s\'", watchedTree->seen.path, kIndexName );
+        }
+    }
+
+    if ( result == 0 ) {
+        result = loadIndex( store );
+        if ( result != 0 ) {
+            logSetErrno( -result );
+            logError( "unable to load the index of \'%s\'", watchedTree->root.path );
+        }
+    }
+
+    if ( result == 0 ) {
+        result = importShadowHierarchy( store );
+    }
+    if ( result == 0 && buildFilter( store, 0 ) != 0 ) {
+        /* the scans can manage without it */
+        logWarning( "no memory for the filter of the files processed in '%s'", watchedTree->root.path );
+    }
+    logSetErrno( 0 );
+
+    if ( result == 0 ) {
+        watchedTree->state = store;
+    } else {
+        freeStateStore( store );
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief open a file so its xattr can be got at. fgetxattr() & fsetxattr()
+ * won't take an O_PATH descriptor, but opening a file to read doesn't read
+ * it. One we're not allowed to read may still be ours to label, so that's
+ * done through its /proc/self/fd link, which is only a short path to resolve
+ * @param dirFd a directory it's in, or somewhere above it
+ * @param name relative to dirFd
+ * @param fd the descriptor, for the caller to close
+ * @param procPath filled in with the link, or left empty if fd can be used directly
+ * @return
+ */
+static tError openForXattr( tFileDscr dirFd, const char * name, tFileDscr * fd, char * procPath )
+{
+    procPath[ 0 ] = '\0';
+    *fd = openat( dirFd, name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC );
+    if ( *fd != -1 ) {
+        return 0;
+    }
+    if ( errno != EACCES && errno != EPERM ) {
+        return -errno;
+    }
+    *fd = openat( dirFd, name, O_PATH | O_CLOEXEC );
+    if ( *fd == -1 ) {
+        return -errno;
+    }
+    snprintf( procPath, 32, "/proc/self/fd/%d", *fd );
+    return 0;
+}
+
+
+/**
+ * @brief read a file's state from its xattr, which reads e.g. "done 1 <mtime in ns> <size>"
+ * @param dirFd a directory it's in, or somewhere above it
+ * @param name relative to dirFd
+ * @param record
+ * @return -ENODATA if it hasn't got one, or an error if it can't be read
+ */
+static tError readXattr( tFileDscr dirFd, const char * name, tFileRecord * record )
+{
+    tFileDscr fd;
+    char      procPath[ 32 ];
+    char      value[ 96 ];
+
+    tError result = openForXattr( dirFd, name, &fd, procPath );
+    if ( result != 0 ) {
+        return result;
+    }
+    ssize_t len = ( procPath[ 0 ] == '\0' ) ? fgetxattr( fd, kStateXattr, value, sizeof( value ) - 1 )
+                                            : getxattr( procPath, kStateXattr, value, sizeof( value ) - 1 );
+    if ( len < 0 ) {
+        result = -errno;
+    }
+    close( fd );
+    if ( result != 0 ) {
+        return result;
+    }
+    value[ len ] = '\0';
+
+    char               state[ 16 ];
+    unsigned int       attempts;
+    long long          mtime;
+    unsigned long long size;
+    if ( sscanf( value, "%15s %u %lld %llu", state, &attempts, &mtime, &size ) != 4 ) {
+        return -EINVAL;
+    }
+    for ( tFileState i = kStatePending; i <= kStateFailed; ++i ) {
+        if ( i != kStateGone && strcmp( state, kStateNames[ i ] ) == 0 ) {
+            record->state    = i;
+            record->attempts = attempts;
+            record->mtime    = mtime;
+            record->size     = size;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+
+/**
+ * @brief
+ * @param dirFd a directory it's in, or somewhere above it
+ * @param name relative to dirFd
+ * @param record
+ * @return
+ */
+static tError writeXattr( tFileDscr dirFd, const char * name, const tFileRecord * record )
+{
+    tFileDscr fd;
+    char      procPath[ 32 ];
+    char      value[ 96 ];
+
+    tError result = openForXattr( dirFd, name, &fd, procPath );
+    if ( result != 0 ) {
+        return result;
+    }
+    int len = snprintf( value, sizeof( value ), "%s %u %lld %llu",
+                        kStateNames[ record->state ], record->attempts,
+                        (long long)record->mtime, (unsigned long long)record->size );
+    int err = ( procPath[ 0 ] == '\0' ) ? fsetxattr( fd, kStateXattr, value, (size_t)len, 0 )
+                                        : setxattr( procPath, kStateXattr, value, (size_t)len, 0 );
+    if ( err == -1 ) {
+        result = -errno;
+    }
+    close( fd );
+    return result;
+}
+
+
+/**
+ * @brief whether the filter already holds what a file's xattr says. The
+ * caller holds the lock, for reading at least
+ * @param store
+ * @param hash of its relative path
+ * @param record from its xattr, or NULL if it hasn't got one (any more)
+ * @param generation if non-zero, note that this deep scan came across it
+ * @return
+ */
+static bool xattrDoneMatches( tStateStore * store, tHash hash, const tFileRecord * record, uint8_t generation )
+{
+    tXattrDone * entry;
+    bool         done = ( record != NULL && record->state == kStateDone );
+
+    if ( hashMapFind( store->xattrDone, hash, NULL, (void **)&entry ) != 0 ) {
+        return !done;
+    }
+    if ( generation != 0 ) {
+        /* as for an index slot, only the scan thread that's in its directory writes this */
+        __atomic_store_n( &entry->seen, generation, __ATOMIC_RELAXED );
+    }
+    return done && entry->mtime == record->mtime && entry->size == record->size;
+}
+
+
+/**
+ * @brief bring the filter into line with what a file's xattr says, so a
+ * file that's no longer processed (as it was), or has been moved, isn't
+ * vouched for. The caller holds the write lock
+ * @param store
+ * @param hash of its relative path
+ * @param record from its xattr, or NULL if it hasn't got one (any more)
+ * @param generation if non-zero, the deep scan that came across it
+ */
+static void syncXattrDone( tStateStore * store, tHash hash, const tFileRecord * record, uint8_t generation )
+{
+    tXattrDone * entry = NULL;
+    bool         done  = ( record != NULL && record->state == kStateDone );
+
+    hashMapFind( store->xattrDone, hash, NULL, (void **)&entry );
+    if ( entry != NULL ) {
+        if ( done && entry->mtime == record->mtime && entry->size == record->size ) {
+            return;
+        }
+        filterRemove( store, hash, entry->mtime, entry->size );
+        if ( !done ) {
+            hashMapRemove( store->xattrDone, hash, NULL );
+            free( entry );
+            return;
+        }
+    } else {
+        if ( !done ) {
+            return;
+        }
+        /* if there's no room, the filter simply won't vouch for it */
+        entry = malloc( sizeof( tXattrDone ) );
+        if ( entry == NULL ) {
+            return;
+        }
+        entry->hash = hash;
+        entry->seen = ( generation != 0 ) ? generation : (uint8_t)store->index.header->generation;
+        if ( hashMapAdd( store->xattrDone, hash, entry ) != 0 ) {
+            free( entry );
+            return;
+        }
+    }
+    entry->mtime = record->mtime;
+    entry->size  = record->size;
+    filterAdd( store, hash, record->mtime, record->size );
+}
+
+
+/**
+ * @brief
+ * @param store
+ * @param relPath
+ * @param generation if non-zero, note that this deep scan came across it
+ * @param record filled in. If there's no record for the path, its state is kStateNone
+ * @return -ENOENT if there's no record for the path
+ */
+tError storeLookup( tStateStore * store, const char * relPath, uint8_t generation, tFileRecord * record )
+{
+    return storeLookupAt( store, relPath, store->watchedTree->root.fd, relPath, generation, record );
+}
+
+
+/**
+ * @brief as storeLookup(), for a file in a directory that's already open,
+ * so reading its xattr doesn't have to resolve its whole path again
+ * @param store
+ * @param relPath
+ * @param dirFd the directory it's in
+ * @param name its name in dirFd
+ * @param generation if non-zero, note that this deep scan came across it
+ * @param record filled in. If there's no record for the path, its state is kStateNone
+ * @return -ENOENT if there's no record for the path
+ */
+tError storeLookupAt( tStateStore * store, const char * relPath, tFileDscr dirFd, const char * name,
+                      uint8_t generation, tFileRecord * record )
+{
+    tError result = 0;
+
+    memset( record, 0, sizeof( tFileRecord ) );
+
+    if ( store->watchedTree->useXattr ) {
+        result = readXattr( dirFd, name, record );
+        if ( result == 0 || result == -ENODATA || result == -ENOENT || result == -EINVAL ) {
+            /* it could have been moved here, or away, since the filter was told about it */
+            const tFileRecord * xattr = ( result == 0 ) ? record : NULL;
+            tHash               hash  = calcHash( relPath );
+
+            pthread_rwlock_rdlock( &store->lock );
+            bool matches = xattrDoneMatches( store, hash, xattr, generation );
+            pthread_rwlock_unlock( &store->lock );
+            if ( !matches ) {
+                pthread_rwlock_wrlock( &store->lock );
+                syncXattrDone( store, hash, xattr, generation );
+                pthread_rwlock_unlock( &store->lock );
+            }
+        }
+        if ( result == 0 ) {
+            return 0;
+        }
+        memset( record, 0, sizeof( tFileRecord ) );
+        result = 0;
+    }
+
+    pthread_rwlock_rdlock( &store->lock );
+    tIndexSlot * slot = findSlot( store, calcHash( relPath ), relPath, strlen( relPath ) );
+    if ( slot->offset == 0 ) {
+        result = -ENOENT;
+    } else {
+        record->state    = slot->state;
+        record->attempts = slot->attempts;
+        record->mtime    = slot->mtime;
+        record->size     = slot->size;
+        if ( generation != 0 ) {
+            /* each file is only in one directory, so only one scan thread ever writes this */
+            __atomic_store_n( &slot->seen, generation, __ATOMIC_RELAXED );
+        }
+    }
+    pthread_rwlock_unlock( &store->lock );
+
+    return result;
+}
+
+
+/**
+ * @brief record a change of state. It's written to the log straight away,
+ * but only made durable by the next sync
+ * @param store
+ * @param relPath
+ * @param record
+ * @return
+ */
+tError storeUpdate( tStateStore * store, const char * relPath, const tFileRecord * record )
+{
+    if ( store->watchedTree->useXattr ) {
+        tError result = writeXattr( store->watchedTree->root.fd, relPath, record );
+        if ( result == 0 || result == -ENOENT ) {
+            tHash hash = calcHash( relPath );
+            pthread_rwlock_wrlock( &store->lock );
+            syncXattrDone( store, hash, ( result == 0 ) ? record : NULL, 0 );
+            if ( result == 0 ) {
+                /* the xattr supersedes any record of it in the log, which would
+                 * otherwise keep its old state in the filter too */
+                const tIndexSlot * slot = findSlot( store, hash, relPath, strlen( relPath ) );
+                if ( slot->offset != 0 && slot->state != kStateGone ) {
+                    tFileRecord gone = { .state = kStateGone };
+                    appendRecord( store, relPath, &gone );
+                }
+            }
+            pthread_rwlock_unlock( &store->lock );
+            return result;
+        }
+        if ( !store->xattrRejected ) {
+            store->xattrRejected = true;
+            logSetErrno( -result );
+            logWarning( "unable to set the xattr on \'%s\', so keeping its state (and that of any "
+                        "others like it) in the log instead", relPath );
+            logSetErrno( 0 );
+        }
+    }
+
+    pthread_rwlock_wrlock( &store->lock );
+    if ( store->xattrDone != NULL ) {
+        /* whatever an xattr it might still have says, the log has the last word now */
+        syncXattrDone( store, calcHash( relPath ), NULL, 0 );
+    }
+    tError result = appendRecord( store, relPath, record );
+    pthread_rwlock_unlock( &store->lock );
+
+    return result;
+}
+
+
+/**
+ * @brief ask the filter whether the file has been processed, and not
+ * modified since, without looking up its record. Once in a while it's wrong,
+ * and says so for a file that hasn't, so only a periodic scan asks. A file
+ * it misses is picked up by the next deep scan, if not by inotify first.
+ * @param store
+ * @param relPath
+ * @param mtime the file's, in nanoseconds
+ * @param size
+ * @return true if it (probably) has been
+ */
+bool storeProbablyDone( tStateStore * store, const char * relPath, int64_t mtime, uint64_t size )
+{
+    bool found = false;
+
+    pthread_rwlock_rdlock( &store->lock );
+    if ( store->filter != NULL ) {
+        found = cuckooFilterContains( store->filter, filterKey( calcHash( relPath ), mtime, size ) );
+        __atomic_fetch_add( &store->filterCount.lookups, 1, __ATOMIC_RELAXED );
+        if ( found ) {
+            __atomic_fetch_add( &store->filterCount.hits, 1, __ATOMIC_RELAXED );
+        }
+    }
+    pthread_rwlock_unlock( &store->lock );
+
+    return found;
+}
+
+
+/**
+ * @brief a scan found the file unchanged since it was processed, although the
+ * filter didn't know it was. Only the ones in xattrs aren't loaded with the
+ * index, but entries can be dropped when it's full
+ * @param store
+ * @param relPath
+ * @param mtime
+ * @param size
+ */
+void storeNoteDone( tStateStore * store, const char * relPath, int64_t mtime, uint64_t size )
+{
+    tHash hash = calcHash( relPath );
+
+    pthread_rwlock_wrlock( &store->lock );
+    if ( store->filter != NULL && !cuckooFilterContains( store->filter, filterKey( hash, mtime, size ) ) ) {
+        filterAdd( store, hash, mtime, size );
+    }
+    pthread_rwlock_unlock( &store->lock );
+}
+
+
+/**
+ * @brief report how well the filter is doing, if the scans have used it since last time
+ * @param store
+ */
+void logStoreStats( tStateStore * store )
+{
+    unsigned long lookups = __atomic_load_n( &store->filterCount.lookups, __ATOMIC_RELAXED );
+    if ( store->filter == NULL || lookups == store->filterCount.logged ) {
+        return;
+    }
+
+    pthread_rwlock_rdlock( &store->lock );
+    logInfo( "'%s': the filter vouched for %lu of the %lu files it was asked about. It holds %lu "
+             "in %lu KiB, with an estimated false positive rate of %.1e",
+             store->watchedTree->root.path,
+             __atomic_load_n( &store->filterCount.hits, __ATOMIC_RELAXED ), lookups,
+             store->filter->count, cuckooFilterMemory( store->filter ) / 1024,
+             cuckooFilterFalsePositiveRate( store->filter ) );
+    pthread_rwlock_unlock( &store->lock );
+
+    store->filterCount.logged = lookups;
+}
+
+
+/**
+ * @brief the file has been deleted
+ * @param store
+ * @param relPath
+ * @return
+ */
+tError storeForget( tStateStore * store, const char * relPath )
+{
+    tError result = 0;
+
+    tHash hash = calcHash( relPath );
+
+    pthread_rwlock_wrlock( &store->lock );
+    if ( store->xattrDone != NULL ) {
+        /* its xattr went with it, wherever it went */
+        syncXattrDone( store, hash, NULL, 0 );
+    }
+    tIndexSlot * slot = findSlot( store, hash, relPath, strlen( relPath ) );
+    if ( slot->offset != 0 && slot->state != kStateGone ) {
+        tFileRecord record = { .state = kStateGone };
+        result = appendRecord( store, relPath, &record );
+    }
+    pthread_rwlock_unlock( &store->lock );
+
+    return result;
+}
+
+
+/**
+ * @brief a deep scan is starting. The records it comes across, and any
+ * that are updated while it's running, are marked with the generation
+ * @param store
+ * @return the new generation, never zero
+ */
+uint8_t storeNewGeneration( tStateStore * store )
+{
+    tIndexHeader * header = store->index.header;
+
+    header->generation = ( header->generation % UINT8_MAX ) + 1;
+    return (uint8_t)header->generation;
+}
+
+
+/**
+ * @brief take the files whose xattrs a deep scan didn't come across out of
+ * the filter. The caller holds the write lock
+ * @param store
+ * @param generation of the deep scan
+ * @return how many were taken out
+ */
+static unsigned long sweepXattrDone( tStateStore * store, uint8_t generation )
+{
+    /* nothing can be removed while stepping through them, so gather them first */
+    tXattrDone ** stale = malloc( store->xattrDone->count * sizeof( tXattrDone * ) + 1 );
+    if ( stale == NULL ) {
+        return 0;
+    }
+
+    unsigned long count = 0;
+    tXattrDone *  entry;
+    size_t        index = 0;
+    while ( ( entry = hashMapNext( store->xattrDone, &index ) ) != NULL ) {
+        if ( entry->seen != generation ) {
+            stale[ count++ ] = entry;
+        }
+    }
+    for ( unsigned long i = 0; i < count; ++i ) {
+        filterRemove( store, stale[ i ]->hash, stale[ i ]->mtime, stale[ i ]->size );
+        hashMapRemove( store->xattrDone, stale[ i ]->hash, NULL );
+        free( stale[ i ] );
+    }
+    free( stale );
+
+    return count;
+}
+
+
+/**
+ * @brief forget the files a deep scan didn't come across, since they must
+ * have been deleted while we weren't watching
+ * @param store
+ * @param generation of the deep scan
+ * @return how many were forgotten
+ */
+unsigned long storeSweep( tStateStore * store, uint8_t generation )
+{
+    unsigned long count = 0;
+    tFileRecord   gone  = { .state = kStateGone };
+    char          relPath[ PATH_MAX ];
+
+    pthread_rwlock_wrlock( &store->lock );
+    /* a record for a path that's already in the index never needs a new slot,
+     * so the slots don't move while we're going through them */
+    for ( uint64_t i = 0; i < store->index.header->capacity; ++i ) {
+        const tIndexSlot * slot = &store->index.slots[ i ];
+        if ( slot->offset == 0 || slot->state == kStateGone || slot->seen == generation ) continue;
+
+        const tLogRecord * record = recordAt( store, slot->offset );
+        if ( record->pathLen >= sizeof( relPath ) ) continue;
+        memcpy( relPath, record->path, record->pathLen + 1 );
+
+        if ( appendRecord( store, relPath, &gone ) == 0 ) {
+            ++count;
+        }
+    }
+    if ( store->xattrDone != NULL ) {
+        count += sweepXattrDone( store, generation );
+    }
+    pthread_rwlock_unlock( &store->lock );
+
+    return count;
+}
+
+
+/**
+ * @brief sync the stores that have had appends waiting long enough
+ * @param force sync every store with appends waiting
+ * @return when the next one will be due, or UINT64_MAX if none are waiting
+ */
+tTick syncStateStores( bool force )
+{
+    tTick now  = monotonicMs();
+    tTick next = UINT64_MAX;
+
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        tStateStore * store = watchedTree->state;
+        if ( store == NULL || store->dirtyAt == 0 ) continue;
+
+        tTick due = store->dirtyAt + kStoreSyncMs;
+        if ( force || due <= now ) {
+            syncStore( store );
+        } else if ( due < next ) {
+            next = due;
+        }
+    }
+
+    return next;
+}
+
+
+/**
+ * @brief carry on using the stores after closeStateStores(), e.g. when a
+ * handover failed. Until they're closed cleanly again, they can't be trusted
+ */
+void reopenStateStores( void )
+{
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        tStateStore * store = watchedTree->state;
+        if ( store == NULL ) continue;
+
+        pthread_rwlock_wrlock( &store->lock );
+        store->index.header->clean = 0;
+        if ( msync( store->index.header, sizeof( tIndexHeader ), MS_SYNC ) == -1 ) {
+            logError( "unable to write the index of \'%s\'", watchedTree->root.path );
+        }
+        pthread_rwlock_unlock( &store->lock );
+    }
+    logSetErrno( 0 );
+}
+
+
+/**
+ * @brief sync every store for the last time, and mark its index as clean
+ * They're left mapped, as the scan threads may still be looking things up.
+ */
+void closeStateStores( void )
+{
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        tStateStore * store = watchedTree->state;
+        if ( store == NULL ) continue;
+
+        if ( syncStore( store ) == 0 ) {
+            pthread_rwlock_wrlock( &store->lock );
+            store->index.header->logLength = store->log.length;
+            store->index.header->clean     = 1;
+            if ( msync( store->index.header, store->index.mapSize, MS_SYNC ) == -1 ) {
+                logError( "unable to write the index of \'%s\'", watchedTree->root.path );
+            }
+            pthread_rwlock_unlock( &store->lock );
+        }
+    }
+    logSetErrno( 0 );
+}
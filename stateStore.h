@@ -0,0 +1,95 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_STATESTORE_H
+#define PROCESSNEWFILES_STATESTORE_H
+
+/*
+ * What we know about the files in a tree, kept in two files in '<root>/.seen'
+ *
+ * The log is append-only. Every change of state appends a record of the
+ * file's relative path, its mtime & size, its state and how many attempts
+ * have been made to process it. Each record carries a checksum, so a record
+ * torn by a crash is recognised, and the log is cut back to just before it.
+ *
+ * The index is an open-addressing hash table, mmap'd from a file of its own,
+ * which holds a copy of the latest record for each path, and where that
+ * record is in the log. So a lookup never needs a syscall. The index is only
+ * trusted if it was closed cleanly, otherwise it's rebuilt from the log.
+ *
+ * Appends are written straight away, but only fsync'ed every kStoreSyncMs,
+ * and the log is compacted when most of it has been superseded.
+ *
+ * The scan threads look up records concurrently, so the store has a rwlock.
+ * Only the event loop changes it.
+ *
+ * A tree can keep its state in a kStateXattr xattr on each file instead, so
+ * it goes wherever the file does. The log is then only used for a file whose
+ * filesystem won't take the xattr, and for records made before the tree
+ * was switched over, so a file without the xattr is still looked up in it.
+ * The xattr is read & written through a descriptor opened relative to the
+ * directory the file's in (or the root), so its path isn't resolved again.
+ *
+ * The files that have been processed are also kept in a cuckoo filter, keyed
+ * by their path, mtime & size. A periodic scan stats a file first, and if the
+ * filter has it, that's the end of it. Only the rest are looked up. The
+ * ones recorded in xattrs are added as they're looked up, and taken out
+ * again when the xattr changes, or the file's moved or deleted.
+ */
+
+#include <pthread.h>
+
+#define kStoreSyncMs        1000                // how long an append can wait to be fsync'ed
+#define kStoreCompactBytes  (1024 * 1024)       // don't bother compacting a log smaller than this
+#define kStoreMinCapacity   1024                // index slots to start with
+#define kStateXattr         "user.processNewFiles"
+
+typedef enum {
+    kStateNone = 0,     // no record
+    kStatePending,      // expired, but not (successfully) processed yet
+    kStateDone,         // processed. mtime & size are as they were when it finished
+    kStateGone,         // the file has been deleted
+    kStateFailed        // its retries ran out. mtime & size are as they were then
+} tFileState;
+
+/* processed, or given up on. Either way, it's only looked at again once it's modified */
+static inline bool stateIsSettled( tFileState state )
+{
+    return state == kStateDone || state == kStateFailed;
+}
+
+typedef struct {
+    tFileState      state;
+    unsigned int    attempts;
+    int64_t         mtime;      // in nanoseconds
+    uint64_t        size;
+} tFileRecord;
+
+typedef struct sStateStore tStateStore;
+
+tError openStateStore( tWatchedTree * watchedTree );
+
+tError storeLookup( tStateStore * store, const char * relPath, uint8_t generation, tFileRecord * record );
+tError storeLookupAt( tStateStore * store, const char * relPath, tFileDscr dirFd, const char * name,
+                      uint8_t generation, tFileRecord * record );
+tError storeUpdate( tStateStore * store, const char * relPath, const tFileRecord * record );
+tError storeForget( tStateStore * store, const char * relPath );
+
+bool   storeProbablyDone( tStateStore * store, const char * relPath, int64_t mtime, uint64_t size );
+void   storeNoteDone( tStateStore * store, const char * relPath, int64_t mtime, uint64_t size );
+void   logStoreStats( tStateStore * store );
+
+uint8_t storeNewGeneration( tStateStore * store );
+unsigned long storeSweep( tStateStore * store, uint8_t generation );
+
+tTick  syncStateStores( bool force );
+void   closeStateStores( void );
+void   reopenStateStores( void );
+
+static inline int64_t statxNs( const struct statx_timestamp * ts )
+{
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+#endif //PROCESSNEWFILES_STATESTORE_H
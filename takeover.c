@@ -0,0 +1,555 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "events.h"
+#include "inotify.h"
+#include "snapshot.h"
+#include "takeover.h"
+
+static const char kTakeoverMagic[8] = "pnfTko1";
+
+typedef struct {
+    char        magic[8];
+    uint32_t    trees;      // how many trees follow
+    uint32_t    reserved;
+} tTakeoverHeader;
+
+/* precedes each tree's root path (without a NUL), then its snapshot */
+typedef struct {
+    uint32_t    mask;       // what the tree's directories are watched for
+    uint32_t    rootLen;
+    uint64_t    length;     // of the snapshot
+} tTakeoverTree;
+
+/* a tree that was handed over to us */
+typedef struct {
+    char *      root;
+    uint32_t    mask;
+    char *      snapshot;
+    size_t      length;
+    bool        claimed;    // a tree has been created from it
+} tHandedTree;
+
+static struct {
+    char *          path;       // the socket's
+    ino_t           inode;      // ...so we only remove it if it's still ours
+    tFileDscr       listenFd;
+    tFileDscr       peerFd;     // the process taking over from us (-1 if none has asked)
+    uint64_t        listenData; // what epoll hands back when one connects...
+    uint64_t        peerData;   // ...and when it goes away again
+
+    struct {
+        bool            done;   // we took over from a previous process
+        unsigned int    count;
+        tHandedTree *   trees;
+    } handed;
+} gTakeover = { .listenFd = -1, .peerFd = -1 };
+
+
+/**
+ * @brief
+ * @return the socket's path, '/tmp/<exe>/<exe>.sock', alongside the pid file
+ */
+static const char * socketPath( void )
+{
+    if ( gTakeover.path == NULL ) {
+        if ( asprintf( &gTakeover.path, "/tmp/%s/%s.sock", g.executableName, g.executableName ) < 1 ) {
+            logError( "unable to generate path to the takeover socket" );
+            gTakeover.path = NULL;
+        }
+    }
+    return gTakeover.path;
+}
+
+
+static tError makeAddress( struct sockaddr_un * address )
+{
+    const char * path = socketPath();
+    if ( path == NULL ) {
+        return -ENOMEM;
+    }
+
+    memset( address, 0, sizeof( *address ) );
+    address->sun_family = AF_UNIX;
+    if ( strlen( path ) >= sizeof( address->sun_path ) ) {
+        return -ENAMETOOLONG;
+    }
+    strcpy( address->sun_path, path );
+
+    return 0;
+}
+
+
+static tError sendAll( tFileDscr fd, const void * buffer, size_t length )
+{
+    const char * p = buffer;
+    while ( length > 0 ) {
+        ssize_t len = send( fd, p, length, MSG_NOSIGNAL );
+        if ( len == -1 ) {
+            if ( errno == EINTR ) continue;
+            return -errno;
+        }
+        p      += len;
+        length -= (size_t)len;
+    }
+    return 0;
+}
+
+
+static tError recvAll( tFileDscr fd, void * buffer, size_t length )
+{
+    char * p = buffer;
+    while ( length > 0 ) {
+        ssize_t len = recv( fd, p, length, 0 );
+        if ( len == -1 ) {
+            if ( errno == EINTR ) continue;
+            return -errno;
+        }
+        if ( len == 0 ) {
+            /* the daemon closed the connection without handing everything over */
+            return -ECONNRESET;
+        }
+        p      += len;
+        length -= (size_t)len;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief listen for a new process that wants to take over from us
+ * @param epollData what epoll should hand back when one connects
+ * @param peerData ...and if it goes away before we've handed over to it
+ * @return
+ */
+tError listenForTakeover( uint64_t epollData, uint64_t peerData )
+{
+    struct sockaddr_un address;
+
+    gTakeover.listenData = epollData;
+    gTakeover.peerData   = peerData;
+
+    tError result = makeAddress( &address );
+    if ( result != 0 ) {
+        return result;
+    }
+
+    gTakeover.listenFd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( gTakeover.listenFd == -1 ) {
+        result = -errno;
+        logError( "unable to create the takeover socket" );
+        return result;
+    }
+
+    /* left behind by a daemon that didn't exit cleanly */
+    unlink( address.sun_path );
+
+    struct stat info;
+    if ( bind( gTakeover.listenFd, (struct sockaddr *)&address, sizeof( address ) ) == -1
+      || listen( gTakeover.listenFd, 1 ) == -1
+      || stat( address.sun_path, &info ) == -1 ) {
+        result = -errno;
+        logError( "unable to listen on \'%s\'", address.sun_path );
+    } else {
+        gTakeover.inode = info.st_ino;
+        result = registerFdToEpoll( gTakeover.listenFd, epollData );
+    }
+
+    if ( result != 0 ) {
+        close( gTakeover.listenFd );
+        gTakeover.listenFd = -1;
+    }
+    return result;
+}
+
+
+/**
+ * @brief a new process has connected to the socket, so wind down, ready to hand over to it
+ * @return
+ */
+tError acceptTakeover( void )
+{
+    tFileDscr fd = accept4( gTakeover.listenFd, NULL, NULL, SOCK_CLOEXEC );
+    if ( fd == -1 ) {
+        if ( errno != EAGAIN && errno != EINTR ) {
+            logError( "unable to accept a takeover" );
+        }
+        logSetErrno( 0 );
+        return 0;
+    }
+
+    /* the socket's directory is only accessible to us, but be sure */
+    struct ucred credentials;
+    socklen_t    length = sizeof( credentials );
+    if ( getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length ) == -1
+      || credentials.uid != geteuid() ) {
+        logWarning( "refused a takeover from another user" );
+        logSetErrno( 0 );
+        close( fd );
+        return 0;
+    }
+
+    /* so we notice if it goes away while we're winding down */
+    if ( registerFdToEpoll( fd, gTakeover.peerData ) != 0 ) {
+        logSetErrno( 0 );
+        close( fd );
+        return 0;
+    }
+
+    gTakeover.peerFd = fd;
+    /* we won't accept another, and the new process will listen on the same path */
+    closeTakeover();
+
+    logInfo( "process %d is taking over. Waiting for %u children and any scans to finish",
+             credentials.pid, g.jobs.running );
+
+    return 0;
+}
+
+
+/**
+ * @brief give up on the process taking over, and carry on as before, listening for another
+ */
+static void abandonTakeover( void )
+{
+    /* closing it also removes it from the epoll set */
+    close( gTakeover.peerFd );
+    gTakeover.peerFd = -1;
+
+    if ( listenForTakeover( gTakeover.listenData, gTakeover.peerData ) != 0 ) {
+        logWarning( "unable to listen for another takeover" );
+    }
+    logSetErrno( 0 );
+}
+
+
+/**
+ * @brief the process taking over has hung up. It never sends anything, so
+ * that's all this can be
+ * @return
+ */
+tError takeoverPeerGone( void )
+{
+    if ( gTakeover.peerFd != -1 ) {
+        logWarning( "the process taking over has gone, so carrying on" );
+        abandonTakeover();
+    }
+    return 0;
+}
+
+
+/**
+ * @brief
+ * @return true if a new process is waiting to take over from us
+ */
+bool takeoverPending( void )
+{
+    return ( gTakeover.peerFd != -1 );
+}
+
+
+/**
+ * @brief send the inotify instance, and a snapshot of every tree, to the
+ * process taking over. Only once nothing is running, and the state stores
+ * are closed. If it fails, the connection is closed, and we carry on
+ * @return
+ */
+tError handOver( void )
+{
+    tError result = 0;
+
+    tTakeoverHeader header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, kTakeoverMagic, sizeof( kTakeoverMagic ) );
+
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        ++header.trees;
+    }
+
+    /* the inotify fd goes along with the header */
+    union {
+        struct cmsghdr  align;
+        char            buffer[ CMSG_SPACE( sizeof( tFileDscr ) ) ];
+    } control;
+    memset( &control, 0, sizeof( control ) );
+
+    struct iovec  iov = { .iov_base = &header, .iov_len = sizeof( header ) };
+    struct msghdr message = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buffer,
+        .msg_controllen = sizeof( control.buffer )
+    };
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN( sizeof( tFileDscr ) );
+    tFileDscr fd = inotifyFd();
+    memcpy( CMSG_DATA( cmsg ), &fd, sizeof( fd ) );
+
+    ssize_t len;
+    do {
+        len = sendmsg( gTakeover.peerFd, &message, MSG_NOSIGNAL );
+    } while ( len == -1 && errno == EINTR );
+    if ( len == -1 ) {
+        result = -errno;
+    } else if ( (size_t)len < sizeof( header ) ) {
+        result = sendAll( gTakeover.peerFd, (const char *)&header + len, sizeof( header ) - (size_t)len );
+    }
+
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        if ( result != 0 ) break;
+
+        char * snapshot;
+        size_t length;
+        result = buildSnapshot( watchedTree, &snapshot, &length );
+        if ( result == 0 ) {
+            tTakeoverTree tree = {
+                .mask    = watchedTree->inotify.mask,
+                .rootLen = (uint32_t)watchedTree->root.pathLen,
+                .length  = length
+            };
+            result = sendAll( gTakeover.peerFd, &tree, sizeof( tree ) );
+            if ( result == 0 ) {
+                result = sendAll( gTakeover.peerFd, watchedTree->root.path, tree.rootLen );
+            }
+            if ( result == 0 ) {
+                result = sendAll( gTakeover.peerFd, snapshot, length );
+            }
+            free( snapshot );
+        }
+    }
+
+    if ( result == 0 ) {
+        logInfo( "handed over %u trees", header.trees );
+    } else {
+        logSetErrno( -result );
+        logError( "unable to hand over to the new process, so carrying on" );
+        logSetErrno( 0 );
+        abandonTakeover();
+    }
+    return result;
+}
+
+
+/**
+ * @brief stop listening for a takeover. If one is pending, the connection
+ * stays open until we exit, so the new process sees us go
+ */
+void closeTakeover( void )
+{
+    if ( gTakeover.listenFd != -1 ) {
+        close( gTakeover.listenFd );
+        gTakeover.listenFd = -1;
+
+        /* unless another daemon has since replaced it */
+        struct stat info;
+        if ( stat( gTakeover.path, &info ) == 0 && info.st_ino == gTakeover.inode ) {
+            unlink( gTakeover.path );
+        }
+        logSetErrno( 0 );
+    }
+}
+
+
+/**
+ * @brief free the trees that were handed over
+ */
+static void freeHandedTrees( void )
+{
+    for ( unsigned int i = 0; i < gTakeover.handed.count; ++i ) {
+        free( gTakeover.handed.trees[ i ].root );
+        free( gTakeover.handed.trees[ i ].snapshot );
+    }
+    free( gTakeover.handed.trees );
+    gTakeover.handed.trees = NULL;
+    gTakeover.handed.count = 0;
+}
+
+
+/**
+ * @brief receive everything the running daemon hands over
+ * @param fd connected to it
+ * @param inotify set to the inotify instance it handed over
+ * @return
+ */
+static tError receiveHandover( tFileDscr fd, tFileDscr * inotify )
+{
+    tError          result = 0;
+    tTakeoverHeader header;
+
+    union {
+        struct cmsghdr  align;
+        char            buffer[ CMSG_SPACE( sizeof( tFileDscr ) ) ];
+    } control;
+
+    struct iovec  iov = { .iov_base = &header, .iov_len = sizeof( header ) };
+    struct msghdr message = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buffer,
+        .msg_controllen = sizeof( control.buffer )
+    };
+
+    ssize_t len;
+    do {
+        len = recvmsg( fd, &message, MSG_CMSG_CLOEXEC );
+    } while ( len == -1 && errno == EINTR );
+    if ( len == -1 ) {
+        return -errno;
+    }
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message );
+    if ( cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+      && cmsg->cmsg_len == CMSG_LEN( sizeof( tFileDscr ) ) ) {
+        memcpy( inotify, CMSG_DATA( cmsg ), sizeof( tFileDscr ) );
+    }
+    if ( *inotify == -1 ) {
+        /* it closed the connection instead */
+        return ( len == 0 ) ? -ECONNRESET : -EPROTO;
+    }
+
+    if ( (size_t)len < sizeof( header ) ) {
+        result = recvAll( fd, (char *)&header + len, sizeof( header ) - (size_t)len );
+    }
+    if ( result == 0 && memcmp( header.magic, kTakeoverMagic, sizeof( kTakeoverMagic ) ) != 0 ) {
+        result = -EPROTO;
+    }
+    if ( result == 0 ) {
+        gTakeover.handed.trees = calloc( header.trees, sizeof( tHandedTree ) );
+        if ( gTakeover.handed.trees == NULL && header.trees != 0 ) {
+            result = -ENOMEM;
+        }
+    }
+
+    for ( uint32_t i = 0; i < header.trees && result == 0; ++i ) {
+        tTakeoverTree tree;
+        result = recvAll( fd, &tree, sizeof( tree ) );
+        if ( result != 0 ) break;
+        if ( tree.rootLen >= PATH_MAX ) {
+            result = -EPROTO;
+            break;
+        }
+
+        tHandedTree * handed = &gTakeover.handed.trees[ gTakeover.handed.count++ ];
+        handed->mask     = tree.mask;
+        handed->length   = tree.length;
+        handed->root     = calloc( 1, tree.rootLen + 1 );
+        handed->snapshot = malloc( tree.length );
+        if ( handed->root == NULL || handed->snapshot == NULL ) {
+            result = -ENOMEM;
+        } else {
+            result = recvAll( fd, handed->root, tree.rootLen );
+            if ( result == 0 ) {
+                result = recvAll( fd, handed->snapshot, tree.length );
+            }
+        }
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief take over from the running daemon. Called before any tree is created
+ * @return -ENOENT if there's no daemon to take over from
+ */
+tError takeOver( void )
+{
+    struct sockaddr_un address;
+
+    tError result = makeAddress( &address );
+    if ( result != 0 ) {
+        return result;
+    }
+
+    tFileDscr fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( fd == -1 ) {
+        return -errno;
+    }
+
+    logSetErrno( 0 );
+    if ( connect( fd, (struct sockaddr *)&address, sizeof( address ) ) == -1 ) {
+        result = ( errno == ECONNREFUSED ) ? -ENOENT : -errno;
+    } else {
+        logInfo( "waiting for the running daemon to hand over" );
+
+        tFileDscr inotify = -1;
+        result = receiveHandover( fd, &inotify );
+        if ( result == 0 ) {
+            result = adoptInotifyFd( inotify );
+        }
+        if ( result == 0 ) {
+            gTakeover.handed.done = true;
+            logInfo( "took over %u trees", gTakeover.handed.count );
+        } else {
+            if ( inotify != -1 ) close( inotify );
+            freeHandedTrees();
+        }
+    }
+    close( fd );
+
+    return result;
+}
+
+
+/**
+ * @brief
+ * @return true if we took over from a previous process
+ */
+bool tookOver( void )
+{
+    return gTakeover.handed.done;
+}
+
+
+/**
+ * @brief restore the tree as it was handed over, if it was
+ * @param watchedTree
+ * @return -ENOENT if it wasn't
+ */
+tError applyTakeover( tWatchedTree * watchedTree )
+{
+    for ( unsigned int i = 0; i < gTakeover.handed.count; ++i ) {
+        tHandedTree * handed = &gTakeover.handed.trees[ i ];
+        if ( handed->claimed || strcmp( handed->root, watchedTree->root.path ) != 0 ) continue;
+
+        handed->claimed = true;
+        tError result = applySnapshot( watchedTree, handed->snapshot, handed->length, handed->mask );
+        if ( result != 0 ) {
+            logWarning( "unable to take over \'%s\', so it will be scanned deeply", watchedTree->root.path );
+            logSetErrno( 0 );
+        } else if ( handed->mask != watchedTree->inotify.mask ) {
+            logInfo( "\'%s\' is now watched for 0x%08x, rather than 0x%08x",
+                     watchedTree->root.path, watchedTree->inotify.mask, handed->mask );
+        }
+        return result;
+    }
+    return -ENOENT;
+}
+
+
+/**
+ * @brief once every tree has been created, stop watching the ones that were
+ * handed over but are no longer configured
+ */
+void finishTakeover( void )
+{
+    for ( unsigned int i = 0; i < gTakeover.handed.count; ++i ) {
+        tHandedTree * handed = &gTakeover.handed.trees[ i ];
+        if ( !handed->claimed ) {
+            logInfo( "\'%s\' is no longer configured, so it is no longer watched", handed->root );
+            dropSnapshotWatches( handed->snapshot, handed->length );
+        }
+    }
+    freeHandedTrees();
+}
@@ -0,0 +1,44 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_TAKEOVER_H
+#define PROCESSNEWFILES_TAKEOVER_H
+
+#include <stdint.h>
+
+/*
+ * A new process started with '--takeover' replaces the running daemon
+ * without dropping its watches. It connects to the daemon's socket,
+ * '/tmp/<exe>/<exe>.sock', and the daemon stops starting anything new. Once
+ * its children have exited and its scans have finished, it closes its state
+ * stores and hands over the inotify instance (as SCM_RIGHTS) along with a
+ * snapshot of each tree (see snapshot.h), then exits.
+ *
+ * The inotify instance keeps its watches, and queues events for them
+ * throughout, so none are missed. As the new process creates each tree, it
+ * takes over the tree's directory nodes from the snapshot, rather than
+ * watching and scanning the whole tree again. A tree whose events mask has
+ * changed is re-watched through the same instance, which just updates each
+ * watch's mask. A tree that's no longer configured has its watches removed.
+ *
+ * If the new process goes away while the daemon is winding down, or the
+ * handover fails, the daemon carries on as before, and listens for another.
+ * A new process that wasn't handed everything starts the usual way.
+ */
+
+/* the running daemon's side */
+tError listenForTakeover( uint64_t epollData, uint64_t peerData );
+tError acceptTakeover( void );
+tError takeoverPeerGone( void );
+bool   takeoverPending( void );
+tError handOver( void );
+void   closeTakeover( void );
+
+/* the new process's side */
+tError takeOver( void );
+bool   tookOver( void );
+tError applyTakeover( tWatchedTree * watchedTree );
+void   finishTakeover( void );
+
+#endif //PROCESSNEWFILES_TAKEOVER_H
@@ -0,0 +1,297 @@
+//
+// Created by paul on 10/16/26.
+//
+
+#include "processNewFiles.h"
+#include "events.h"
+#include "timerWheel.h"
+
+
+/**
+ * @brief the level a deadline belongs in, relative to the current tick
+ * i.e. the highest group of kTimerWheelBits where the two differ.
+ * @param wheel
+ * @param at
+ * @return
+ */
+static unsigned int levelFor( const tTimerWheel * wheel, tTick at )
+{
+    tTick diff = at ^ wheel->current;
+    unsigned int level = 0;
+
+    diff >>= kTimerWheelBits;
+    while ( diff != 0 && level < kTimerWheelLevels - 1 ) {
+        diff >>= kTimerWheelBits;
+        ++level;
+    }
+    return level;
+}
+
+
+static inline unsigned int slotFor( tTick at, unsigned int level )
+{
+    return (unsigned int)(at >> (level * kTimerWheelBits)) & (kTimerWheelSlots - 1);
+}
+
+
+/**
+ * @brief link the node into the slot matching node->expires.filed
+ * @param wheel
+ * @param node
+ */
+static void fileNode( tTimerWheel * wheel, tFSNode * node )
+{
+    tTick at = node->expires.filed;
+
+    if ( at > wheel->current ) {
+        /* too far in the future for the wheel to represent? Then park it at the
+         * furthest point it can, and it'll be filed again when that comes up */
+        const tTick span = ~(tTick)0 >> (64 - kTimerWheelLevels * kTimerWheelBits);
+        if ( (at & ~span) != (wheel->current & ~span) ) {
+            at = wheel->current | span;
+            node->expires.filed = at;
+        }
+    }
+
+    if ( at <= wheel->current ) {
+        listAppend( &wheel->due, &node->queue );
+    } else {
+        unsigned int level = levelFor( wheel, at );
+        unsigned int slot  = slotFor( at, level );
+        listAppend( &wheel->slot[ level ][ slot ], &node->queue );
+        wheel->occupied[ level ] |= (uint64_t)1 << slot;
+    }
+}
+
+
+/**
+ * @brief
+ * @param now
+ * @return
+ */
+tTimerWheel * newTimerWheel( tTick now )
+{
+    tTimerWheel * wheel = calloc( 1, sizeof( tTimerWheel ) );
+    if ( wheel != NULL ) {
+        wheel->current = now;
+        for ( unsigned int level = 0; level < kTimerWheelLevels; ++level ) {
+            for ( unsigned int slot = 0; slot < kTimerWheelSlots; ++slot ) {
+                listInit( &wheel->slot[ level ][ slot ] );
+            }
+        }
+        listInit( &wheel->due );
+    }
+    return wheel;
+}
+
+
+/**
+ * @brief the nodes themselves are not freed, they're just no longer in the wheel
+ * @param wheel
+ */
+void freeTimerWheel( tTimerWheel * wheel )
+{
+    free( wheel );
+}
+
+
+/**
+ * @brief file the node to expire at node->expires.at
+ * If it's already in the wheel with an earlier deadline, it's left where it
+ * is, and moved when that deadline comes around.
+ * @param wheel
+ * @param node
+ */
+void timerWheelAdd( tTimerWheel * wheel, tFSNode * node )
+{
+    tTick at = node->expires.at;
+
+    if ( node->expires.filed != 0 ) {
+        if ( node->expires.filed <= at ) {
+            /* deadline was bumped later - handled lazily */
+            return;
+        }
+        timerWheelRemove( wheel, node );
+    }
+
+    node->expires.filed = at;
+    fileNode( wheel, node );
+    ++wheel->count;
+}
+
+
+/**
+ * @brief
+ * @param wheel
+ * @param node
+ */
+void timerWheelRemove( tTimerWheel * wheel, tFSNode * node )
+{
+    tTick at = node->expires.filed;
+    if ( at == 0 ) return;
+
+    listRemove( &node->queue );
+    node->expires.filed = 0;
+    --wheel->count;
+
+    if ( at > wheel->current ) {
+        unsigned int level = levelFor( wheel, at );
+        unsigned int slot  = slotFor( at, level );
+        if ( listAtEnd( &wheel->slot[ level ][ slot ], listStart( &wheel->slot[ level ][ slot ] ) ) ) {
+            wheel->occupied[ level ] &= ~((uint64_t)1 << slot);
+        }
+    }
+}
+
+
+/**
+ * @brief the tick at which the next occupied slot (at any level) starts
+ * @param wheel
+ * @return the tick, or UINT64_MAX if the wheel is empty
+ */
+static tTick nextSlotStart( const tTimerWheel * wheel )
+{
+    tTick next = UINT64_MAX;
+
+    for ( unsigned int level = 0; level < kTimerWheelLevels; ++level ) {
+        unsigned int shift   = level * kTimerWheelBits;
+        unsigned int current = slotFor( wheel->current, level );
+
+        /* only the slots after the current one in this rotation of the level */
+        uint64_t pending = 0;
+        if ( current < kTimerWheelSlots - 1 ) {
+            pending = wheel->occupied[ level ] & (~(uint64_t)0 << (current + 1));
+        }
+        if ( pending != 0 ) {
+            tTick start = (wheel->current >> (shift + kTimerWheelBits)) << (shift + kTimerWheelBits);
+            start |= (tTick)__builtin_ctzll( pending ) << shift;
+            if ( start < next ) {
+                next = start;
+            }
+        }
+    }
+
+    return next;
+}
+
+
+/**
+ * @brief a node's slot has come up. Either it has expired, or its
+ * deadline was moved later since it was filed, so file it again
+ * @param wheel
+ * @param node
+ * @param expired
+ */
+static void slotReached( tTimerWheel * wheel, tFSNode * node, tListRoot * expired )
+{
+    listRemove( &node->queue );
+
+    if ( node->expires.at > wheel->current ) {
+        node->expires.filed = node->expires.at;
+        fileNode( wheel, node );
+    } else {
+        node->expires.filed = 0;
+        --wheel->count;
+        listAppend( expired, &node->queue );
+    }
+}
+
+
+/**
+ * @brief deal with the nodes on the due list
+ * The list is detached first, as a node parked at the very end of the
+ * wheel's range may be put straight back on it.
+ * @param wheel
+ * @param expired
+ */
+static void drainDue( tTimerWheel * wheel, tListRoot * expired )
+{
+    tListRoot pending;
+
+    if ( listAtEnd( &wheel->due, listStart( &wheel->due ) ) ) return;
+
+    pending.next = wheel->due.next;
+    pending.prev = wheel->due.prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    listInit( &wheel->due );
+
+    tFSNode * node;
+    while ( !listAtEnd( &pending, node = (tFSNode *)listStart( &pending ) ) ) {
+        slotReached( wheel, node, expired );
+    }
+}
+
+
+/**
+ * @brief move every node whose deadline is at or before 'now' onto the expired list
+ * Only occupied slots are visited, so the cost is proportional to the number
+ * of nodes that expire (plus any cascading), not to the size of the wheel.
+ * @param wheel
+ * @param now
+ * @param expired list to append the expired nodes to
+ * @return
+ */
+tError timerWheelExpire( tTimerWheel * wheel, tTick now, tListRoot * expired )
+{
+    tFSNode * node;
+
+    drainDue( wheel, expired );
+
+    tTick next = nextSlotStart( wheel );
+    while ( next <= now ) {
+        wheel->current = next;
+
+        /* cascade the higher levels whose slots start at this tick, highest first */
+        for ( unsigned int level = kTimerWheelLevels - 1; level > 0; --level ) {
+            tTick mask = ((tTick)1 << (level * kTimerWheelBits)) - 1;
+            if ( (next & mask) == 0 ) {
+                unsigned int slot = slotFor( next, level );
+                tListRoot * list = &wheel->slot[ level ][ slot ];
+                wheel->occupied[ level ] &= ~((uint64_t)1 << slot);
+                while ( !listAtEnd( list, node = (tFSNode *)listStart( list ) ) ) {
+                    listRemove( &node->queue );
+                    /* pick up any deadline bump while we're moving it anyway */
+                    node->expires.filed = node->expires.at;
+                    fileNode( wheel, node );
+                }
+            }
+        }
+
+        unsigned int slot = slotFor( next, 0 );
+        tListRoot * list = &wheel->slot[ 0 ][ slot ];
+        wheel->occupied[ 0 ] &= ~((uint64_t)1 << slot);
+        while ( !listAtEnd( list, node = (tFSNode *)listStart( list ) ) ) {
+            slotReached( wheel, node, expired );
+        }
+
+        /* anything cascaded down that turned out to be due already */
+        drainDue( wheel, expired );
+
+        next = nextSlotStart( wheel );
+    }
+
+    if ( wheel->current < now ) {
+        wheel->current = now;
+        /* if we just crossed into the wheel's next rotation, nodes parked at its end can now be filed */
+        drainDue( wheel, expired );
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief the earliest tick at which timerWheelExpire() may have work to do
+ * For the lowest level this is the exact deadline. For higher levels, it's
+ * the start of the slot, when the nodes in it will be cascaded to a lower level.
+ * @param wheel
+ * @return the tick, or UINT64_MAX if the wheel is empty
+ */
+tTick timerWheelNext( const tTimerWheel * wheel )
+{
+    if ( !listAtEnd( &wheel->due, listStart( (tListRoot *)&wheel->due ) ) ) {
+        return wheel->current;
+    }
+    return nextSlotStart( wheel );
+}
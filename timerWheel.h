@@ -0,0 +1,43 @@
+//
+// Created by paul on 10/16/26.
+//
+
+#ifndef PROCESSNEWFILES_TIMERWHEEL_H
+#define PROCESSNEWFILES_TIMERWHEEL_H
+
+#include <stdint.h>
+
+/*
+ * A hierarchical timing wheel. Each level has 64 slots, so a single 64-bit
+ * word records which of a level's slots are occupied. A slot at level N
+ * covers 64^N ticks. A node is filed in the lowest level where its deadline
+ * shares all the higher-order slot indices with the current tick, and is
+ * cascaded down a level when the wheel reaches the start of its slot.
+ *
+ * Deadlines that move later don't re-link the node; it's filed again when
+ * the slot it's in comes up. So a stream of IN_MODIFY events costs O(1).
+ */
+
+#define kTimerWheelBits     6
+#define kTimerWheelSlots    (1 << kTimerWheelBits)
+#define kTimerWheelLevels   6
+
+typedef uint64_t tTick;
+
+typedef struct sTimerWheel {
+    tTick           current;    // every deadline at or before this tick has been expired
+    unsigned int    count;      // number of nodes in the wheel
+    uint64_t        occupied[ kTimerWheelLevels ];
+    tListRoot       slot[ kTimerWheelLevels ][ kTimerWheelSlots ];
+    tListRoot       due;        // nodes whose deadline had already passed when they were filed
+} tTimerWheel;
+
+tTimerWheel * newTimerWheel( tTick now );
+void   freeTimerWheel( tTimerWheel * wheel );
+
+void   timerWheelAdd( tTimerWheel * wheel, tFSNode * node );
+void   timerWheelRemove( tTimerWheel * wheel, tFSNode * node );
+tError timerWheelExpire( tTimerWheel * wheel, tTick now, tListRoot * expired );
+tTick  timerWheelNext( const tTimerWheel * wheel );
+
+#endif //PROCESSNEWFILES_TIMERWHEEL_H
@@ -0,0 +1,169 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "events.h"
+#include "uring.h"
+
+#ifdef USE_IO_URING
+
+/**
+ * @brief
+ * @param ring
+ * @param entries
+ * @return -ENOSYS (or whatever the kernel said) if io_uring isn't available
+ */
+tError ringInit( tRing * ring, unsigned int entries )
+{
+    struct io_uring_params params;
+
+    memset( ring, 0, sizeof( tRing ) );
+    memset( &params, 0, sizeof( params ) );
+
+    ring->fd = (tFileDscr)syscall( __NR_io_uring_setup, entries, &params );
+    if ( ring->fd == -1 ) {
+        return -errno;
+    }
+    /* don't bother with kernels old enough to need the rings mapped separately (pre-5.4) */
+    if ( !(params.features & IORING_FEAT_SINGLE_MMAP) ) {
+        close( ring->fd );
+        return -ENOSYS;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof( unsigned int );
+    size_t cqSize = params.cq_off.cqes  + params.cq_entries * sizeof( struct io_uring_cqe );
+    ring->ringsSize = ( sqSize > cqSize ) ? sqSize : cqSize;
+    ring->sqesSize  = params.sq_entries * sizeof( struct io_uring_sqe );
+
+    ring->rings = mmap( NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING );
+    void * sqes = mmap( NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQES );
+    if ( ring->rings == MAP_FAILED || sqes == MAP_FAILED ) {
+        tError result = -errno;
+        if ( ring->rings != MAP_FAILED ) munmap( ring->rings, ring->ringsSize );
+        if ( sqes != MAP_FAILED )        munmap( sqes, ring->sqesSize );
+        close( ring->fd );
+        return result;
+    }
+
+    char * rings = ring->rings;
+    ring->sq.head  = (unsigned int *)(rings + params.sq_off.head);
+    ring->sq.tail  = (unsigned int *)(rings + params.sq_off.tail);
+    ring->sq.array = (unsigned int *)(rings + params.sq_off.array);
+    ring->sq.mask  = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    ring->sq.sqes  = sqes;
+    ring->cq.head  = (unsigned int *)(rings + params.cq_off.head);
+    ring->cq.tail  = (unsigned int *)(rings + params.cq_off.tail);
+    ring->cq.mask  = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    ring->cq.cqes  = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    ring->entries  = params.sq_entries;
+    ring->sqTail   = *ring->sq.tail;
+
+    return 0;
+}
+
+
+/**
+ * @brief anything still queued or in flight is abandoned
+ * @param ring
+ */
+void ringFree( tRing * ring )
+{
+    munmap( ring->sq.sqes, ring->sqesSize );
+    munmap( ring->rings, ring->ringsSize );
+    close( ring->fd );
+    memset( ring, 0, sizeof( tRing ) );
+    ring->fd = -1;
+}
+
+
+/**
+ * @brief
+ * @param ring
+ * @return how many more sqes can be queued before the ring has to be submitted
+ */
+unsigned int ringSpace( const tRing * ring )
+{
+    return ring->entries - (ring->sqTail - __atomic_load_n( ring->sq.head, __ATOMIC_ACQUIRE ));
+}
+
+
+/**
+ * @brief the next free sqe, cleared
+ * @param ring
+ * @return NULL if the submission queue is full
+ */
+struct io_uring_sqe * ringGetSqe( tRing * ring )
+{
+    if ( ringSpace( ring ) == 0 ) {
+        return NULL;
+    }
+    unsigned int index = ring->sqTail++ & ring->sq.mask;
+    ring->sq.array[ index ] = index;
+
+    struct io_uring_sqe * sqe = &ring->sq.sqes[ index ];
+    memset( sqe, 0, sizeof( struct io_uring_sqe ) );
+    return sqe;
+}
+
+
+/**
+ * @brief hand everything queued to the kernel
+ * @param ring
+ * @param waitFor how many completions to wait for
+ * @return
+ */
+tError ringSubmit( tRing * ring, unsigned int waitFor )
+{
+    /* make the sqes visible to the kernel before the new tail is */
+    __atomic_store_n( ring->sq.tail, ring->sqTail, __ATOMIC_RELEASE );
+
+    unsigned int pending = ring->sqTail - __atomic_load_n( ring->sq.head, __ATOMIC_ACQUIRE );
+    if ( pending == 0 && waitFor == 0 ) {
+        return 0;
+    }
+
+    int submitted = (int)syscall( __NR_io_uring_enter, ring->fd, pending, waitFor,
+                                  waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+    if ( submitted == -1 ) {
+        return -errno;
+    }
+    ring->inFlight += submitted;
+
+    return 0;
+}
+
+
+/**
+ * @brief
+ * @param ring
+ * @return the oldest completion that hasn't been seen yet, or NULL if there are none
+ */
+struct io_uring_cqe * ringNextCqe( tRing * ring )
+{
+    unsigned int head = *ring->cq.head;
+    if ( head == __atomic_load_n( ring->cq.tail, __ATOMIC_ACQUIRE ) ) {
+        return NULL;
+    }
+    return &ring->cq.cqes[ head & ring->cq.mask ];
+}
+
+
+/**
+ * @brief let the kernel reuse the completion ringNextCqe() returned
+ * @param ring
+ */
+void ringCqeSeen( tRing * ring )
+{
+    __atomic_store_n( ring->cq.head, *ring->cq.head + 1, __ATOMIC_RELEASE );
+    --ring->inFlight;
+}
+
+
+#endif //USE_IO_URING
@@ -0,0 +1,55 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_URING_H
+#define PROCESSNEWFILES_URING_H
+
+/*
+ * An optional io_uring submission layer, used when built with USE_IO_URING.
+ * It talks to the kernel directly, so it doesn't need liburing.
+ *
+ * The scans use a private ring each, to stat a directory's files in batches.
+ *
+ * If the kernel won't set up a ring (too old, or io_uring is disabled),
+ * everything quietly falls back to the usual synchronous calls.
+ */
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+
+typedef struct {
+    tFileDscr       fd;
+    struct {
+        unsigned int *          head;
+        unsigned int *          tail;
+        unsigned int *          array;
+        unsigned int            mask;
+        struct io_uring_sqe *   sqes;
+    } sq;
+    struct {
+        unsigned int *          head;
+        unsigned int *          tail;
+        unsigned int            mask;
+        struct io_uring_cqe *   cqes;
+    } cq;
+    unsigned int    entries;
+    unsigned int    sqTail;     // where the next sqe goes. The kernel sees it on the next submit
+    unsigned int    inFlight;   // submitted, but their completions haven't been seen yet
+    void *          rings;
+    size_t          ringsSize;
+    size_t          sqesSize;
+} tRing;
+
+tError ringInit( tRing * ring, unsigned int entries );
+void   ringFree( tRing * ring );
+unsigned int ringSpace( const tRing * ring );
+struct io_uring_sqe * ringGetSqe( tRing * ring );
+tError ringSubmit( tRing * ring, unsigned int waitFor );
+struct io_uring_cqe * ringNextCqe( tRing * ring );
+void   ringCqeSeen( tRing * ring );
+
+#endif //USE_IO_URING
+
+#endif //PROCESSNEWFILES_URING_H
@@ -0,0 +1,74 @@
+//
+// Created by paul on 10/16/26.
+//
+
+#include "processNewFiles.h"
+#include "events.h"
+#include "watchTable.h"
+
+#define kWatchTableMinSize  64
+
+
+tWatchTable * newWatchTable( void )
+{
+    return calloc( 1, sizeof( tWatchTable ) );
+}
+
+void freeWatchTable( tWatchTable * table )
+{
+    if ( table != NULL ) {
+        free( table->nodes );
+        free( table );
+    }
+}
+
+/**
+ * @brief record the node for a watchID, growing the table if necessary
+ * @param table
+ * @param watchID
+ * @param node
+ * @return 0 on success, or a negative errno
+ */
+tError watchTableAdd( tWatchTable * table, tWatchID watchID, tFSNode * node )
+{
+    if ( watchID < 0 ) return -EINVAL;
+
+    if ( watchID >= table->size ) {
+        tWatchID newSize = ( table->size > 0 ) ? table->size : kWatchTableMinSize;
+        while ( newSize <= watchID ) {
+            newSize *= 2;
+        }
+        tFSNode ** nodes = realloc( table->nodes, newSize * sizeof( tFSNode * ) );
+        if ( nodes == NULL ) {
+            return -ENOMEM;
+        }
+        // realloc() does not clear the additional entries
+        memset( &nodes[ table->size ], 0, (newSize - table->size) * sizeof( tFSNode * ) );
+        table->nodes = nodes;
+        table->size  = newSize;
+    }
+
+    if ( table->nodes[ watchID ] == NULL ) {
+        ++table->count;
+    }
+    table->nodes[ watchID ] = node;
+
+    return 0;
+}
+
+/**
+ * @brief forget the node for a watchID, when we remove its watch or its
+ * IN_IGNORED arrives. The kernel can hand the watchID out again once the
+ * watch has gone, but events are read in order, so the slot is cleared
+ * before any reuse can be seen. The table never shrinks, as the kernel
+ * may well hand out a similar watchID.
+ * @param table
+ * @param watchID
+ */
+void watchTableRemove( tWatchTable * table, tWatchID watchID )
+{
+    if ( watchID >= 0 && watchID < table->size && table->nodes[ watchID ] != NULL ) {
+        table->nodes[ watchID ] = NULL;
+        --table->count;
+    }
+}
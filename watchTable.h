@@ -0,0 +1,33 @@
+//
+// Created by paul on 10/16/26.
+//
+
+#ifndef PROCESSNEWFILES_WATCHTABLE_H
+#define PROCESSNEWFILES_WATCHTABLE_H
+
+/*
+ * inotify hands out watch descriptors as small integers, mostly in
+ * ascending order, and reuses one only once its watch has gone (and its
+ * IN_IGNORED has been queued). So rather than hash them, use them to index
+ * an array of node pointers directly. The array grows as higher watchIDs
+ * appear.
+ */
+
+typedef struct {
+    tFSNode **      nodes;      // indexed by watchID, NULL if not in use
+    tWatchID        size;       // number of entries allocated
+    unsigned int    count;      // number of entries in use
+} tWatchTable;
+
+tWatchTable * newWatchTable( void );
+void   freeWatchTable( tWatchTable * table );
+tError watchTableAdd( tWatchTable * table, tWatchID watchID, tFSNode * node );
+void   watchTableRemove( tWatchTable * table, tWatchID watchID );
+
+static inline tFSNode * watchTableFind( const tWatchTable * table, tWatchID watchID )
+{
+    if ( watchID < 0 || watchID >= table->size ) return NULL;
+    return table->nodes[ watchID ];
+}
+
+#endif //PROCESSNEWFILES_WATCHTABLE_H
@@ -0,0 +1,422 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#include "processNewFiles.h"
+
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "events.h"
+#include "execTemplate.h"
+#include "forkServer.h"
+#include "worker.h"
+
+/* a worker that has gone, but hasn't been reaped yet */
+typedef struct {
+    pid_t       pid;
+    tFileDscr   pidfd;      // tells epoll when it exits (-1 if unavailable, so only SIGCHLD does)
+} tGoneWorker;
+
+static struct {
+    uint64_t    epollData;  // for the workers' stdout, and their pidfds once they've gone
+    struct {
+        tGoneWorker *   workers;
+        unsigned int    count;
+        unsigned int    size;
+    } gone;
+} gWorkers;
+
+
+/**
+ * @brief remember what epoll is to tag the workers' replies with
+ * @param epollData
+ * @return
+ */
+tError registerForWorkerEvents( uint64_t epollData )
+{
+    gWorkers.epollData = epollData;
+    return 0;
+}
+
+
+/**
+ * @brief
+ * @param count the most workers it will run at once
+ * @return NULL if we're out of memory
+ */
+tWorkerPool * newWorkerPool( unsigned int count )
+{
+    tWorkerPool * pool = calloc( 1, sizeof( tWorkerPool ) + count * sizeof( tWorker ) );
+    if ( pool != NULL ) {
+        pool->count = count;
+        for ( unsigned int i = 0; i < count; ++i ) {
+            pool->workers[ i ].in  = -1;
+            pool->workers[ i ].out = -1;
+        }
+    }
+    return pool;
+}
+
+
+/**
+ * @brief start a worker, with pipes for its stdin and stdout
+ * @param watchedTree
+ * @param worker
+ * @return
+ */
+static tError startWorker( tWatchedTree * watchedTree, tWorker * worker )
+{
+    tError    result;
+    tFileDscr in[2];
+    tFileDscr out[2];
+
+    if ( pipe2( in, O_CLOEXEC ) == -1 ) {
+        logError( "unable to create a pipe for a worker" );
+        return -errno;
+    }
+    if ( pipe2( out, O_CLOEXEC ) == -1 ) {
+        result = -errno;
+        logError( "unable to create a pipe for a worker" );
+        close( in[0] );
+        close( in[1] );
+        return result;
+    }
+
+    /* it isn't for any one file, so only the tree is set */
+    tExecValue values[ kExecValueCount ];
+    for ( tExecValueId value = 0; value < kExecValueCount; ++value ) {
+        values[ value ] = execString( "" );
+    }
+    values[ kExecTree ] = execString( watchedTree->root.path );
+
+    char ** argv = buildExecArgv( watchedTree->command, values );
+    char ** envp = buildExecEnv( watchedTree->command, values );
+
+    /* dup2() clears FD_CLOEXEC on the copies, so the worker keeps them */
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    posix_spawn_file_actions_adddup2( &actions, in[0],  STDIN_FILENO );
+    posix_spawn_file_actions_adddup2( &actions, out[1], STDOUT_FILENO );
+
+    pid_t pid = 0;
+    if ( argv == NULL || envp == NULL ) {
+        result = -ENOMEM;
+    } else {
+        result = spawnChild( &pid, argv, envp, &actions );
+    }
+    posix_spawn_file_actions_destroy( &actions );
+    close( in[0] );
+    close( out[1] );
+
+    if ( result == 0 ) {
+        /* neither can be allowed to block the event loop */
+        fcntl( in[1],  F_SETFL, O_NONBLOCK );
+        fcntl( out[0], F_SETFL, O_NONBLOCK );
+        result = registerFdToEpoll( out[0], gWorkers.epollData );
+    }
+
+    if ( result != 0 ) {
+        logSetErrno( -result );
+        logError( "unable to start a worker for \'%s\'", watchedTree->root.path );
+        logSetErrno( 0 );
+        close( in[1] );
+        close( out[0] );
+        if ( pid != 0 ) {
+            kill( pid, SIGKILL );
+            waitpid( pid, NULL, 0 );
+        }
+        return result;
+    }
+
+    worker->pid  = pid;
+    worker->in   = in[1];
+    worker->out  = out[0];
+    worker->node = NULL;
+    worker->used = 0;
+    logInfo( "[%d] started a worker for \'%s\'", pid, watchedTree->root.path );
+
+    return 0;
+}
+
+
+/**
+ * @brief collect a worker's exit status, if it has exited
+ * @param pid
+ * @return true if it has been reaped
+ */
+static bool reapWorker( pid_t pid )
+{
+    siginfo_t info;
+    info.si_pid = 0;
+    if ( waitid( P_PID, pid, &info, WEXITED | WNOHANG ) == -1 ) {
+        /* it isn't our child any more, so there's nothing to wait for */
+        logSetErrno( 0 );
+        return true;
+    }
+    if ( info.si_pid == 0 ) {
+        return false;
+    }
+
+    if ( info.si_code == CLD_EXITED ) {
+        logWarning( "[%d] worker exited with status %d", pid, info.si_status );
+    } else if ( info.si_status != SIGKILL ) {
+        logWarning( "[%d] worker was terminated by signal %d", pid, info.si_status );
+    }
+    logSetErrno( 0 );
+    return true;
+}
+
+
+/**
+ * @brief reap any workers that have gone, and since exited. Only those
+ * without a pidfd need SIGCHLD to tell us they have
+ */
+void reapWorkers( void )
+{
+    for ( unsigned int i = 0; i < gWorkers.gone.count; ) {
+        tGoneWorker * gone = &gWorkers.gone.workers[ i ];
+        if ( !reapWorker( gone->pid ) ) {
+            ++i;
+            continue;
+        }
+        /* closing it also removes it from the epoll set */
+        if ( gone->pidfd != -1 ) close( gone->pidfd );
+        *gone = gWorkers.gone.workers[ --gWorkers.gone.count ];
+    }
+}
+
+
+/**
+ * @brief the worker has exited, or stopped listening. Make sure it goes,
+ * and retry the file it had, if any. It isn't waited for, as it may be
+ * stuck where even SIGKILL can't reach it (e.g. in uninterruptible I/O),
+ * but reaped once it has exited
+ * @param worker
+ */
+static void workerGone( tWorker * worker )
+{
+    /* closing it also removes it from the epoll set */
+    close( worker->in );
+    close( worker->out );
+    worker->in  = -1;
+    worker->out = -1;
+
+    kill( worker->pid, SIGKILL );   // in case it's still running
+    if ( !reapWorker( worker->pid ) ) {
+        if ( gWorkers.gone.count >= gWorkers.gone.size ) {
+            unsigned int  size    = ( gWorkers.gone.size > 0 ) ? gWorkers.gone.size * 2 : 4;
+            tGoneWorker * workers = realloc( gWorkers.gone.workers, size * sizeof( tGoneWorker ) );
+            if ( workers != NULL ) {
+                gWorkers.gone.workers = workers;
+                gWorkers.gone.size    = size;
+            }
+        }
+        if ( gWorkers.gone.count < gWorkers.gone.size ) {
+            tGoneWorker * gone = &gWorkers.gone.workers[ gWorkers.gone.count++ ];
+            gone->pid   = worker->pid;
+            gone->pidfd = (tFileDscr)syscall( SYS_pidfd_open, worker->pid, 0 );
+            if ( gone->pidfd != -1 && registerFdToEpoll( gone->pidfd, gWorkers.epollData ) != 0 ) {
+                close( gone->pidfd );
+                gone->pidfd = -1;
+            }
+            logSetErrno( 0 );
+        } else {
+            logError( "[%d] unable to keep track of the worker until it exits", worker->pid );
+        }
+    }
+
+    tFSNode * node = worker->node;
+    worker->node = NULL;
+    if ( node != NULL ) {
+        logInfo( "[%d] worker went before it replied about \'%s\'", worker->pid, node->relPath );
+        siginfo_t info = { .si_pid = worker->pid, .si_code = CLD_EXITED, .si_status = 1 };
+        childExited( node, &info );
+    }
+}
+
+
+/**
+ * @brief send the file to an idle worker, starting one if need be
+ * @param fileNode
+ * @return
+ */
+tError sendToWorker( tFSNode * fileNode )
+{
+    tWatchedTree * watchedTree = fileNode->watchedTree;
+    tWorkerPool *  pool        = watchedTree->workers;
+
+    /* a request is never bigger than PIPE_BUF, so as a worker only has one at a time,
+     * the write to its (empty) pipe is never split, and never blocks */
+    size_t length = strlen( fileNode->path );
+    if ( length + 1 > PIPE_BUF || strchr( fileNode->path, '\n' ) != NULL ) {
+        logError( "\'%s\' can't be sent to a worker as a line", fileNode->relPath );
+        return -EINVAL;
+    }
+
+    tWorker * worker = NULL;
+    tWorker * unused = NULL;
+    for ( unsigned int i = 0; i < pool->count && worker == NULL; ++i ) {
+        tWorker * candidate = &pool->workers[ i ];
+        if ( candidate->in == -1 ) {
+            if ( unused == NULL ) unused = candidate;
+        } else if ( candidate->node == NULL ) {
+            worker = candidate;
+        }
+    }
+    if ( worker == NULL ) {
+        if ( unused == NULL ) {
+            /* dispatchReadyNodes() keeps to the tree's limit, so this shouldn't happen */
+            logError( "(Internal) no worker is free for \'%s\'", fileNode->relPath );
+            return -EBUSY;
+        }
+        tError result = startWorker( watchedTree, unused );
+        if ( result != 0 ) {
+            return result;
+        }
+        worker = unused;
+    }
+
+    char line[ PIPE_BUF ];
+    memcpy( line, fileNode->path, length );
+    line[ length++ ] = '\n';
+
+    ssize_t written = write( worker->in, line, length );
+    if ( written != (ssize_t)length ) {
+        tError result = ( written == -1 ) ? -errno : -EIO;
+        logError( "[%d] unable to send \'%s\' to the worker", worker->pid, fileNode->relPath );
+        logSetErrno( 0 );
+        workerGone( worker );
+        return result;
+    }
+    logDebug( "[%d] sent \'%s\' to the worker", worker->pid, fileNode->relPath );
+
+    worker->node = fileNode;
+    fileNode->child.pid    = worker->pid;
+    fileNode->child.pidfd  = -1;
+    fileNode->child.worker = worker;
+
+    return 0;
+}
+
+
+/**
+ * @brief a worker has replied about the file it was sent
+ * @param worker
+ * @param line without its newline
+ */
+static void workerReplied( tWorker * worker, const char * line )
+{
+    tFSNode * node = worker->node;
+    if ( node == NULL ) {
+        logWarning( "[%d] worker said \'%s\' when it hadn't been sent anything", worker->pid, line );
+        return;
+    }
+    worker->node = NULL;
+
+    char * end;
+    long status = strtol( line, &end, 10 );
+    if ( end == line ) {
+        logWarning( "[%d] worker replied \'%s\' about \'%s\', which doesn't start with a status",
+                    worker->pid, line, node->relPath );
+        status = 1;
+    } else if ( *end != '\0' ) {
+        logInfo( "[%d] \'%s\':%s", worker->pid, node->relPath, end );
+    }
+
+    siginfo_t info = { .si_pid = worker->pid, .si_code = CLD_EXITED, .si_status = (int)status };
+    childExited( node, &info );
+}
+
+
+/**
+ * @brief read what a worker has to say, a line at a time
+ * @param worker
+ */
+static void readReplies( tWorker * worker )
+{
+    for (;;) {
+        ssize_t length = read( worker->out, &worker->reply[ worker->used ], sizeof( worker->reply ) - 1 - worker->used );
+        if ( length == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+            logSetErrno( 0 );
+            return;
+        }
+        if ( length == -1 && errno == EINTR ) {
+            continue;
+        }
+        if ( length <= 0 ) {
+            workerGone( worker );
+            return;
+        }
+        worker->used += (size_t)length;
+
+        char * start = worker->reply;
+        char * end   = worker->reply + worker->used;
+        char * newline;
+        while ( ( newline = memchr( start, '\n', (size_t)(end - start) ) ) != NULL ) {
+            *newline = '\0';
+            workerReplied( worker, start );
+            start = newline + 1;
+        }
+        worker->used = (size_t)(end - start);
+        if ( worker->used == sizeof( worker->reply ) - 1 ) {
+            /* it's too long to be a status line, so take what there is */
+            worker->reply[ worker->used ] = '\0';
+            workerReplied( worker, worker->reply );
+            worker->used = 0;
+        } else {
+            memmove( worker->reply, start, worker->used );
+        }
+    }
+}
+
+
+/**
+ * @brief epoll says one or more of the workers have replied, or gone, or
+ * exited since. There are only ever a handful, so check all of them
+ * @return
+ */
+tError processWorkerEvents( void )
+{
+    reapWorkers();
+
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        tWorkerPool * pool = watchedTree->workers;
+        if ( pool == NULL ) continue;
+
+        for ( unsigned int i = 0; i < pool->count; ++i ) {
+            if ( pool->workers[ i ].out != -1 ) {
+                readReplies( &pool->workers[ i ] );
+            }
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief close every worker's stdin, which tells it to exit. They aren't
+ * waited for: they finish in their own time
+ */
+void stopWorkers( void )
+{
+    tWatchedTree * watchedTree;
+    listForEachEntry( g.treeList, watchedTree )
+    {
+        tWorkerPool * pool = watchedTree->workers;
+        if ( pool == NULL ) continue;
+
+        for ( unsigned int i = 0; i < pool->count; ++i ) {
+            tWorker * worker = &pool->workers[ i ];
+            if ( worker->in != -1 ) {
+                close( worker->in );
+                close( worker->out );
+                worker->in  = -1;
+                worker->out = -1;
+            }
+        }
+    }
+}
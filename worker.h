@@ -0,0 +1,55 @@
+//
+// Created by paul on 10/17/26.
+//
+
+#ifndef PROCESSNEWFILES_WORKER_H
+#define PROCESSNEWFILES_WORKER_H
+
+#include <stdint.h>
+
+/*
+ * A tree configured with 'worker = "..."' rather than 'exec' doesn't start a
+ * child for each file. Instead it keeps up to 'jobs' long-lived workers
+ * running (or the global limit, if the tree doesn't set one), started as
+ * they're needed, so handlers that are expensive to start only pay for it
+ * once.
+ *
+ * Each file is sent to an idle worker as its full path, followed by a
+ * newline, on the worker's stdin. The worker replies with a line on its
+ * stdout, starting with a status: zero if the file was processed, otherwise
+ * it's retried, just as an exit status would be. Anything after the status
+ * is logged. A worker only has one file at a time.
+ *
+ * The worker line is compiled like an exec line (see execTemplate.h), with
+ * {tree} and $TREE set. The per-file values are empty, since it isn't for
+ * any one file. Its stdin and stdout are pipes, non-blocking at our end, and
+ * its stdout is read through epoll. A worker that exits is started again
+ * when it's next needed, and any file it had is retried. A worker knows to
+ * exit when its stdin is closed. One that stops listening is killed, and
+ * reaped once it has exited, so the event loop never waits for it.
+ */
+
+#define kWorkerMaxReply     1024
+
+typedef struct sWorker {
+    pid_t           pid;
+    tFileDscr       in;         // its stdin, which files are sent on (-1 if it isn't running)
+    tFileDscr       out;        // its stdout, which it replies on
+    tFSNode *       node;       // the file it's working on (NULL if it's idle)
+    size_t          used;       // of 'reply', which holds a partial line
+    char            reply[ kWorkerMaxReply ];
+} tWorker;
+
+typedef struct sWorkerPool {
+    unsigned int    count;
+    tWorker         workers[];
+} tWorkerPool;
+
+tError        registerForWorkerEvents( uint64_t epollData );
+tWorkerPool * newWorkerPool( unsigned int count );
+tError        sendToWorker( tFSNode * fileNode );
+tError        processWorkerEvents( void );
+void          reapWorkers( void );
+void          stopWorkers( void );
+
+#endif //PROCESSNEWFILES_WORKER_H